@@ -1,4 +1,12 @@
 #include "include/ast.hpp"
+#include "include/cache.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <fstream>
+#include <functional>
+#include <set>
+#include <sstream>
 
 using std::cout;
 using std::endl;
@@ -14,9 +22,15 @@ void IRGenContext::AddSymbol(const std::string &name, const Symbol &sym) {
 }
 
 Symbol *IRGenContext::FindSymbol(const std::string &name) {
-  for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
-    auto found = it->find(name);
-    if (found != it->end()) {
+  for (size_t i = scopes.size(); i > visible_from; --i) {
+    auto found = scopes[i - 1].find(name);
+    if (found != scopes[i - 1].end()) {
+      return &found->second;
+    }
+  }
+  if (visible_from > 0) {
+    auto found = scopes.front().find(name);
+    if (found != scopes.front().end()) {
       return &found->second;
     }
   }
@@ -41,9 +55,15 @@ void RiscvContext::AddSymbol(const std::string &name, const RiscvSymbol &sym) {
 }
 
 RiscvSymbol *RiscvContext::FindSymbol(const std::string &name) {
-  for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
-    auto found = it->find(name);
-    if (found != it->end()) {
+  for (size_t i = scopes.size(); i > visible_from; --i) {
+    auto found = scopes[i - 1].find(name);
+    if (found != scopes[i - 1].end()) {
+      return &found->second;
+    }
+  }
+  if (visible_from > 0) {
+    auto found = scopes.front().find(name);
+    if (found != scopes.front().end()) {
       return &found->second;
     }
   }
@@ -51,19 +71,30 @@ RiscvSymbol *RiscvContext::FindSymbol(const std::string &name) {
 }
 
 int RiscvContext::AllocSlot() {
+  int offset = out_args_size + stack_size;
   stack_size += 4;
-  return -(stack_size + 8);
+  return offset;
 }
 
 int RiscvContext::AllocArray(size_t count) {
-  int base = -(stack_size + 8 + static_cast<int>(count) * 4);
+  int base = out_args_size + stack_size;
   stack_size += static_cast<int>(count) * 4;
   return base;
 }
 
-void RiscvContext::Emit(const std::string &line) { body.push_back("  " + line); }
+void RiscvContext::Emit(const std::string &inst) {
+  if (options.debug_lines && line > 0 && line != loc_line) {
+    body.push_back("  .loc 1 " + std::to_string(line));
+    loc_line = line;
+  }
+  body.push_back("  " + inst);
+}
 
-void RiscvContext::EmitLabel(const std::string &label) { body.push_back(label + ":"); }
+// 标号之后的代码可能被移到别处或从别处跳来, 重新给出行号
+void RiscvContext::EmitLabel(const std::string &label) {
+  body.push_back(label + ":");
+  loc_line = 0;
+}
 
 std::string RiscvContext::NewLabel(const std::string &prefix) {
   if (!func_name.empty()) {
@@ -136,28 +167,133 @@ static void EmitLoadBase(RiscvContext &ctx, const std::string &reg,
   }
 }
 
+// 全局变量地址所在的寄存器: 序言里已经算好时直接用, 否则用 la 算进 scratch
+static std::string GlobalAddr(RiscvContext &ctx, const std::string &label,
+                              const std::string &scratch) {
+  for (const auto &entry : ctx.global_regs) {
+    if (entry.first == label) {
+      return entry.second;
+    }
+  }
+  ctx.Emit("la " + scratch + ", " + label);
+  return scratch;
+}
+
+static void LoadGlobalAddr(RiscvContext &ctx, const std::string &label, const std::string &reg) {
+  auto base = GlobalAddr(ctx, label, reg);
+  if (base != reg) {
+    ctx.Emit("mv " + reg + ", " + base);
+  }
+}
+
 static void LoadToReg(RiscvContext &ctx, const RiscvValue &val, const string &reg) {
   if (val.is_imm) {
     ctx.Emit("li " + reg + ", " + std::to_string(val.imm));
   } else if (val.is_ptr) {
     if (val.ptr_is_global) {
-      ctx.Emit("la " + reg + ", " + val.label);
+      LoadGlobalAddr(ctx, val.label, reg);
     } else if (val.ptr_is_stack_slot) {
-      EmitLoadBase(ctx, reg, "s0", val.offset);
+      ++ctx.reloads;
+      EmitLoadBase(ctx, reg, "sp", val.offset);
     } else {
-      EmitAddImm(ctx, reg, "s0", val.offset);
+      EmitAddImm(ctx, reg, "sp", val.offset);
     }
   } else {
-    EmitLoadBase(ctx, reg, "s0", val.offset);
+    ++ctx.reloads;
+    EmitLoadBase(ctx, reg, "sp", val.offset);
   }
 }
 
 static RiscvValue StoreFromReg(RiscvContext &ctx, const string &reg) {
+  ++ctx.spills;
   int offset = ctx.AllocSlot();
-  EmitStoreBase(ctx, reg, "s0", offset);
+  EmitStoreBase(ctx, reg, "sp", offset);
   return {false, 0, false, false, false, "", offset};
 }
 
+struct ParallelMove {
+  std::string dst_reg;  // 为空表示目标是 sp 上的栈槽
+  int dst_offset = 0;
+  RiscvValue src;
+  std::string src_reg;  // 非空表示源已经在该寄存器里
+};
+
+static bool MoveReads(const ParallelMove &move, const ParallelMove &dst) {
+  if (!dst.dst_reg.empty()) {
+    return move.src_reg == dst.dst_reg;
+  }
+  if (!move.src_reg.empty() || move.src.is_imm) {
+    return false;
+  }
+  bool reads_slot = !move.src.is_ptr || move.src.ptr_is_stack_slot;
+  return reads_slot && move.src.offset == dst.dst_offset;
+}
+
+static void EmitMove(RiscvContext &ctx, const ParallelMove &move) {
+  std::string reg = move.dst_reg.empty() ? "t0" : move.dst_reg;
+  if (!move.src_reg.empty()) {
+    if (move.dst_reg.empty()) {
+      reg = move.src_reg;
+    } else {
+      ctx.Emit("mv " + reg + ", " + move.src_reg);
+    }
+  } else if (move.src.is_imm && move.src.imm == 0 && move.dst_reg.empty()) {
+    reg = "x0";
+  } else {
+    LoadToReg(ctx, move.src, reg);
+  }
+  if (move.dst_reg.empty()) {
+    EmitStoreBase(ctx, reg, "sp", move.dst_offset);
+  }
+}
+
+// 把一组互相独立的赋值 "同时" 完成: 先做目标不再被读的搬运, 遇到环时借临时寄存器拆开
+static void EmitParallelMoves(RiscvContext &ctx, std::vector<ParallelMove> moves) {
+  static const char *kTemps[] = {"t6", "t5", "t3", "t2", "t1"};
+  while (!moves.empty()) {
+    bool progress = false;
+    for (size_t i = 0; i < moves.size(); ++i) {
+      bool blocked = false;
+      for (size_t j = 0; j < moves.size() && !blocked; ++j) {
+        blocked = j != i && MoveReads(moves[j], moves[i]);
+      }
+      if (!blocked) {
+        EmitMove(ctx, moves[i]);
+        moves.erase(moves.begin() + static_cast<long>(i));
+        progress = true;
+        break;
+      }
+    }
+    if (progress) {
+      continue;
+    }
+    std::string temp;
+    for (const char *cand : kTemps) {
+      bool busy = false;
+      for (const auto &move : moves) {
+        busy = busy || move.src_reg == cand || move.dst_reg == cand;
+      }
+      if (!busy) {
+        temp = cand;
+        break;
+      }
+    }
+    assert(!temp.empty());
+    const ParallelMove &head = moves.front();
+    if (head.dst_reg.empty()) {
+      EmitLoadBase(ctx, temp, "sp", head.dst_offset);
+    } else {
+      ctx.Emit("mv " + temp + ", " + head.dst_reg);
+    }
+    ParallelMove saved = head;
+    for (auto &move : moves) {
+      if (MoveReads(move, saved)) {
+        move.src_reg = temp;
+      }
+    }
+  }
+}
+
 static void EmitLabel(IRGenContext &ctx, const std::string &label) {
   *ctx.out << label << ":\n";
 }
@@ -167,6 +303,62 @@ static bool IsBuiltinFunc(const std::string &name) {
          name == "putint" || name == "putch" || name == "putarray";
 }
 
+// 按 32 位补码语义折叠运算, 除零等运行时才有定义的情况返回 false
+static bool FoldBinary(const std::string &op, int lhs, int rhs, int &out) {
+  auto ul = static_cast<unsigned>(lhs);
+  auto ur = static_cast<unsigned>(rhs);
+  if (op == "+") {
+    out = static_cast<int>(ul + ur);
+  } else if (op == "-") {
+    out = static_cast<int>(ul - ur);
+  } else if (op == "*") {
+    out = static_cast<int>(ul * ur);
+  } else if (op == "/" || op == "%") {
+    if (rhs == 0 || (lhs == INT_MIN && rhs == -1)) {
+      return false;
+    }
+    out = op == "/" ? lhs / rhs : lhs % rhs;
+  } else if (op == "<") {
+    out = lhs < rhs;
+  } else if (op == ">") {
+    out = lhs > rhs;
+  } else if (op == "<=") {
+    out = lhs <= rhs;
+  } else if (op == ">=") {
+    out = lhs >= rhs;
+  } else if (op == "==") {
+    out = lhs == rhs;
+  } else if (op == "!=") {
+    out = lhs != rhs;
+  } else if (op == "&&") {
+    out = lhs && rhs;
+  } else if (op == "||") {
+    out = lhs || rhs;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static int FoldUnary(const std::string &op, int rhs) {
+  if (op == "-") {
+    return static_cast<int>(0u - static_cast<unsigned>(rhs));
+  }
+  if (op == "!") {
+    return !rhs;
+  }
+  return rhs;
+}
+
+static bool IntLiteralValue(const std::string &val, int &out) {
+  if (val.empty() || (!isdigit(static_cast<unsigned char>(val[0])) &&
+                      !(val[0] == '-' && val.size() > 1))) {
+    return false;
+  }
+  out = static_cast<int>(std::stoll(val));
+  return true;
+}
+
 static int64_t Product(const std::vector<int> &dims, size_t start) {
   int64_t prod = 1;
   for (size_t i = start; i < dims.size(); ++i) {
@@ -268,33 +460,3395 @@ static std::vector<const ExprAST *> BuildInitExprList(
     size_t pos = 0;
     FlattenInitExpr(init, dims, 0, pos, out);
   }
-  return out;
+  return out;
+}
+
+static std::string GenElemPtr(IRGenContext &ctx, const std::string &base,
+                              const std::vector<int> &dims, size_t linear) {
+  std::vector<int> indices;
+  indices.reserve(dims.size());
+  size_t rem = linear;
+  for (size_t i = 0; i < dims.size(); ++i) {
+    size_t sub = static_cast<size_t>(Product(dims, i + 1));
+    int idx = static_cast<int>(rem / sub);
+    rem %= sub;
+    indices.push_back(idx);
+  }
+  std::string ptr = base;
+  for (int idx : indices) {
+    auto next = ctx.NewTemp();
+    ctx.Emit(next + " = getelemptr " + ptr + ", " + std::to_string(idx));
+    ptr = next;
+  }
+  return ptr;
+}
+
+static std::string GenToBool(IRGenContext &ctx, const std::string &val) {
+  int known = 0;
+  if (IntLiteralValue(val, known)) {
+    return known != 0 ? "1" : "0";
+  }
+  auto tmp = ctx.NewTemp();
+  ctx.Emit(tmp + " = ne " + val + ", 0");
+  return tmp;
+}
+
+using StmtVisitor = std::function<void(const BaseAST *)>;
+using ExprVisitor = std::function<void(const ExprAST *)>;
+
+static void VisitExpr(const ExprAST *expr, const ExprVisitor &on_expr) {
+  if (!expr) {
+    return;
+  }
+  on_expr(expr);
+  if (auto *lval = dynamic_cast<const LValAST *>(expr)) {
+    for (const auto &idx : lval->indices) {
+      VisitExpr(idx.get(), on_expr);
+    }
+  } else if (auto *unary = dynamic_cast<const UnaryExpAST *>(expr)) {
+    VisitExpr(unary->rhs.get(), on_expr);
+  } else if (auto *binary = dynamic_cast<const BinaryExpAST *>(expr)) {
+    VisitExpr(binary->lhs.get(), on_expr);
+    VisitExpr(binary->rhs.get(), on_expr);
+  } else if (auto *call = dynamic_cast<const CallExpAST *>(expr)) {
+    for (const auto &arg : call->args) {
+      VisitExpr(arg.get(), on_expr);
+    }
+  }
+}
+
+static void VisitInit(const InitValAST *init, const ExprVisitor &on_expr) {
+  if (!init) {
+    return;
+  }
+  if (init->is_expr) {
+    VisitExpr(init->expr.get(), on_expr);
+    return;
+  }
+  for (const auto &child : init->list) {
+    VisitInit(child.get(), on_expr);
+  }
+}
+
+// 按源码顺序遍历语句及其中的全部表达式, 两个回调都可以为空
+static void VisitStmt(const BaseAST *node, const StmtVisitor &on_stmt,
+                      const ExprVisitor &on_expr) {
+  if (!node) {
+    return;
+  }
+  if (on_stmt) {
+    on_stmt(node);
+  }
+  auto visit_expr = [&](const ExprAST *expr) {
+    if (on_expr) {
+      VisitExpr(expr, on_expr);
+    }
+  };
+  if (auto *block = dynamic_cast<const BlockAST *>(node)) {
+    for (const auto &item : block->items) {
+      VisitStmt(item.get(), on_stmt, on_expr);
+    }
+  } else if (auto *decl = dynamic_cast<const ConstDeclAST *>(node)) {
+    for (const auto &def : decl->defs) {
+      for (const auto &dim : def.dims) {
+        visit_expr(dim.get());
+      }
+      if (on_expr) {
+        VisitInit(def.init.get(), on_expr);
+      }
+    }
+  } else if (auto *decl = dynamic_cast<const VarDeclAST *>(node)) {
+    for (const auto &def : decl->defs) {
+      for (const auto &dim : def.dims) {
+        visit_expr(dim.get());
+      }
+      if (on_expr) {
+        VisitInit(def.init.get(), on_expr);
+      }
+    }
+  } else if (auto *ret = dynamic_cast<const ReturnStmtAST *>(node)) {
+    visit_expr(ret->value.get());
+  } else if (auto *assign = dynamic_cast<const AssignStmtAST *>(node)) {
+    visit_expr(assign->lval.get());
+    visit_expr(assign->value.get());
+  } else if (auto *stmt = dynamic_cast<const ExprStmtAST *>(node)) {
+    visit_expr(stmt->expr.get());
+  } else if (auto *if_stmt = dynamic_cast<const IfStmtAST *>(node)) {
+    visit_expr(if_stmt->cond.get());
+    VisitStmt(if_stmt->then_stmt.get(), on_stmt, on_expr);
+    VisitStmt(if_stmt->else_stmt.get(), on_stmt, on_expr);
+  } else if (auto *while_stmt = dynamic_cast<const WhileStmtAST *>(node)) {
+    visit_expr(while_stmt->cond.get());
+    VisitStmt(while_stmt->body.get(), on_stmt, on_expr);
+  }
+}
+
+static int CountNodes(const BaseAST *node) {
+  int count = 0;
+  VisitStmt(node, [&](const BaseAST *) { ++count; },
+            [&](const ExprAST *) { ++count; });
+  return count;
+}
+
+static bool AssignsTo(const BaseAST *node, const std::string &name) {
+  bool found = false;
+  VisitStmt(node, [&](const BaseAST *stmt) {
+    auto *assign = dynamic_cast<const AssignStmtAST *>(stmt);
+    if (assign) {
+      auto *lval = dynamic_cast<const LValAST *>(assign->lval.get());
+      found = found || (lval && lval->ident == name);
+    }
+  }, nullptr);
+  return found;
+}
+
+static bool DeclaresArray(const BaseAST *node) {
+  bool found = false;
+  VisitStmt(node, [&](const BaseAST *stmt) {
+    if (auto *decl = dynamic_cast<const VarDeclAST *>(stmt)) {
+      for (const auto &def : decl->defs) {
+        found = found || !def.dims.empty();
+      }
+    } else if (auto *decl = dynamic_cast<const ConstDeclAST *>(stmt)) {
+      for (const auto &def : decl->defs) {
+        found = found || !def.dims.empty();
+      }
+    }
+  }, nullptr);
+  return found;
+}
+
+static bool IsVoidFunc(const FuncDefAST &func) {
+  auto *type = dynamic_cast<FuncTypeAST *>(func.func_type.get());
+  return type && type->type == "void";
+}
+
+// Tarjan 求强连通分量, 大小超过 1 或带自环的分量里的函数都算递归
+static void FindRecursive(ProgramInfo &info) {
+  std::unordered_map<std::string, int> index;
+  std::unordered_map<std::string, int> low;
+  std::vector<std::string> stack;
+  std::unordered_set<std::string> on_stack;
+  int counter = 0;
+  std::function<void(const std::string &)> connect = [&](const std::string &name) {
+    index[name] = low[name] = counter++;
+    stack.push_back(name);
+    on_stack.insert(name);
+    bool self_call = false;
+    for (const auto &callee : info.callees[name]) {
+      if (info.funcs.find(callee) == info.funcs.end()) {
+        continue;
+      }
+      self_call = self_call || callee == name;
+      if (index.find(callee) == index.end()) {
+        connect(callee);
+        low[name] = std::min(low[name], low[callee]);
+      } else if (on_stack.count(callee)) {
+        low[name] = std::min(low[name], index[callee]);
+      }
+    }
+    if (low[name] != index[name]) {
+      return;
+    }
+    std::vector<std::string> scc;
+    std::string top;
+    do {
+      top = stack.back();
+      stack.pop_back();
+      on_stack.erase(top);
+      scc.push_back(top);
+    } while (top != name);
+    if (scc.size() > 1 || self_call) {
+      info.recursive.insert(scc.begin(), scc.end());
+    }
+  };
+  for (const auto &func : info.funcs) {
+    if (index.find(func.first) == index.end()) {
+      connect(func.first);
+    }
+  }
+}
+
+// 纯函数: 没有数组形参, 不读写非常量全局变量, 不调用库函数, 只调用纯函数.
+// 先逐个检查函数体, 再反复剔除调用了非纯函数的候选直到不动点
+static void FindPure(ProgramInfo &info) {
+  for (const auto &entry : info.funcs) {
+    const FuncDefAST *func = entry.second;
+    // 局部名字按块分层: 块里的声明只遮住这个块里它之后的同名全局变量
+    std::vector<std::unordered_set<std::string>> scopes(1);
+    bool ok = true;
+    for (const auto &param : func->params) {
+      ok = ok && !param.is_array;
+      scopes.back().insert(param.ident);
+    }
+    auto is_local = [&](const std::string &name) {
+      return std::any_of(scopes.begin(), scopes.end(),
+                         [&](const std::unordered_set<std::string> &scope) {
+                           return scope.count(name) > 0;
+                         });
+    };
+    ExprVisitor check = [&](const ExprAST *expr) {
+      if (auto *lval = dynamic_cast<const LValAST *>(expr)) {
+        ok = ok && (is_local(lval->ident) || !info.global_vars.count(lval->ident));
+      } else if (auto *call = dynamic_cast<const CallExpAST *>(expr)) {
+        ok = ok && !IsBuiltinFunc(call->ident) && info.funcs.count(call->ident);
+      }
+    };
+    std::function<void(const BaseAST *)> walk = [&](const BaseAST *node) {
+      if (auto *block = dynamic_cast<const BlockAST *>(node)) {
+        scopes.emplace_back();
+        for (const auto &item : block->items) {
+          walk(item.get());
+        }
+        scopes.pop_back();
+      } else if (auto *if_stmt = dynamic_cast<const IfStmtAST *>(node)) {
+        VisitExpr(if_stmt->cond.get(), check);
+        walk(if_stmt->then_stmt.get());
+        walk(if_stmt->else_stmt.get());
+      } else if (auto *while_stmt = dynamic_cast<const WhileStmtAST *>(node)) {
+        VisitExpr(while_stmt->cond.get(), check);
+        walk(while_stmt->body.get());
+      } else {
+        // 声明的初值按声明之前的作用域检查, 偏保守
+        VisitStmt(node, nullptr, check);
+        if (auto *decl = dynamic_cast<const VarDeclAST *>(node)) {
+          for (const auto &def : decl->defs) {
+            scopes.back().insert(def.ident);
+          }
+        } else if (auto *decl = dynamic_cast<const ConstDeclAST *>(node)) {
+          for (const auto &def : decl->defs) {
+            scopes.back().insert(def.ident);
+          }
+        }
+      }
+    };
+    walk(func->block.get());
+    if (ok) {
+      info.pure.insert(entry.first);
+    }
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto it = info.pure.begin(); it != info.pure.end();) {
+      const auto &callees = info.callees[*it];
+      bool ok = std::all_of(callees.begin(), callees.end(),
+                            [&](const std::string &callee) {
+                              return info.pure.count(callee) > 0;
+                            });
+      if (ok) {
+        ++it;
+      } else {
+        it = info.pure.erase(it);
+        changed = true;
+      }
+    }
+  }
+}
+
+// 从 main 出发沿调用图求可达函数, 再收集它们引用到的全局变量; 没有 main 时全部保留
+static void FindReachable(ProgramInfo &info) {
+  if (!info.funcs.count("main")) {
+    for (const auto &func : info.funcs) {
+      info.reachable.insert(func.first);
+    }
+    info.used_globals = info.global_vars;
+    return;
+  }
+  std::vector<std::string> work{"main"};
+  while (!work.empty()) {
+    std::string name = work.back();
+    work.pop_back();
+    if (!info.reachable.insert(name).second) {
+      continue;
+    }
+    for (const auto &callee : info.callees[name]) {
+      if (info.funcs.count(callee)) {
+        work.push_back(callee);
+      }
+    }
+  }
+  for (const auto &name : info.reachable) {
+    VisitStmt(info.funcs.at(name)->block.get(), nullptr, [&](const ExprAST *expr) {
+      auto *lval = dynamic_cast<const LValAST *>(expr);
+      if (lval && info.global_vars.count(lval->ident)) {
+        info.used_globals.insert(lval->ident);
+      }
+    });
+  }
+  if (options.opt_report) {
+    for (const auto &func : info.funcs) {
+      if (!info.reachable.count(func.first)) {
+        std::cerr << "dce: removed unreachable function " << func.first << std::endl;
+      }
+    }
+    for (const auto &name : info.global_vars) {
+      if (!info.used_globals.count(name)) {
+        std::cerr << "dce: removed unused global " << name << std::endl;
+      }
+    }
+  }
+}
+
+/* =======================
+ * 剖析反馈
+ * ======================= */
+static const uint32_t kProfileMagic = 0x46505953;  // "SYPF"
+
+// 编号只取决于源码, 插桩和使用剖析的两次编译不论开了哪些优化都对得上
+static void AssignCounters(const std::vector<std::unique_ptr<BaseAST>> &items,
+                           ProgramInfo &info) {
+  uint32_t hash = 2166136261u;
+  auto mix = [&](const std::string &text) {
+    for (unsigned char c : text) {
+      hash = (hash ^ c) * 16777619u;
+    }
+  };
+  for (const auto &item : items) {
+    auto *func = dynamic_cast<const FuncDefAST *>(item.get());
+    if (!func) {
+      continue;
+    }
+    mix(func->ident + ":");
+    info.counter_ids[func] = info.num_counters++;
+    VisitStmt(func->block.get(), [&](const BaseAST *stmt) {
+      bool is_if = dynamic_cast<const IfStmtAST *>(stmt) != nullptr;
+      if (is_if || dynamic_cast<const WhileStmtAST *>(stmt)) {
+        mix(is_if ? "i" : "w");
+        info.counter_ids[stmt] = info.num_counters;
+        info.num_counters += 2;
+      }
+    }, nullptr);
+  }
+  info.counter_layout = hash;
+}
+
+// 剖析文件依次是魔数, 布局散列, 计数器个数和各计数器, 都是小端 32 位字
+static void LoadProfile(ProgramInfo &info) {
+  std::ifstream in(options.profile_file, std::ios::binary);
+  std::vector<uint32_t> words;
+  unsigned char bytes[4];
+  while (in.read(reinterpret_cast<char *>(bytes), 4)) {
+    words.push_back(bytes[0] | bytes[1] << 8 | bytes[2] << 16 |
+                    static_cast<uint32_t>(bytes[3]) << 24);
+  }
+  if (words.size() < 3 || words[0] != kProfileMagic || words[1] != info.counter_layout ||
+      words[2] != static_cast<uint32_t>(info.num_counters) || words.size() != 3 + words[2]) {
+    std::cerr << "warning: profile " << options.profile_file
+              << " is missing or does not match this program, ignored" << std::endl;
+    return;
+  }
+  info.profile.assign(words.begin() + 3, words.end());
+  long long hottest = *std::max_element(info.profile.begin(), info.profile.end());
+  info.hot_count = std::max(1LL, hottest / 10);
+}
+
+// 计数器 base + edge 在剖析里的值, 没有剖析数据时为 -1
+template <typename Ctx>
+static long long EdgeCount(const Ctx &ctx, const BaseAST &node, int edge) {
+  if (!ctx.prog || ctx.prog->profile.empty()) {
+    return -1;
+  }
+  auto found = ctx.prog->counter_ids.find(&node);
+  if (found == ctx.prog->counter_ids.end()) {
+    return -1;
+  }
+  return ctx.prog->profile[found->second + edge];
+}
+
+// 插桩: 计数器 base + edge 加一, 用 t0 和 t1
+static void EmitCounterRiscv(RiscvContext &ctx, const BaseAST &node, int edge) {
+  if (!options.profile_generate || !ctx.prog) {
+    return;
+  }
+  auto found = ctx.prog->counter_ids.find(&node);
+  if (found == ctx.prog->counter_ids.end()) {
+    return;
+  }
+  ctx.Emit("la t0, .Lprof_counters+" + std::to_string((found->second + edge) * 4));
+  ctx.Emit("lw t1, 0(t0)");
+  ctx.Emit("addi t1, t1, 1");
+  ctx.Emit("sw t1, 0(t0)");
+}
+
+static void AddProfileData(RiscvContext &ctx, const ProgramInfo &info) {
+  std::string path;
+  for (char c : options.profile_file) {
+    if (c == '"' || c == '\\') {
+      path += '\\';
+    }
+    path += c;
+  }
+  ctx.data.push_back(".Lprof_data:");
+  ctx.data.push_back("  .word " + std::to_string(kProfileMagic));
+  ctx.data.push_back("  .word " + std::to_string(info.counter_layout));
+  ctx.data.push_back("  .word " + std::to_string(info.num_counters));
+  ctx.data.push_back(".Lprof_counters:");
+  ctx.data.push_back("  .zero " + std::to_string(info.num_counters * 4));
+  ctx.data.push_back(".Lprof_path:");
+  ctx.data.push_back("  .asciz \"" + path + "\"");
+}
+
+// main 返回前用 jal t6 调用: 直接用 openat/write/close 系统调用写出剖析文件, 保留 a0
+static void EmitProfileDump(const ProgramInfo &info) {
+  cout << "  .text" << endl;
+  cout << ".Lprof_dump:" << endl;
+  cout << "  mv t3, a0" << endl;
+  cout << "  li a0, -100" << endl;  // AT_FDCWD
+  cout << "  la a1, .Lprof_path" << endl;
+  cout << "  li a2, 577" << endl;  // O_WRONLY | O_CREAT | O_TRUNC
+  cout << "  li a3, 420" << endl;  // 0644
+  cout << "  li a7, 56" << endl;
+  cout << "  ecall" << endl;
+  cout << "  bltz a0, .Lprof_dump_end" << endl;
+  cout << "  mv t5, a0" << endl;
+  cout << "  la a1, .Lprof_data" << endl;
+  cout << "  li a2, " << (info.num_counters + 3) * 4 << endl;
+  cout << "  li a7, 64" << endl;
+  cout << "  ecall" << endl;
+  cout << "  mv a0, t5" << endl;
+  cout << "  li a7, 57" << endl;
+  cout << "  ecall" << endl;
+  cout << ".Lprof_dump_end:" << endl;
+  cout << "  mv a0, t3" << endl;
+  cout << "  jr t6" << endl;
+}
+
+/* =======================
+ * 函数级周期剖析
+ * ======================= */
+// 每个可达函数一行: 调用次数, 然后是含子调用和不含子调用的周期数, 指令数, 各占两个字
+// (低位在前), 再是正在执行的层数, 最后是函数名的地址. .Lcyc_child 累计当前帧里直接
+// 子调用花掉的周期数和指令数, 也是各占两个字
+static const int kCycleRowSize = 44;
+static const int kCycleDepth = kCycleRowSize - 8;
+
+static void AddCycleTable(RiscvContext &ctx, const std::vector<std::unique_ptr<BaseAST>> &items,
+                          const ProgramInfo &info) {
+  ctx.data.push_back(".Lcyc_child:");
+  ctx.data.push_back("  .zero 16");
+  ctx.data.push_back(".Lcyc_table:");
+  std::vector<std::string> names;
+  for (const auto &item : items) {
+    auto *func = dynamic_cast<const FuncDefAST *>(item.get());
+    if (!func || !info.reachable.count(func->ident)) {
+      continue;
+    }
+    ctx.data.push_back(".Lcyc_row_" + func->ident + ":");
+    ctx.data.push_back("  .zero " + std::to_string(kCycleRowSize - 4));
+    ctx.data.push_back("  .word .Lcyc_name_" + func->ident);
+    names.push_back(func->ident);
+  }
+  ctx.data.push_back(".Lcyc_rows:");
+  ctx.data.push_back("  .word " + std::to_string(names.size()));
+  for (const auto &name : names) {
+    ctx.data.push_back(".Lcyc_name_" + name + ":");
+    ctx.data.push_back("  .asciz \"" + name + "\"");
+  }
+  ctx.data.push_back(".Lcyc_header:");
+  ctx.data.push_back("  .asciz \"function\\tcalls\\tcycles\\tself cycles\\tinstret\\tself instret\\n\"");
+  ctx.data.push_back(".Lcyc_newline:");
+  ctx.data.push_back("  .asciz \"\\n\"");
+  ctx.data.push_back(".Lcyc_buf:");
+  ctx.data.push_back("  .zero 24");
+}
+
+// offset(base) 处的 64 位数加上 hi:lo, 低位的进位由无符号比较得出. 会改掉 lo 和 t6
+static void EmitCycleAdd(std::ostream &os, const std::string &base, int offset,
+                         const char *lo, const char *hi) {
+  os << "  lw t6, " << offset << "(" << base << ")\n";
+  os << "  add " << lo << ", t6, " << lo << "\n";
+  os << "  sw " << lo << ", " << offset << "(" << base << ")\n";
+  os << "  sltu " << lo << ", " << lo << ", t6\n";
+  os << "  lw t6, " << offset + 4 << "(" << base << ")\n";
+  os << "  add t6, t6, " << lo << "\n";
+  os << "  add t6, t6, " << hi << "\n";
+  os << "  sw t6, " << offset + 4 << "(" << base << ")\n";
+}
+
+// 序言末尾: 保存父帧的子调用累计并清零, 层数加一, 再记下进入时的计数. 探针槽依次是
+// 进入时的周期数, 指令数, 父帧的子调用周期数, 指令数, 都是 64 位
+static void EmitCycleEntry(std::ostream &os, const std::string &func, int slots) {
+  os << "  la t2, .Lcyc_child\n";
+  for (int i = 0; i < 16; i += 4) {
+    os << "  lw t0, " << i << "(t2)\n";
+    EmitStoreBaseOut(os, "t0", "sp", slots + 16 + i);
+    os << "  sw zero, " << i << "(t2)\n";
+  }
+  os << "  la t2, .Lcyc_row_" << func << "\n";
+  os << "  lw t0, " << kCycleDepth << "(t2)\n";
+  os << "  addi t0, t0, 1\n";
+  os << "  sw t0, " << kCycleDepth << "(t2)\n";
+  os << "  jal t6, .Lcyc_now\n";
+  const char *regs[] = {"t0", "t1", "t2", "t3"};
+  for (int i = 0; i < 4; ++i) {
+    EmitStoreBaseOut(os, regs[i], "sp", slots + i * 4);
+  }
+}
+
+// 每条返回路径上: 本次调用的增量累加进本函数的不含子调用部分, 并计入父帧的子调用;
+// 含子调用的部分只在最外层的一次返回时累加, 递归的内层已经包含在里面了.
+// 只用 t 寄存器, 返回值和尾调用的实参不受影响
+static void EmitCycleExit(std::ostream &os, const std::string &func, int slots) {
+  // 增量写回进入时计数的槽里
+  os << "  jal t6, .Lcyc_now\n";
+  const std::pair<const char *, const char *> now[] = {{"t0", "t1"}, {"t2", "t3"}};
+  for (int k = 0; k < 2; ++k) {
+    int slot = slots + k * 8;
+    EmitLoadBaseOut(os, "t5", "sp", slot);
+    os << "  sltu t6, " << now[k].first << ", t5\n";
+    os << "  sub " << now[k].first << ", " << now[k].first << ", t5\n";
+    EmitLoadBaseOut(os, "t5", "sp", slot + 4);
+    os << "  sub " << now[k].second << ", " << now[k].second << ", t5\n";
+    os << "  sub " << now[k].second << ", " << now[k].second << ", t6\n";
+    EmitStoreBaseOut(os, now[k].first, "sp", slot);
+    EmitStoreBaseOut(os, now[k].second, "sp", slot + 4);
+  }
+  std::string row = ".Lcyc_row_" + func;
+  os << "  la t2, " << row << "\n";
+  os << "  lw t6, 0(t2)\n";
+  os << "  addi t6, t6, 1\n";
+  os << "  sw t6, 0(t2)\n";
+  for (int k = 0; k < 2; ++k) {
+    int slot = slots + k * 8;
+    EmitLoadBaseOut(os, "t0", "sp", slot);
+    EmitLoadBaseOut(os, "t1", "sp", slot + 4);
+    // 不含子调用 t5:t3 = 增量 - 本帧子调用累计
+    os << "  la t2, .Lcyc_child\n";
+    os << "  lw t3, " << k * 8 << "(t2)\n";
+    os << "  lw t5, " << k * 8 + 4 << "(t2)\n";
+    os << "  sltu t6, t0, t3\n";
+    os << "  sub t3, t0, t3\n";
+    os << "  sub t5, t1, t5\n";
+    os << "  sub t5, t5, t6\n";
+    // 父帧的子调用累计 = 保存的值 + 增量
+    EmitLoadBaseOut(os, "t6", "sp", slot + 16);
+    os << "  sw t6, " << k * 8 << "(t2)\n";
+    EmitLoadBaseOut(os, "t6", "sp", slot + 20);
+    os << "  sw t6, " << k * 8 + 4 << "(t2)\n";
+    EmitCycleAdd(os, "t2", k * 8, "t0", "t1");
+    os << "  la t2, " << row << "\n";
+    EmitCycleAdd(os, "t2", 12 + k * 16, "t3", "t5");
+  }
+  // 层数减一, 减到 0 时 t3 为全 1, 否则为 0, 用来屏蔽内层的含子调用增量
+  os << "  lw t3, " << kCycleDepth << "(t2)\n";
+  os << "  addi t3, t3, -1\n";
+  os << "  sw t3, " << kCycleDepth << "(t2)\n";
+  os << "  seqz t3, t3\n";
+  os << "  neg t3, t3\n";
+  for (int k = 0; k < 2; ++k) {
+    int slot = slots + k * 8;
+    EmitLoadBaseOut(os, "t0", "sp", slot);
+    EmitLoadBaseOut(os, "t1", "sp", slot + 4);
+    os << "  and t0, t0, t3\n";
+    os << "  and t1, t1, t3\n";
+    EmitCycleAdd(os, "t2", 4 + k * 16, "t0", "t1");
+  }
+}
+
+// main 返回前调用, 把调用过的函数逐行写到 stderr, 保留 a0. 64 位数除以 10 拆成
+// 高位字和低位字的两个 16 位半边各做一次 32 位除法
+static void EmitCycleReport() {
+  cout << "  .text" << endl;
+  cout << ".Lcyc_report:" << endl;
+  cout << "  addi sp, sp, -16" << endl;
+  cout << "  sw ra, 12(sp)" << endl;
+  cout << "  sw s1, 8(sp)" << endl;
+  cout << "  sw s2, 4(sp)" << endl;
+  cout << "  sw a0, 0(sp)" << endl;
+  cout << "  la a0, .Lcyc_header" << endl;
+  cout << "  call .Lcyc_puts" << endl;
+  cout << "  la s1, .Lcyc_table" << endl;
+  cout << "  la s2, .Lcyc_rows" << endl;
+  cout << "  lw s2, 0(s2)" << endl;
+  cout << ".Lcyc_report_row:" << endl;
+  cout << "  beqz s2, .Lcyc_report_done" << endl;
+  cout << "  lw t0, 0(s1)" << endl;
+  cout << "  beqz t0, .Lcyc_report_next" << endl;
+  cout << "  lw a0, " << kCycleRowSize - 4 << "(s1)" << endl;
+  cout << "  call .Lcyc_puts" << endl;
+  cout << "  lw a0, 0(s1)" << endl;
+  cout << "  li a1, 0" << endl;
+  cout << "  call .Lcyc_putu64" << endl;
+  for (int offset = 4; offset < kCycleDepth; offset += 8) {
+    cout << "  lw a0, " << offset << "(s1)" << endl;
+    cout << "  lw a1, " << offset + 4 << "(s1)" << endl;
+    cout << "  call .Lcyc_putu64" << endl;
+  }
+  cout << "  la a0, .Lcyc_newline" << endl;
+  cout << "  call .Lcyc_puts" << endl;
+  cout << ".Lcyc_report_next:" << endl;
+  cout << "  addi s1, s1, " << kCycleRowSize << endl;
+  cout << "  addi s2, s2, -1" << endl;
+  cout << "  j .Lcyc_report_row" << endl;
+  cout << ".Lcyc_report_done:" << endl;
+  cout << "  lw a0, 0(sp)" << endl;
+  cout << "  lw s2, 4(sp)" << endl;
+  cout << "  lw s1, 8(sp)" << endl;
+  cout << "  lw ra, 12(sp)" << endl;
+  cout << "  addi sp, sp, 16" << endl;
+  cout << "  ret" << endl;
+  // a0 指向的字符串写到 stderr
+  cout << ".Lcyc_puts:" << endl;
+  cout << "  mv a1, a0" << endl;
+  cout << "  mv a2, a0" << endl;
+  cout << ".Lcyc_puts_len:" << endl;
+  cout << "  lbu t0, 0(a2)" << endl;
+  cout << "  beqz t0, .Lcyc_puts_write" << endl;
+  cout << "  addi a2, a2, 1" << endl;
+  cout << "  j .Lcyc_puts_len" << endl;
+  cout << ".Lcyc_puts_write:" << endl;
+  cout << "  sub a2, a2, a1" << endl;
+  cout << "  li a0, 2" << endl;
+  cout << "  li a7, 64" << endl;
+  cout << "  ecall" << endl;
+  cout << "  ret" << endl;
+  // 以 tab 开头写出 a1:a0 的十进制值
+  cout << ".Lcyc_putu64:" << endl;
+  cout << "  la a2, .Lcyc_buf+23" << endl;
+  cout << "  li t6, 10" << endl;
+  cout << ".Lcyc_putu64_digit:" << endl;
+  cout << "  remu t0, a1, t6" << endl;
+  cout << "  divu a1, a1, t6" << endl;
+  cout << "  srli t1, a0, 16" << endl;
+  cout << "  slli t0, t0, 16" << endl;
+  cout << "  or t0, t0, t1" << endl;
+  cout << "  remu t1, t0, t6" << endl;
+  cout << "  divu t0, t0, t6" << endl;
+  cout << "  slli t0, t0, 16" << endl;
+  cout << "  slli t1, t1, 16" << endl;
+  cout << "  slli t2, a0, 16" << endl;
+  cout << "  srli t2, t2, 16" << endl;
+  cout << "  or t1, t1, t2" << endl;
+  cout << "  remu t2, t1, t6" << endl;
+  cout << "  divu t1, t1, t6" << endl;
+  cout << "  or a0, t0, t1" << endl;
+  cout << "  addi t2, t2, 48" << endl;
+  cout << "  addi a2, a2, -1" << endl;
+  cout << "  sb t2, 0(a2)" << endl;
+  cout << "  or t0, a0, a1" << endl;
+  cout << "  bnez t0, .Lcyc_putu64_digit" << endl;
+  cout << "  li t0, 9" << endl;
+  cout << "  addi a2, a2, -1" << endl;
+  cout << "  sb t0, 0(a2)" << endl;
+  cout << "  mv a0, a2" << endl;
+  cout << "  j .Lcyc_puts" << endl;
+  // 用 jal t6 调用: 64 位的周期数放进 t1:t0, 指令数放进 t3:t2. 读低位时高位可能
+  // 正好进位, 所以前后两次读到的高位不同时重读
+  cout << ".Lcyc_now:" << endl;
+  cout << "  rdcycleh t1" << endl;
+  cout << "  rdcycle t0" << endl;
+  cout << "  rdcycleh t5" << endl;
+  cout << "  bne t1, t5, .Lcyc_now" << endl;
+  cout << ".Lcyc_now_instret:" << endl;
+  cout << "  rdinstreth t3" << endl;
+  cout << "  rdinstret t2" << endl;
+  cout << "  rdinstreth t5" << endl;
+  cout << "  bne t3, t5, .Lcyc_now_instret" << endl;
+  cout << "  jr t6" << endl;
+}
+
+static void BuildProgramInfo(const std::vector<std::unique_ptr<BaseAST>> &items,
+                             ProgramInfo &info) {
+  for (const auto &item : items) {
+    auto *func = dynamic_cast<const FuncDefAST *>(item.get());
+    auto *decl = dynamic_cast<const VarDeclAST *>(item.get());
+    if (decl) {
+      for (const auto &def : decl->defs) {
+        info.global_vars.insert(def.ident);
+      }
+    }
+    if (!func) {
+      continue;
+    }
+    info.funcs[func->ident] = func;
+    info.sizes[func->ident] = CountNodes(func->block.get());
+    auto &callees = info.callees[func->ident];
+    VisitStmt(func->block.get(), [&](const BaseAST *stmt) {
+      auto *assign = dynamic_cast<const AssignStmtAST *>(stmt);
+      auto *lval = assign ? dynamic_cast<const LValAST *>(assign->lval.get()) : nullptr;
+      if (lval && lval->indices.empty()) {
+        info.assigned_names.insert(lval->ident);
+      }
+    }, [&](const ExprAST *expr) {
+      auto *call = dynamic_cast<const CallExpAST *>(expr);
+      if (call) {
+        callees.push_back(call->ident);
+      }
+    });
+  }
+  FindRecursive(info);
+  FindPure(info);
+  FindReachable(info);
+  AssignCounters(items, info);
+  if (options.profile_use && !options.profile_generate) {
+    LoadProfile(info);
+  }
+}
+
+// 返回不内联的原因, 可以内联时返回空串
+template <typename Ctx>
+static std::string InlineRefusal(const Ctx &ctx, const CallExpAST &call) {
+  const FuncDefAST *callee = ctx.prog->funcs.at(call.ident);
+  int size = ctx.prog->sizes.at(call.ident);
+  // 有剖析数据时热点调用放宽一倍, 否则循环内的调用放宽一倍
+  bool hot = ctx.exec_count >= 0 ? ctx.exec_count >= ctx.prog->hot_count
+                                 : !ctx.break_labels.empty();
+  int limit = options.inline_threshold * (hot ? 2 : 1);
+  if (!options.inline_funcs) {
+    return "disabled";
+  }
+  if (ctx.prog->recursive.count(call.ident)) {
+    return "recursive";
+  }
+  if (callee->params.size() != call.args.size()) {
+    return "argument count mismatch";
+  }
+  if (ctx.exec_count == 0) {
+    return "never executed in the profile";
+  }
+  if (size > limit) {
+    return "too large (" + std::to_string(size) + " > " +
+           std::to_string(limit) + ")";
+  }
+  if (ctx.inline_growth + size > options.inline_growth) {
+    return "caller growth budget exhausted";
+  }
+  if (DeclaresArray(callee->block.get())) {
+    return "declares local arrays";
+  }
+  return "";
+}
+
+// 决定一个调用点是否内联, 返回被调函数; 开启 -fopt-report 时把决定写到 stderr
+template <typename Ctx>
+static const FuncDefAST *InlineTarget(Ctx &ctx, const CallExpAST &call) {
+  if (!ctx.prog || ctx.prog->funcs.find(call.ident) == ctx.prog->funcs.end()) {
+    return nullptr;
+  }
+  int size = ctx.prog->sizes.at(call.ident);
+  std::string reason = InlineRefusal(ctx, call);
+  if (options.opt_report) {
+    std::cerr << "inline: " << ctx.func_name << " -> " << call.ident << ": "
+              << (reason.empty() ? "inlined (size " + std::to_string(size) + ")"
+                                 : "not inlined, " + reason)
+              << std::endl;
+  }
+  if (!reason.empty()) {
+    return nullptr;
+  }
+  ctx.inline_growth += size;
+  return ctx.prog->funcs.at(call.ident);
+}
+
+/* =======================
+ * 公共子表达式
+ * ======================= */
+static std::string CseToken(const Symbol &sym) { return sym.ir_name; }
+
+static std::string CseToken(const RiscvSymbol &sym) {
+  return sym.is_global ? sym.label : "sp" + std::to_string(sym.offset);
+}
+
+static bool CseGlobal(const Symbol &sym) { return sym.ir_name[0] == '@'; }
+
+static bool CseGlobal(const RiscvSymbol &sym) { return sym.is_global; }
+
+// 常量传播只跟踪局部标量, 全局变量可能被调用改写
+template <typename Ctx, typename Sym>
+static bool KnownScalar(Ctx &ctx, const Sym &sym, int &value) {
+  if (sym.is_array || CseGlobal(sym)) {
+    return false;
+  }
+  auto found = ctx.known_values.find(CseToken(sym));
+  if (found == ctx.known_values.end()) {
+    return false;
+  }
+  value = found->second;
+  return true;
+}
+
+// 把变量换成存储位置, 值确定的变量和常量换成值; 含调用或数组地址的表达式不参与
+template <typename Ctx>
+static bool CseKey(Ctx &ctx, const ExprAST *expr, std::string &key,
+                   typename Ctx::CseEntry &entry) {
+  if (auto *num = dynamic_cast<const NumberAST *>(expr)) {
+    key += std::to_string(num->value);
+    return true;
+  }
+  if (auto *lval = dynamic_cast<const LValAST *>(expr)) {
+    auto *sym = ctx.FindSymbol(lval->ident);
+    if (!sym) {
+      return false;
+    }
+    if (sym->is_const && !sym->is_array) {
+      key += std::to_string(sym->const_value);
+      return true;
+    }
+    int known = 0;
+    if (KnownScalar(ctx, *sym, known)) {
+      key += std::to_string(known);
+      return true;
+    }
+    auto token = CseToken(*sym);
+    if (!sym->is_array) {
+      key += token;
+      entry.reads_globals = entry.reads_globals || CseGlobal(*sym);
+      entry.vars.push_back(std::move(token));
+      return true;
+    }
+    size_t full = sym->is_param_ptr ? sym->dims.size() + 1 : sym->dims.size();
+    if (lval->indices.size() != full) {
+      return false;
+    }
+    key += "*" + token;
+    entry.reads_memory = true;
+    for (const auto &idx : lval->indices) {
+      key += "[";
+      if (!CseKey(ctx, idx.get(), key, entry)) {
+        return false;
+      }
+      key += "]";
+    }
+    return true;
+  }
+  if (auto *unary = dynamic_cast<const UnaryExpAST *>(expr)) {
+    key += "(" + unary->op;
+    bool ok = CseKey(ctx, unary->rhs.get(), key, entry);
+    key += ")";
+    return ok;
+  }
+  if (auto *binary = dynamic_cast<const BinaryExpAST *>(expr)) {
+    key += "(";
+    bool ok = CseKey(ctx, binary->lhs.get(), key, entry);
+    key += binary->op;
+    ok = ok && CseKey(ctx, binary->rhs.get(), key, entry);
+    key += ")";
+    return ok;
+  }
+  return false;
+}
+
+// 数组元素的地址只依赖下标, 写数组不会让它失效
+template <typename Ctx>
+static bool CseAddrKey(Ctx &ctx, const LValAST &lval, std::string &key,
+                       typename Ctx::CseEntry &entry) {
+  auto *sym = ctx.FindSymbol(lval.ident);
+  if (!sym || !sym->is_array) {
+    return false;
+  }
+  key = "&" + CseToken(*sym);
+  for (const auto &idx : lval.indices) {
+    key += "[";
+    if (!CseKey(ctx, idx.get(), key, entry)) {
+      return false;
+    }
+    key += "]";
+  }
+  return true;
+}
+
+template <typename Ctx>
+static const typename Ctx::CseEntry *CseFind(Ctx &ctx, const std::string &key) {
+  for (auto it = ctx.cse.rbegin(); it != ctx.cse.rend(); ++it) {
+    auto found = it->find(key);
+    if (found != it->end()) {
+      return &found->second;
+    }
+  }
+  return nullptr;
+}
+
+template <typename Ctx>
+static void CseRecord(Ctx &ctx, const std::string &key, typename Ctx::CseEntry entry) {
+  if (!ctx.cse.empty()) {
+    ctx.cse.back()[key] = std::move(entry);
+  }
+}
+
+template <typename Ctx>
+static void CsePush(Ctx &ctx) {
+  if (!ctx.cse.empty()) {
+    ctx.cse.emplace_back();
+  }
+}
+
+template <typename Ctx>
+static void CsePop(Ctx &ctx) {
+  if (!ctx.cse.empty()) {
+    ctx.cse.pop_back();
+  }
+}
+
+template <typename Ctx, typename Pred>
+static void CseKillIf(Ctx &ctx, const Pred &pred) {
+  for (auto &scope : ctx.cse) {
+    for (auto it = scope.begin(); it != scope.end();) {
+      it = pred(it->second) ? scope.erase(it) : std::next(it);
+    }
+  }
+}
+
+template <typename Ctx>
+static void CseKillVar(Ctx &ctx, const std::string &token) {
+  CseKillIf(ctx, [&](const typename Ctx::CseEntry &entry) {
+    return std::find(entry.vars.begin(), entry.vars.end(), token) != entry.vars.end();
+  });
+}
+
+// 写数组时作废所有数组元素的值 (形参数组可能与任何数组重叠), 调用时还要作废全局标量
+template <typename Ctx>
+static void CseKillMemory(Ctx &ctx, bool globals) {
+  CseKillIf(ctx, [&](const typename Ctx::CseEntry &entry) {
+    return entry.reads_memory || (globals && entry.reads_globals);
+  });
+}
+
+template <typename Ctx>
+static void CseKillCall(Ctx &ctx, const std::string &callee) {
+  if (!ctx.prog || !ctx.prog->pure.count(callee)) {
+    CseKillMemory(ctx, true);
+  }
+}
+
+// 循环里被赋值的标量的存储位置, 以及是否写数组, 是否调用可能有副作用的函数
+template <typename Ctx>
+static void LoopWrites(Ctx &ctx, const WhileStmtAST &loop, std::vector<std::string> &tokens,
+                       bool &memory, bool &calls) {
+  VisitStmt(&loop, [&](const BaseAST *stmt) {
+    auto *assign = dynamic_cast<const AssignStmtAST *>(stmt);
+    auto *lval = assign ? dynamic_cast<const LValAST *>(assign->lval.get()) : nullptr;
+    auto *sym = lval ? ctx.FindSymbol(lval->ident) : nullptr;
+    if (lval && lval->indices.empty() && sym && !sym->is_array) {
+      tokens.push_back(CseToken(*sym));
+    } else if (lval) {
+      memory = true;
+    }
+  }, [&](const ExprAST *expr) {
+    auto *call = dynamic_cast<const CallExpAST *>(expr);
+    if (call && (!ctx.prog || !ctx.prog->pure.count(call->ident))) {
+      memory = true;
+      calls = true;
+    }
+  });
+}
+
+// 循环头和循环体从回边进入, 循环里会被改写的值在那里都不能复用
+template <typename Ctx>
+static void CseKillLoop(Ctx &ctx, const WhileStmtAST &loop) {
+  if (ctx.cse.empty()) {
+    return;
+  }
+  std::vector<std::string> tokens;
+  bool memory = false;
+  bool globals = false;
+  LoopWrites(ctx, loop, tokens, memory, globals);
+  CseKillIf(ctx, [&](const typename Ctx::CseEntry &entry) {
+    if ((memory && entry.reads_memory) || (globals && entry.reads_globals)) {
+      return true;
+    }
+    for (const auto &var : entry.vars) {
+      if (std::find(tokens.begin(), tokens.end(), var) != tokens.end()) {
+        return true;
+      }
+    }
+    return false;
+  });
+}
+
+// 给标量赋值后记下或忘掉它的值, 并作废依赖它的公共子表达式
+template <typename Ctx, typename Sym>
+static void SetScalar(Ctx &ctx, const Sym &sym, bool known, int value) {
+  auto token = CseToken(sym);
+  CseKillVar(ctx, token);
+  if (known && !CseGlobal(sym)) {
+    ctx.known_values[token] = value;
+  } else {
+    ctx.known_values.erase(token);
+  }
+}
+
+using KnownValues = std::unordered_map<std::string, int>;
+
+// 分支汇合处只保留每条能走到这里的路径上都相同的值, 以 return/break/continue 结尾的分支不参与
+static KnownValues MergeKnown(const KnownValues *lhs, const KnownValues *rhs) {
+  if (!lhs || !rhs) {
+    return lhs ? *lhs : rhs ? *rhs : KnownValues{};
+  }
+  KnownValues merged;
+  for (const auto &entry : *lhs) {
+    auto found = rhs->find(entry.first);
+    if (found != rhs->end() && found->second == entry.second) {
+      merged.insert(entry);
+    }
+  }
+  return merged;
+}
+
+// 循环里被赋值的标量在循环头处的值不确定
+template <typename Ctx>
+static void ForgetLoopValues(Ctx &ctx, const WhileStmtAST &loop) {
+  std::vector<std::string> tokens;
+  bool memory = false;
+  bool calls = false;
+  LoopWrites(ctx, loop, tokens, memory, calls);
+  for (const auto &token : tokens) {
+    ctx.known_values.erase(token);
+  }
+}
+
+// 先查外提到循环前置块的值, 再查支配当前位置的同一个表达式, 都没有时才生成并记下
+template <typename Ctx, typename Fresh>
+static auto GenReusing(Ctx &ctx, const ExprAST *expr, const Fresh &fresh)
+    -> decltype(fresh()) {
+  auto hoisted = ctx.hoisted.find(expr);
+  if (hoisted != ctx.hoisted.end()) {
+    return hoisted->second;
+  }
+  std::string key;
+  typename Ctx::CseEntry entry;
+  if (ctx.cse.empty() || !CseKey(ctx, expr, key, entry)) {
+    return fresh();
+  }
+  if (auto *hit = CseFind(ctx, key)) {
+    return hit->value;
+  }
+  auto value = fresh();
+  entry.value = value;
+  CseRecord(ctx, key, std::move(entry));
+  return value;
+}
+
+// expr 里不含调用且读了地址键为 key 的数组元素
+static bool ReadsSameElement(RiscvContext &ctx, const ExprAST *expr,
+                             const std::string &key) {
+  bool same = false;
+  bool call = false;
+  VisitExpr(expr, [&](const ExprAST *sub) {
+    call = call || dynamic_cast<const CallExpAST *>(sub);
+    auto *lval = dynamic_cast<const LValAST *>(sub);
+    std::string sub_key;
+    RiscvContext::CseEntry entry;
+    same = same || (lval && !lval->indices.empty() &&
+                    CseAddrKey(ctx, *lval, sub_key, entry) && sub_key == key);
+  });
+  return same && !call;
+}
+
+// 数组元素的地址, 支配当前位置上算过同一个地址时直接复用
+static std::string ElemPtrIR(IRGenContext &ctx, const LValAST &lval) {
+  std::string key;
+  IRGenContext::CseEntry entry;
+  bool keyed = !ctx.cse.empty() && CseAddrKey(ctx, lval, key, entry);
+  if (keyed) {
+    if (auto *hit = CseFind(ctx, key)) {
+      return hit->value;
+    }
+  }
+  auto ptr = lval.GetPtrWithIndices(ctx);
+  if (keyed) {
+    entry.value = ptr;
+    CseRecord(ctx, key, std::move(entry));
+  }
+  return ptr;
+}
+
+// 同上, 地址放进 t0. RISC-V 下记住地址要多占一个栈槽, 由调用方决定是否记下
+static void EmitElemAddrRiscv(RiscvContext &ctx, const LValAST &lval,
+                              const RiscvSymbol &sym) {
+  std::string key;
+  RiscvContext::CseEntry entry;
+  if (!ctx.cse.empty() && CseAddrKey(ctx, lval, key, entry)) {
+    if (auto *hit = CseFind(ctx, key)) {
+      LoadToReg(ctx, hit->value, "t0");
+      return;
+    }
+  }
+  auto idx_vals = lval.GenIndicesRiscv(ctx);
+  lval.EmitAddrRiscv(ctx, sym.dims, idx_vals, sym);
+}
+
+// 在调用点展开函数体: 形参成为新作用域里的局部变量, 临时值和标号照常由 NewTemp/NewLabel 生成
+static std::string GenInlineIR(IRGenContext &ctx, const FuncDefAST &callee,
+                               const std::vector<std::string> &args) {
+  bool is_void = IsVoidFunc(callee);
+  size_t saved_visible = ctx.visible_from;
+  ctx.visible_from = ctx.scopes.size();
+  ctx.PushScope();
+  for (size_t i = 0; i < callee.params.size(); ++i) {
+    const auto &param = callee.params[i];
+    Symbol sym;
+    if (param.is_array) {
+      sym.is_array = true;
+      sym.is_param_ptr = true;
+      sym.dims = EvalDimsIR(param.dims, ctx);
+      sym.ir_name = args[i];
+    } else if (IntLiteralValue(args[i], sym.const_value) &&
+               !AssignsTo(callee.block.get(), param.ident)) {
+      sym.is_const = true;
+    } else {
+      auto alloc = ctx.NewTemp();
+      ctx.Emit(alloc + " = alloc i32");
+      ctx.Emit("store " + args[i] + ", " + alloc);
+      sym.ir_name = alloc;
+    }
+    ctx.AddSymbol(param.ident, sym);
+  }
+  IRGenContext::InlineFrame frame;
+  frame.end_label = ctx.NewLabel("inline_end");
+  if (!is_void) {
+    frame.result = ctx.NewTemp();
+    ctx.Emit(frame.result + " = alloc i32");
+  }
+  ctx.inline_frames.push_back(frame);
+  CsePush(ctx);
+  callee.block->Dump(ctx);
+  CsePop(ctx);
+  if (!callee.block->IsTerminator()) {
+    ctx.Emit("jump " + frame.end_label);
+  }
+  EmitLabel(ctx, frame.end_label);
+  ctx.inline_frames.pop_back();
+  ctx.PopScope();
+  ctx.visible_from = saved_visible;
+  if (is_void) {
+    return "0";
+  }
+  auto tmp = ctx.NewTemp();
+  ctx.Emit(tmp + " = load " + frame.result);
+  return tmp;
+}
+
+static RiscvValue GenInlineRiscv(RiscvContext &ctx, const FuncDefAST &callee,
+                                 const std::vector<RiscvValue> &args) {
+  bool is_void = IsVoidFunc(callee);
+  size_t saved_visible = ctx.visible_from;
+  ctx.visible_from = ctx.scopes.size();
+  ctx.PushScope();
+  for (size_t i = 0; i < callee.params.size(); ++i) {
+    const auto &param = callee.params[i];
+    const RiscvValue &arg = args[i];
+    bool assigned = AssignsTo(callee.block.get(), param.ident);
+    RiscvSymbol sym;
+    if (param.is_array) {
+      sym.is_array = true;
+      sym.is_param_ptr = true;
+      sym.dims = EvalDimsRiscv(param.dims, ctx);
+    }
+    if (param.is_array && arg.is_ptr && arg.ptr_is_stack_slot) {
+      sym.offset = arg.offset;
+    } else if (!param.is_array && arg.is_imm && !assigned) {
+      sym.is_const = true;
+      sym.const_value = arg.imm;
+    } else if (!param.is_array && !arg.is_imm && !arg.is_ptr && !assigned) {
+      // 形参只读时直接复用实参所在的栈槽
+      sym.offset = arg.offset;
+    } else {
+      sym.offset = ctx.AllocSlot();
+      LoadToReg(ctx, arg, "t0");
+      EmitStoreBase(ctx, "t0", "sp", sym.offset);
+    }
+    ctx.AddSymbol(param.ident, sym);
+  }
+  RiscvContext::InlineFrame frame;
+  frame.end_label = ctx.NewLabel("inline_end");
+  if (!is_void) {
+    frame.result_offset = ctx.AllocSlot();
+  }
+  ctx.inline_frames.push_back(frame);
+  CsePush(ctx);
+  callee.block->EmitRiscv(ctx);
+  CsePop(ctx);
+  ctx.EmitLabel(frame.end_label);
+  ctx.inline_frames.pop_back();
+  ctx.PopScope();
+  ctx.visible_from = saved_visible;
+  if (is_void) {
+    return {true, 0, false, false, false, "", 0};
+  }
+  return {false, 0, false, false, false, "", frame.result_offset};
+}
+
+// 函数体里是否有 return f(...) 形式的自递归尾调用
+static bool HasSelfTailCall(const FuncDefAST &func) {
+  bool found = false;
+  VisitStmt(func.block.get(), [&](const BaseAST *stmt) {
+    auto *ret = dynamic_cast<const ReturnStmtAST *>(stmt);
+    if (!ret) {
+      return;
+    }
+    auto *call = dynamic_cast<const CallExpAST *>(ret->value.get());
+    found = found || (call && call->ident == func.ident &&
+                      call->args.size() == func.params.size());
+  }, nullptr);
+  return found;
+}
+
+static bool IsReturnLine(const std::string &line) {
+  return line == "  ret" || line.rfind("  tail ", 0) == 0;
+}
+
+// 尾调用复用当前栈帧: 自递归重新绑定形参后跳回入口, 其余调用在尾声之后用 tail 跳过去.
+// 本帧里有局部数组时实参可能指向它们, 一律不做
+static bool EmitTailCall(RiscvContext &ctx, const CallExpAST &call) {
+  // 插桩时 main 返回前要写出剖析文件
+  if (ctx.current_func_is_void || ctx.has_local_arrays || !ctx.prog ||
+      (options.profile_generate && ctx.func_name == "main")) {
+    return false;
+  }
+  bool self = call.ident == ctx.func_name && !ctx.entry_label.empty();
+  if (self) {
+    if (call.args.size() != ctx.param_offsets.size()) {
+      return false;
+    }
+  } else {
+    // 周期剖析时被调函数的开销要算进调用者的含子调用时间, 不能先拆掉调用者的栈帧
+    auto found = ctx.func_returns_void.find(call.ident);
+    if (options.cycle_profile || found == ctx.func_returns_void.end() || found->second ||
+        call.args.size() > 8 || InlineRefusal(ctx, call).empty()) {
+      return false;
+    }
+  }
+  std::vector<ParallelMove> moves(call.args.size());
+  for (size_t i = 0; i < call.args.size(); ++i) {
+    moves[i].src = call.args[i]->GenRiscv(ctx);
+    if (self) {
+      moves[i].dst_offset = ctx.param_offsets[i];
+    } else {
+      moves[i].dst_reg = "a" + std::to_string(i);
+    }
+  }
+  EmitParallelMoves(ctx, std::move(moves));
+  if (self) {
+    ctx.Emit("j " + ctx.entry_label);
+  } else {
+    ctx.Emit("tail " + call.ident);
+  }
+  return true;
+}
+
+/* =======================
+ * 编译期求值
+ * ======================= */
+// 在编译期解释执行纯函数调用. 遇到求不出的情况 (读未初始化的值, 越界, 除零,
+// 超出步数预算等) 就放弃, 调用照常在运行时执行
+class ConstEvaluator {
+ public:
+  using Lookup = std::function<bool(const std::string &, int &)>;
+
+  ConstEvaluator(const ProgramInfo &prog, Lookup caller_const, Lookup global_const)
+      : prog_(prog),
+        caller_const_(std::move(caller_const)),
+        global_const_(std::move(global_const)),
+        steps_left_(options.const_eval_steps) {}
+
+  bool EvalCall(const CallExpAST &call, int &result) {
+    try {
+      result = Call(call);
+      return true;
+    } catch (const Abort &) {
+      return false;
+    }
+  }
+
+ private:
+  struct Abort {};
+  struct Var {
+    std::vector<int> dims;
+    std::vector<int> data;
+    std::vector<bool> known;
+  };
+  using Scope = std::unordered_map<std::string, Var>;
+  enum class Flow { kNormal, kBreak, kContinue, kReturn };
+
+  static constexpr size_t kMaxDepth = 256;
+
+  const ProgramInfo &prog_;
+  Lookup caller_const_;
+  Lookup global_const_;
+  long steps_left_;
+  std::vector<std::vector<Scope>> frames_;
+  int ret_value_ = 0;
+
+  void Step() {
+    if (--steps_left_ < 0) {
+      throw Abort();
+    }
+  }
+
+  Var *FindVar(const std::string &name) {
+    if (frames_.empty()) {
+      return nullptr;
+    }
+    auto &scopes = frames_.back();
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+      auto found = it->find(name);
+      if (found != it->end()) {
+        return &found->second;
+      }
+    }
+    return nullptr;
+  }
+
+  int Call(const CallExpAST &call) {
+    Step();
+    auto it = prog_.funcs.find(call.ident);
+    if (it == prog_.funcs.end() || !prog_.pure.count(call.ident) ||
+        it->second->params.size() != call.args.size() ||
+        frames_.size() >= kMaxDepth) {
+      throw Abort();
+    }
+    const FuncDefAST &func = *it->second;
+    std::vector<int> args;
+    for (const auto &arg : call.args) {
+      args.push_back(Eval(arg.get()));
+    }
+    frames_.emplace_back();
+    frames_.back().emplace_back();
+    for (size_t i = 0; i < args.size(); ++i) {
+      frames_.back().back()[func.params[i].ident] = {{}, {args[i]}, {true}};
+    }
+    Flow flow = Exec(func.block.get());
+    frames_.pop_back();
+    if (flow != Flow::kReturn && !IsVoidFunc(func)) {
+      throw Abort();
+    }
+    return flow == Flow::kReturn ? ret_value_ : 0;
+  }
+
+  // 把下标折算成扁平下标, 下标个数必须和维数相同
+  size_t Index(const Var &var, const LValAST &lval) {
+    if (lval.indices.size() != var.dims.size()) {
+      throw Abort();
+    }
+    size_t pos = 0;
+    for (size_t i = 0; i < var.dims.size(); ++i) {
+      int idx = Eval(lval.indices[i].get());
+      if (idx < 0 || idx >= var.dims[i]) {
+        throw Abort();
+      }
+      pos = pos * static_cast<size_t>(var.dims[i]) + static_cast<size_t>(idx);
+    }
+    return pos;
+  }
+
+  int Eval(const ExprAST *expr) {
+    Step();
+    if (auto *num = dynamic_cast<const NumberAST *>(expr)) {
+      return num->value;
+    }
+    if (auto *lval = dynamic_cast<const LValAST *>(expr)) {
+      Var *var = FindVar(lval->ident);
+      if (var) {
+        size_t pos = Index(*var, *lval);
+        if (!var->known[pos]) {
+          throw Abort();
+        }
+        return var->data[pos];
+      }
+      int value = 0;
+      const Lookup &lookup = frames_.empty() ? caller_const_ : global_const_;
+      if (!lval->indices.empty() || !lookup(lval->ident, value)) {
+        throw Abort();
+      }
+      return value;
+    }
+    if (auto *unary = dynamic_cast<const UnaryExpAST *>(expr)) {
+      return FoldUnary(unary->op, Eval(unary->rhs.get()));
+    }
+    if (auto *binary = dynamic_cast<const BinaryExpAST *>(expr)) {
+      const std::string &op = binary->op;
+      int lhs = Eval(binary->lhs.get());
+      if (op == "&&" && !lhs) {
+        return 0;
+      }
+      if (op == "||" && lhs) {
+        return 1;
+      }
+      int out = 0;
+      if (!FoldBinary(op, lhs, Eval(binary->rhs.get()), out)) {
+        throw Abort();
+      }
+      return out;
+    }
+    if (auto *call = dynamic_cast<const CallExpAST *>(expr)) {
+      return Call(*call);
+    }
+    throw Abort();
+  }
+
+  template <typename Def>
+  void Declare(const Def &def, bool has_init) {
+    Var var;
+    for (const auto &dim : def.dims) {
+      int len = Eval(dim.get());
+      if (len <= 0) {
+        throw Abort();
+      }
+      var.dims.push_back(len);
+    }
+    auto exprs = BuildInitExprList(def.init.get(), var.dims);
+    var.data.assign(exprs.size(), 0);
+    var.known.assign(exprs.size(), has_init);
+    for (size_t i = 0; i < exprs.size(); ++i) {
+      if (exprs[i]) {
+        var.data[i] = Eval(exprs[i]);
+      }
+    }
+    frames_.back().back()[def.ident] = std::move(var);
+  }
+
+  Flow Exec(const BaseAST *node) {
+    Step();
+    if (!node) {
+      return Flow::kNormal;
+    }
+    if (auto *block = dynamic_cast<const BlockAST *>(node)) {
+      frames_.back().emplace_back();
+      Flow flow = Flow::kNormal;
+      for (const auto &item : block->items) {
+        flow = Exec(item.get());
+        if (flow != Flow::kNormal) {
+          break;
+        }
+      }
+      frames_.back().pop_back();
+      return flow;
+    }
+    if (auto *decl = dynamic_cast<const ConstDeclAST *>(node)) {
+      for (const auto &def : decl->defs) {
+        Declare(def, true);
+      }
+      return Flow::kNormal;
+    }
+    if (auto *decl = dynamic_cast<const VarDeclAST *>(node)) {
+      for (const auto &def : decl->defs) {
+        Declare(def, def.has_init);
+      }
+      return Flow::kNormal;
+    }
+    if (auto *ret = dynamic_cast<const ReturnStmtAST *>(node)) {
+      ret_value_ = ret->value ? Eval(ret->value.get()) : 0;
+      return Flow::kReturn;
+    }
+    if (auto *assign = dynamic_cast<const AssignStmtAST *>(node)) {
+      auto *lval = dynamic_cast<const LValAST *>(assign->lval.get());
+      Var *var = lval ? FindVar(lval->ident) : nullptr;
+      if (!var) {
+        throw Abort();
+      }
+      size_t pos = Index(*var, *lval);
+      var->data[pos] = Eval(assign->value.get());
+      var->known[pos] = true;
+      return Flow::kNormal;
+    }
+    if (auto *stmt = dynamic_cast<const ExprStmtAST *>(node)) {
+      if (stmt->expr) {
+        Eval(stmt->expr.get());
+      }
+      return Flow::kNormal;
+    }
+    if (auto *if_stmt = dynamic_cast<const IfStmtAST *>(node)) {
+      if (Eval(if_stmt->cond.get())) {
+        return Exec(if_stmt->then_stmt.get());
+      }
+      return Exec(if_stmt->else_stmt.get());
+    }
+    if (auto *while_stmt = dynamic_cast<const WhileStmtAST *>(node)) {
+      while (Eval(while_stmt->cond.get())) {
+        Flow flow = Exec(while_stmt->body.get());
+        if (flow == Flow::kBreak) {
+          break;
+        }
+        if (flow == Flow::kReturn) {
+          return flow;
+        }
+      }
+      return Flow::kNormal;
+    }
+    if (dynamic_cast<const BreakStmtAST *>(node)) {
+      return Flow::kBreak;
+    }
+    if (dynamic_cast<const ContinueStmtAST *>(node)) {
+      return Flow::kContinue;
+    }
+    return Flow::kNormal;
+  }
+};
+
+// 纯函数的实参都能在编译期求出时直接算出调用结果. 实参只能引用调用点可见的标量常量,
+// 函数体内只能引用全局标量常量
+template <typename Ctx>
+static bool TryEvalCall(Ctx &ctx, const CallExpAST &call, int &result) {
+  if (!ctx.prog || !ctx.prog->pure.count(call.ident) ||
+      options.const_eval_steps <= 0) {
+    return false;
+  }
+  auto scalar_const = [](const auto *sym, int &value) {
+    if (!sym || !sym->is_const || sym->is_array) {
+      return false;
+    }
+    value = sym->const_value;
+    return true;
+  };
+  ConstEvaluator evaluator(
+      *ctx.prog,
+      [&](const std::string &name, int &value) {
+        return scalar_const(ctx.FindSymbol(name), value);
+      },
+      [&](const std::string &name, int &value) {
+        auto found = ctx.scopes.front().find(name);
+        return found != ctx.scopes.front().end() &&
+               scalar_const(&found->second, value);
+      });
+  if (!evaluator.EvalCall(call, result)) {
+    return false;
+  }
+  if (options.opt_report) {
+    std::cerr << "fold: " << ctx.func_name << " -> " << call.ident << " = "
+              << result << std::endl;
+  }
+  return true;
+}
+
+/* =======================
+ * 循环不变量外提
+ * ======================= */
+static std::string ExprText(const ExprAST *expr) {
+  if (auto *num = dynamic_cast<const NumberAST *>(expr)) {
+    return std::to_string(num->value);
+  }
+  if (auto *lval = dynamic_cast<const LValAST *>(expr)) {
+    std::string text = lval->ident;
+    for (const auto &idx : lval->indices) {
+      text += "[" + ExprText(idx.get()) + "]";
+    }
+    return text;
+  }
+  if (auto *unary = dynamic_cast<const UnaryExpAST *>(expr)) {
+    return unary->op + ExprText(unary->rhs.get());
+  }
+  if (auto *binary = dynamic_cast<const BinaryExpAST *>(expr)) {
+    return "(" + ExprText(binary->lhs.get()) + " " + binary->op + " " +
+           ExprText(binary->rhs.get()) + ")";
+  }
+  if (auto *call = dynamic_cast<const CallExpAST *>(expr)) {
+    std::string text = call->ident + "(";
+    for (size_t i = 0; i < call->args.size(); ++i) {
+      text += (i == 0 ? "" : ", ") + ExprText(call->args[i].get());
+    }
+    return text + ")";
+  }
+  return "?";
+}
+
+static bool ContainsJump(const BaseAST *node) {
+  bool found = false;
+  VisitStmt(node, [&](const BaseAST *stmt) {
+    found = found || dynamic_cast<const ReturnStmtAST *>(stmt) ||
+            dynamic_cast<const BreakStmtAST *>(stmt) ||
+            dynamic_cast<const ContinueStmtAST *>(stmt);
+  }, nullptr);
+  return found;
+}
+
+// 只由字面量, 标量常量和值确定的局部标量组成的表达式在编译期求值
+template <typename Ctx>
+static bool ConstExpr(Ctx &ctx, const ExprAST *expr, int &value) {
+  if (auto *num = dynamic_cast<const NumberAST *>(expr)) {
+    value = num->value;
+    return true;
+  }
+  if (auto *lval = dynamic_cast<const LValAST *>(expr)) {
+    auto *sym = ctx.FindSymbol(lval->ident);
+    if (!sym || sym->is_array) {
+      return false;
+    }
+    if (sym->is_const) {
+      value = sym->const_value;
+      return true;
+    }
+    return KnownScalar(ctx, *sym, value);
+  }
+  if (auto *unary = dynamic_cast<const UnaryExpAST *>(expr)) {
+    if (!ConstExpr(ctx, unary->rhs.get(), value)) {
+      return false;
+    }
+    value = FoldUnary(unary->op, value);
+    return true;
+  }
+  auto *binary = dynamic_cast<const BinaryExpAST *>(expr);
+  int lhs = 0;
+  int rhs = 0;
+  return binary && ConstExpr(ctx, binary->lhs.get(), lhs) &&
+         ConstExpr(ctx, binary->rhs.get(), rhs) &&
+         FoldBinary(binary->op, lhs, rhs, value);
+}
+
+// 整个程序里从没被赋值过的标量变量, 按名字保守判断
+template <typename Ctx>
+static bool NeverAssigned(const Ctx &ctx, const std::string &name) {
+  return ctx.prog && !ctx.prog->assigned_names.count(name);
+}
+
+// 初值能在编译期求出且之后不再被赋值的局部标量直接当常量, 不分配存储
+template <typename Ctx>
+static bool ConstLocal(Ctx &ctx, const VarDef &def, int &value) {
+  return def.dims.empty() && def.has_init && def.init && def.init->is_expr &&
+         NeverAssigned(ctx, def.ident) && ConstExpr(ctx, def.init->expr.get(), value);
+}
+
+struct LoopHoists {
+  std::vector<const ExprAST *> exprs;
+  std::vector<std::pair<const LValAST *, size_t>> rows;  // 数组访问及外提的下标个数
+
+  // 第 pos 个下标为 var + offset, 其余下标不变的数组访问
+  struct IvAccess {
+    const LValAST *lval;
+    std::string var;
+    size_t pos;
+    int offset;
+    bool guaranteed;
+  };
+  std::vector<IvAccess> ivs;
+  // 归纳变量 -> 循环里对它的全部 var = var + c 语句
+  std::unordered_map<std::string, std::vector<std::pair<const AssignStmtAST *, int>>>
+      steps;
+  // 循环条件为 counter op bound, counter 是归纳变量且 bound 不变时记下
+  const LValAST *counter = nullptr;
+  const ExprAST *bound = nullptr;
+  std::string cmp_op;
+  bool lftr = false;                    // 条件可以改成指针比较
+  const AssignStmtAST *step = nullptr;  // counter 每轮在循环体顶层恰好自增一次时的那条语句
+  int step_value = 0;
+  bool innermost = false;
+
+  bool empty() const { return exprs.empty() && rows.empty(); }
+};
+
+// 找出 while 循环里可以提到循环前置块的计算. 名字都按循环开始处的作用域解析,
+// 前置块只在循环至少执行一次时运行, 所以可能出错的计算 (数组读, 除以变量)
+// 只从每轮必定执行的位置外提
+template <typename Ctx>
+class LoopHoister {
+ public:
+  LoopHoister(Ctx &ctx, const WhileStmtAST &loop) : ctx_(ctx), loop_(loop) {}
+
+  LoopHoists Run() {
+    VisitStmt(&loop_, [&](const BaseAST *stmt) {
+      if (auto *assign = dynamic_cast<const AssignStmtAST *>(stmt)) {
+        auto *lval = dynamic_cast<const LValAST *>(assign->lval.get());
+        if (lval && lval->indices.empty()) {
+          assigned_.insert(lval->ident);
+          std::string var;
+          int step = 0;
+          if (MatchLinear(assign->value.get(), var, step) && var == lval->ident) {
+            hoists_.steps[var].emplace_back(assign, step);
+          } else {
+            non_linear_.insert(lval->ident);
+          }
+        } else if (lval) {
+          stored_.insert(lval->ident);
+        }
+      } else if (auto *decl = dynamic_cast<const VarDeclAST *>(stmt)) {
+        for (const auto &def : decl->defs) {
+          declared_.insert(def.ident);
+        }
+      } else if (auto *decl = dynamic_cast<const ConstDeclAST *>(stmt)) {
+        for (const auto &def : decl->defs) {
+          declared_.insert(def.ident);
+        }
+      }
+    }, [&](const ExprAST *expr) {
+      auto *call = dynamic_cast<const CallExpAST *>(expr);
+      if (call && (!ctx_.prog || !ctx_.prog->pure.count(call->ident))) {
+        impure_call_ = true;
+      }
+    });
+    for (const auto &name : stored_) {
+      stores_shared_ = stores_shared_ || IsShared(name);
+    }
+    CollectExpr(loop_.cond.get(), true);
+    CollectStmt(loop_.body.get(), true);
+    for (auto it = hoists_.steps.begin(); it != hoists_.steps.end();) {
+      it = IsIv(it->first) ? std::next(it) : hoists_.steps.erase(it);
+    }
+    // 收集访问时还看不出下标变量是不是全局的或者后面有非线性赋值, 这里一并去掉
+    auto &ivs = hoists_.ivs;
+    ivs.erase(std::remove_if(ivs.begin(), ivs.end(),
+                             [&](const LoopHoists::IvAccess &iv) {
+                               return !hoists_.steps.count(iv.var);
+                             }),
+              ivs.end());
+    FindCounter();
+    FindLftr();
+    return std::move(hoists_);
+  }
+
+ private:
+  Ctx &ctx_;
+  const WhileStmtAST &loop_;
+  std::unordered_set<std::string> assigned_;
+  std::unordered_set<std::string> declared_;
+  std::unordered_set<std::string> stored_;
+  std::unordered_set<std::string> non_linear_;
+  bool impure_call_ = false;
+  bool stores_shared_ = false;
+  LoopHoists hoists_;
+
+  bool IsGlobal(const std::string &name) {
+    auto *sym = ctx_.FindSymbol(name);
+    auto found = ctx_.scopes.front().find(name);
+    return sym && found != ctx_.scopes.front().end() && &found->second == sym;
+  }
+
+  // 全局数组和数组形参之间可能互为别名
+  bool IsShared(const std::string &name) {
+    auto *sym = ctx_.FindSymbol(name);
+    return sym && (sym->is_param_ptr || IsGlobal(name));
+  }
+
+  bool IsConstScalar(const ExprAST *expr) {
+    auto *lval = dynamic_cast<const LValAST *>(expr);
+    if (!lval) {
+      return dynamic_cast<const NumberAST *>(expr) != nullptr;
+    }
+    auto *sym = ctx_.FindSymbol(lval->ident);
+    return sym && sym->is_const && !sym->is_array;
+  }
+
+  bool HasVar(const ExprAST *expr) {
+    bool found = false;
+    VisitExpr(expr, [&](const ExprAST *node) {
+      found = found || (dynamic_cast<const LValAST *>(node) && !IsConstScalar(node));
+    });
+    return found;
+  }
+
+  bool IsFullIndex(const LValAST &lval) {
+    auto *sym = ctx_.FindSymbol(lval.ident);
+    size_t full = sym->is_param_ptr ? sym->dims.size() + 1 : sym->dims.size();
+    return sym->is_array && lval.indices.size() == full;
+  }
+
+  bool ConstValue(const ExprAST *expr, int &value) {
+    return ConstExpr(ctx_, expr, value);
+  }
+
+  // 形如 v, v + c, v - c, c + v 的表达式, v 是标量变量, c 是常量
+  bool MatchLinear(const ExprAST *expr, std::string &var, int &c) {
+    auto scalar_var = [&](const ExprAST *node) {
+      auto *lval = dynamic_cast<const LValAST *>(node);
+      auto *sym = lval ? ctx_.FindSymbol(lval->ident) : nullptr;
+      if (!sym || sym->is_array || sym->is_const || !lval->indices.empty()) {
+        return false;
+      }
+      var = lval->ident;
+      return true;
+    };
+    if (scalar_var(expr)) {
+      c = 0;
+      return true;
+    }
+    auto *binary = dynamic_cast<const BinaryExpAST *>(expr);
+    if (!binary || (binary->op != "+" && binary->op != "-")) {
+      return false;
+    }
+    int value = 0;
+    if (scalar_var(binary->lhs.get()) && ConstValue(binary->rhs.get(), value)) {
+      c = binary->op == "+" ? value : -value;
+      return true;
+    }
+    if (binary->op == "+" && ConstValue(binary->lhs.get(), value) &&
+        scalar_var(binary->rhs.get())) {
+      c = value;
+      return true;
+    }
+    return false;
+  }
+
+  // 归纳变量: 循环外声明的局部标量, 循环里每次赋值都是自身加减常量
+  bool IsIv(const std::string &name) {
+    return hoists_.steps.count(name) && !non_linear_.count(name) &&
+           !declared_.count(name) && !IsGlobal(name);
+  }
+
+  void CollectIv(const LValAST &lval, bool guaranteed) {
+    auto *sym = ctx_.FindSymbol(lval.ident);
+    if (!sym || !sym->is_array || lval.indices.empty() ||
+        declared_.count(lval.ident)) {
+      return;
+    }
+    LoopHoists::IvAccess iv{&lval, "", lval.indices.size(), 0, guaranteed};
+    for (size_t i = 0; i < lval.indices.size(); ++i) {
+      const ExprAST *idx = lval.indices[i].get();
+      std::string var;
+      int c = 0;
+      if (Invariant(idx)) {
+        if (!guaranteed && MayFault(idx)) {
+          return;
+        }
+        continue;
+      }
+      if (iv.pos != lval.indices.size() || !MatchLinear(idx, var, c)) {
+        return;
+      }
+      iv.pos = i;
+      iv.var = var;
+      iv.offset = c;
+    }
+    if (iv.pos != lval.indices.size() && hoists_.steps.count(iv.var) &&
+        !non_linear_.count(iv.var)) {
+      hoists_.ivs.push_back(iv);
+    }
+  }
+
+  void FindCounter() {
+    auto *cmp = dynamic_cast<const BinaryExpAST *>(loop_.cond.get());
+    if (!cmp || (cmp->op != "<" && cmp->op != "<=" && cmp->op != ">" &&
+                 cmp->op != ">=" && cmp->op != "!=")) {
+      return;
+    }
+    auto *counter = dynamic_cast<const LValAST *>(cmp->lhs.get());
+    if (!counter || !counter->indices.empty() || !IsIv(counter->ident) ||
+        !Invariant(cmp->rhs.get())) {
+      return;
+    }
+    hoists_.counter = counter;
+    hoists_.bound = cmp->rhs.get();
+    hoists_.cmp_op = cmp->op;
+    const auto &steps = hoists_.steps.at(counter->ident);
+    auto *block = dynamic_cast<const BlockAST *>(loop_.body.get());
+    bool top_level = steps.size() == 1 &&
+                     (loop_.body.get() == steps[0].first ||
+                      (block && std::any_of(block->items.begin(), block->items.end(),
+                                            [&](const std::unique_ptr<BaseAST> &item) {
+                                              return item.get() == steps[0].first;
+                                            })));
+    if (top_level && steps[0].second != 0 && !ContainsJump(loop_.body.get())) {
+      hoists_.step = steps[0].first;
+      hoists_.step_value = steps[0].second;
+    }
+    hoists_.innermost = true;
+    VisitStmt(loop_.body.get(), [&](const BaseAST *stmt) {
+      hoists_.innermost = hoists_.innermost && !dynamic_cast<const WhileStmtAST *>(stmt);
+    }, nullptr);
+  }
+
+  // 计数器只出现在自增, 循环条件和按它走的数组下标里, 且每轮必定经过其中一次访问时,
+  // 条件可以改成比较指针. 循环里有跳转时不做
+  void FindLftr() {
+    const LValAST *counter = hoists_.counter;
+    if (!counter || hoists_.cmp_op == ">" || hoists_.cmp_op == ">=" ||
+        ContainsJump(loop_.body.get())) {
+      return;
+    }
+    const auto &steps = hoists_.steps.at(counter->ident);
+    for (const auto &step : steps) {
+      if (step.second <= 0) {
+        return;
+      }
+    }
+    size_t refs = 0;
+    VisitStmt(&loop_, nullptr, [&](const ExprAST *expr) {
+      auto *lval = dynamic_cast<const LValAST *>(expr);
+      refs += lval && lval->ident == counter->ident;
+    });
+    size_t accounted = 1 + 2 * steps.size();
+    bool anchored = false;
+    for (const auto &iv : hoists_.ivs) {
+      if (iv.var == counter->ident) {
+        ++accounted;
+        anchored = anchored || iv.guaranteed;
+      }
+    }
+    hoists_.lftr = refs == accounted && anchored;
+  }
+
+  bool Invariant(const ExprAST *expr) {
+    if (dynamic_cast<const NumberAST *>(expr)) {
+      return true;
+    }
+    if (auto *lval = dynamic_cast<const LValAST *>(expr)) {
+      auto *sym = ctx_.FindSymbol(lval->ident);
+      if (!sym || assigned_.count(lval->ident) || declared_.count(lval->ident)) {
+        return false;
+      }
+      for (const auto &idx : lval->indices) {
+        if (!Invariant(idx.get())) {
+          return false;
+        }
+      }
+      if (sym->is_array) {
+        return !IsFullIndex(*lval) ||
+               (!impure_call_ && !stored_.count(lval->ident) &&
+                !(stores_shared_ && IsShared(lval->ident)));
+      }
+      return sym->is_const || !IsGlobal(lval->ident) || !impure_call_;
+    }
+    if (auto *unary = dynamic_cast<const UnaryExpAST *>(expr)) {
+      return Invariant(unary->rhs.get());
+    }
+    if (auto *binary = dynamic_cast<const BinaryExpAST *>(expr)) {
+      return Invariant(binary->lhs.get()) && Invariant(binary->rhs.get());
+    }
+    return false;
+  }
+
+  // 只外提能省下指令的计算: 局部标量和常量本来就只要一次读取
+  bool Worth(const ExprAST *expr) {
+    if (auto *lval = dynamic_cast<const LValAST *>(expr)) {
+      auto *sym = ctx_.FindSymbol(lval->ident);
+      return sym->is_array ? !lval->indices.empty()
+                           : !sym->is_const && IsGlobal(lval->ident);
+    }
+    if (auto *unary = dynamic_cast<const UnaryExpAST *>(expr)) {
+      return unary->op != "+" && HasVar(unary->rhs.get());
+    }
+    return dynamic_cast<const BinaryExpAST *>(expr) && HasVar(expr);
+  }
+
+  bool MayFault(const ExprAST *expr) {
+    bool found = false;
+    VisitExpr(expr, [&](const ExprAST *node) {
+      if (auto *lval = dynamic_cast<const LValAST *>(node)) {
+        auto *sym = ctx_.FindSymbol(lval->ident);
+        found = found || (sym && sym->is_array && IsFullIndex(*lval));
+      } else if (auto *binary = dynamic_cast<const BinaryExpAST *>(node)) {
+        auto *num = dynamic_cast<const NumberAST *>(binary->rhs.get());
+        found = found || ((binary->op == "/" || binary->op == "%") &&
+                          (!num || num->value == 0));
+      }
+    });
+    return found;
+  }
+
+  // 数组访问的前若干个下标不变时, 把这部分地址算好
+  size_t CollectRow(const LValAST &lval, bool guaranteed) {
+    auto *sym = ctx_.FindSymbol(lval.ident);
+    if (!sym || !sym->is_array || declared_.count(lval.ident) ||
+        ctx_.hoisted_rows.count(&lval)) {
+      return 0;
+    }
+    size_t prefix = 0;
+    bool has_var = false;
+    while (prefix < lval.indices.size()) {
+      const ExprAST *idx = lval.indices[prefix].get();
+      if (!Invariant(idx) || (!guaranteed && MayFault(idx))) {
+        break;
+      }
+      has_var = has_var || HasVar(idx);
+      ++prefix;
+    }
+    if (prefix == 0 || !has_var) {
+      return 0;
+    }
+    hoists_.rows.emplace_back(&lval, prefix);
+    return prefix;
+  }
+
+  void CollectExpr(const ExprAST *expr, bool guaranteed) {
+    if (!expr || ctx_.hoisted.count(expr)) {
+      return;
+    }
+    if (Invariant(expr) && Worth(expr) && (guaranteed || !MayFault(expr))) {
+      hoists_.exprs.push_back(expr);
+      return;
+    }
+    if (auto *lval = dynamic_cast<const LValAST *>(expr)) {
+      CollectIv(*lval, guaranteed);
+      CollectIndices(*lval, guaranteed);
+    } else if (auto *unary = dynamic_cast<const UnaryExpAST *>(expr)) {
+      CollectExpr(unary->rhs.get(), guaranteed);
+    } else if (auto *binary = dynamic_cast<const BinaryExpAST *>(expr)) {
+      bool short_circuit = binary->op == "&&" || binary->op == "||";
+      CollectExpr(binary->lhs.get(), guaranteed);
+      CollectExpr(binary->rhs.get(), guaranteed && !short_circuit);
+    } else if (auto *call = dynamic_cast<const CallExpAST *>(expr)) {
+      for (const auto &arg : call->args) {
+        CollectExpr(arg.get(), guaranteed);
+      }
+    }
+  }
+
+  void CollectIndices(const LValAST &lval, bool guaranteed) {
+    for (size_t i = CollectRow(lval, guaranteed); i < lval.indices.size(); ++i) {
+      CollectExpr(lval.indices[i].get(), guaranteed);
+    }
+  }
+
+  void CollectInit(const InitValAST *init, bool guaranteed) {
+    if (!init) {
+      return;
+    }
+    if (init->is_expr) {
+      CollectExpr(init->expr.get(), guaranteed);
+      return;
+    }
+    for (const auto &child : init->list) {
+      CollectInit(child.get(), guaranteed);
+    }
+  }
+
+  // 返回这条语句之后的语句是否仍然每轮必定执行
+  bool CollectStmt(const BaseAST *node, bool guaranteed) {
+    if (auto *block = dynamic_cast<const BlockAST *>(node)) {
+      for (const auto &item : block->items) {
+        guaranteed = CollectStmt(item.get(), guaranteed);
+      }
+      return guaranteed;
+    }
+    if (auto *decl = dynamic_cast<const VarDeclAST *>(node)) {
+      for (const auto &def : decl->defs) {
+        CollectInit(def.init.get(), guaranteed);
+      }
+      return guaranteed;
+    }
+    if (auto *ret = dynamic_cast<const ReturnStmtAST *>(node)) {
+      CollectExpr(ret->value.get(), guaranteed);
+      return false;
+    }
+    if (auto *assign = dynamic_cast<const AssignStmtAST *>(node)) {
+      CollectExpr(assign->value.get(), guaranteed);
+      auto *lval = dynamic_cast<const LValAST *>(assign->lval.get());
+      if (lval) {
+        CollectIv(*lval, guaranteed);
+        CollectIndices(*lval, guaranteed);
+      }
+      return guaranteed;
+    }
+    if (auto *stmt = dynamic_cast<const ExprStmtAST *>(node)) {
+      CollectExpr(stmt->expr.get(), guaranteed);
+      return guaranteed;
+    }
+    if (auto *if_stmt = dynamic_cast<const IfStmtAST *>(node)) {
+      CollectExpr(if_stmt->cond.get(), guaranteed);
+      CollectStmt(if_stmt->then_stmt.get(), false);
+      CollectStmt(if_stmt->else_stmt.get(), false);
+      return guaranteed && !ContainsJump(node);
+    }
+    if (auto *while_stmt = dynamic_cast<const WhileStmtAST *>(node)) {
+      CollectExpr(while_stmt->cond.get(), guaranteed);
+      CollectStmt(while_stmt->body.get(), false);
+      return guaranteed && !ContainsJump(node);
+    }
+    return guaranteed && !ContainsJump(node);
+  }
+};
+
+template <typename Ctx>
+static void ReportHoists(const Ctx &ctx, const LoopHoists &hoists) {
+  if (!options.opt_report) {
+    return;
+  }
+  for (const auto *expr : hoists.exprs) {
+    std::cerr << "licm: " << ctx.func_name << ": hoisted " << ExprText(expr)
+              << std::endl;
+  }
+  for (const auto &row : hoists.rows) {
+    std::string text = row.first->ident;
+    for (size_t i = 0; i < row.second; ++i) {
+      text += "[" + ExprText(row.first->indices[i].get()) + "]";
+    }
+    std::cerr << "licm: " << ctx.func_name << ": hoisted address of " << text
+              << std::endl;
+  }
+}
+
+template <typename Ctx>
+static void ForgetHoists(Ctx &ctx, const LoopHoists &hoists) {
+  for (const auto *expr : hoists.exprs) {
+    ctx.hoisted.erase(expr);
+  }
+  for (const auto &row : hoists.rows) {
+    ctx.hoisted_rows.erase(row.first);
+  }
+}
+
+// 第 pos 个下标加一时地址增加的元素个数
+static int64_t IndexStride(const RiscvSymbol &sym, size_t pos) {
+  if (sym.is_param_ptr) {
+    return Product(sym.dims, pos == 0 ? 0 : pos);
+  }
+  return Product(sym.dims, pos + 1);
+}
+
+static bool ExprMentions(const ExprAST *expr, const std::string &name) {
+  bool found = false;
+  VisitExpr(expr, [&](const ExprAST *node) {
+    auto *lval = dynamic_cast<const LValAST *>(node);
+    found = found || (lval && lval->ident == name);
+  });
+  return found;
+}
+
+static bool Mentions(const BaseAST *node, const std::string &name) {
+  bool found = false;
+  VisitStmt(node, nullptr, [&](const ExprAST *expr) {
+    auto *lval = dynamic_cast<const LValAST *>(expr);
+    found = found || (lval && lval->ident == name);
+  });
+  return found;
+}
+
+static bool DeclaresName(const BaseAST *node, const std::string &name) {
+  bool found = false;
+  if (auto *decl = dynamic_cast<const VarDeclAST *>(node)) {
+    for (const auto &def : decl->defs) {
+      found = found || def.ident == name;
+    }
+  } else if (auto *decl = dynamic_cast<const ConstDeclAST *>(node)) {
+    for (const auto &def : decl->defs) {
+      found = found || def.ident == name;
+    }
+  }
+  return found;
+}
+
+// 当前循环结束后 name 的值是否不会再被读到: 沿外层语句块向外看后面的语句, 直到离开
+// 声明它的块. 先遇到不读它自己的赋值就算死, 中途经过外层循环时保守地认为仍然活跃
+static bool DeadAfterLoop(const RiscvContext &ctx, const std::string &name) {
+  for (auto it = ctx.open_blocks.rbegin(); it != ctx.open_blocks.rend(); ++it) {
+    if (!it->first) {
+      return false;
+    }
+    const auto &items = it->first->items;
+    for (size_t i = it->second + 1; i < items.size(); ++i) {
+      if (!Mentions(items[i].get(), name)) {
+        continue;
+      }
+      auto *assign = dynamic_cast<const AssignStmtAST *>(items[i].get());
+      auto *lval = assign ? dynamic_cast<const LValAST *>(assign->lval.get()) : nullptr;
+      return lval && lval->ident == name && !ExprMentions(assign->value.get(), name);
+    }
+    for (size_t i = 0; i <= it->second && i < items.size(); ++i) {
+      if (DeclaresName(items[i].get(), name)) {
+        return true;
+      }
+    }
+  }
+  return true;
+}
+
+// 条件改成指针比较后的循环出口
+struct LftrExit {
+  bool active = false;
+  int ptr_slot = 0;
+  int end_slot = 0;
+  std::string op;
+};
+
+// 按同一个归纳变量走、其余下标相同的数组访问共用一个指针槽, 槽里始终是归纳变量取当前值
+// 时的地址, 各访问再加上自己的常量偏移; 归纳变量每次自增都同步推进指针
+static LftrExit EmitIvPointersRiscv(RiscvContext &ctx, const LoopHoists &hoists,
+                                    bool allow_lftr) {
+  struct Group {
+    int slot;
+    int stride;
+    std::string var;
+    bool anchored;
+  };
+  std::unordered_map<std::string, Group> groups;
+  std::unordered_set<std::string> skipped;
+  for (const auto &iv : hoists.ivs) {
+    bool taken = ctx.iv_access.count(iv.lval) > 0;
+    for (const auto &step : hoists.steps.at(iv.var)) {
+      taken = taken || ctx.iv_steps.count(step.first);
+    }
+    if (taken) {
+      skipped.insert(iv.var);
+      continue;
+    }
+    auto *sym = ctx.FindSymbol(iv.lval->ident);
+    int stride = static_cast<int>(IndexStride(*sym, iv.pos) * 4);
+    std::string key = iv.lval->ident + "|" + iv.var + "|" + std::to_string(iv.pos);
+    for (size_t i = 0; i < iv.lval->indices.size(); ++i) {
+      key += "|" + (i == iv.pos ? "" : ExprText(iv.lval->indices[i].get()));
+    }
+    auto group = groups.find(key);
+    if (group == groups.end()) {
+      auto idx_vals = iv.lval->GenIndicesRiscv(ctx);
+      iv.lval->EmitAddrRiscv(ctx, sym->dims, idx_vals, *sym);
+      EmitAddImm(ctx, "t0", "t0", -iv.offset * stride);
+      int slot = StoreFromReg(ctx, "t0").offset;
+      group = groups.emplace(key, Group{slot, stride, iv.var, false}).first;
+      if (options.opt_report) {
+        std::cerr << "iv: " << ctx.func_name << ": " << ExprText(iv.lval)
+                  << " walked by pointer, " << stride << " bytes per step of "
+                  << iv.var << std::endl;
+      }
+    }
+    group->second.anchored = group->second.anchored || iv.guaranteed;
+    ctx.iv_access[iv.lval] = {group->second.slot, iv.offset * stride};
+  }
+  for (const auto &entry : groups) {
+    const Group &group = entry.second;
+    for (const auto &step : hoists.steps.at(group.var)) {
+      ctx.iv_steps[step.first].bumps.emplace_back(group.slot,
+                                                  step.second * group.stride);
+    }
+  }
+
+  LftrExit exit;
+  if (!hoists.lftr || !allow_lftr) {
+    return exit;
+  }
+  const std::string &var = hoists.counter->ident;
+  auto anchor = std::find_if(groups.begin(), groups.end(), [&](const auto &entry) {
+    return entry.second.var == var && entry.second.anchored;
+  });
+  if (skipped.count(var) || anchor == groups.end() || !DeadAfterLoop(ctx, var)) {
+    return exit;
+  }
+  // 终点指针 = 当前指针 + (bound - var) * stride
+  LoadToReg(ctx, hoists.bound->GenRiscv(ctx), "t1");
+  LoadToReg(ctx, hoists.counter->GenRiscv(ctx), "t2");
+  ctx.Emit("sub t1, t1, t2");
+  ctx.Emit("li t3, " + std::to_string(anchor->second.stride));
+  ctx.Emit("mul t1, t1, t3");
+  EmitLoadBase(ctx, "t0", "sp", anchor->second.slot);
+  ctx.Emit("add t0, t0, t1");
+  exit.active = true;
+  exit.ptr_slot = anchor->second.slot;
+  exit.end_slot = StoreFromReg(ctx, "t0").offset;
+  exit.op = hoists.cmp_op;
+  for (const auto &step : hoists.steps.at(var)) {
+    ctx.iv_steps[step.first].counter_dead = true;
+  }
+  if (options.opt_report) {
+    std::cerr << "lftr: " << ctx.func_name << ": counter " << var
+              << " replaced by pointer compare" << std::endl;
+  }
+  return exit;
+}
+
+// 从 ptr 出发依次按第 first 到 last-1 个下标取元素地址, 数组形参的第一维用 getptr
+static std::string GenIndexedPtr(IRGenContext &ctx, const Symbol &sym,
+                                 std::string ptr, const LValAST &lval,
+                                 size_t first, size_t last) {
+  if (first == 0 && last == 0 && !sym.is_param_ptr) {
+    auto next = ctx.NewTemp();
+    ctx.Emit(next + " = getelemptr " + ptr + ", 0");
+    return next;
+  }
+  for (size_t i = first; i < last; ++i) {
+    auto idx = lval.indices[i]->Gen(ctx);
+    auto next = ctx.NewTemp();
+    const char *op = sym.is_param_ptr && i == 0 ? " = getptr " : " = getelemptr ";
+    ctx.Emit(next + op + ptr + ", " + idx);
+    ptr = next;
+  }
+  return ptr;
+}
+
+// 在循环前置块里把外提的值算好
+static void EmitHoistsIR(IRGenContext &ctx, const LoopHoists &hoists) {
+  for (const auto *expr : hoists.exprs) {
+    auto val = expr->Gen(ctx);
+    ctx.hoisted[expr] = val;
+  }
+  for (const auto &row : hoists.rows) {
+    auto *sym = ctx.FindSymbol(row.first->ident);
+    auto ptr = GenIndexedPtr(ctx, *sym, sym->ir_name, *row.first, 0, row.second);
+    ctx.hoisted_rows[row.first] = {ptr, row.second};
+  }
+}
+
+static void EmitHoistsRiscv(RiscvContext &ctx, const LoopHoists &hoists) {
+  for (const auto *expr : hoists.exprs) {
+    auto val = expr->GenRiscv(ctx);
+    ctx.hoisted[expr] = val;
+  }
+  for (const auto &row : hoists.rows) {
+    auto *sym = ctx.FindSymbol(row.first->ident);
+    std::vector<RiscvValue> idx_vals;
+    for (size_t i = 0; i < row.second; ++i) {
+      idx_vals.push_back(row.first->indices[i]->GenRiscv(ctx));
+    }
+    row.first->EmitAddrRiscv(ctx, sym->dims, idx_vals, *sym);
+    ctx.hoisted_rows[row.first] = {StoreFromReg(ctx, "t0"), row.second};
+  }
+}
+
+/* =======================
+ * 循环展开
+ * ======================= */
+// 紧挨在循环前面、把 name 设成常量的那条语句给出的初值
+template <typename Ctx>
+static bool InitialValue(Ctx &ctx, const WhileStmtAST &loop, const std::string &name,
+                         int &value) {
+  if (ctx.open_blocks.empty() || !ctx.open_blocks.back().first) {
+    return false;
+  }
+  const auto &items = ctx.open_blocks.back().first->items;
+  size_t pos = ctx.open_blocks.back().second;
+  if (pos == 0 || pos >= items.size() || items[pos].get() != &loop) {
+    return false;
+  }
+  const BaseAST *prev = items[pos - 1].get();
+  if (auto *decl = dynamic_cast<const VarDeclAST *>(prev)) {
+    const auto &def = decl->defs.back();
+    return def.ident == name && def.dims.empty() && def.has_init && def.init &&
+           def.init->is_expr && ConstExpr(ctx, def.init->expr.get(), value);
+  }
+  auto *assign = dynamic_cast<const AssignStmtAST *>(prev);
+  auto *lval = assign ? dynamic_cast<const LValAST *>(assign->lval.get()) : nullptr;
+  return lval && lval->ident == name && lval->indices.empty() &&
+         ConstExpr(ctx, assign->value.get(), value);
+}
+
+// 迭代次数为常量且展开后不超过预算的最内层循环整个展开: 每份循环体里计数器都绑定成
+// 常量, 交给常量折叠和地址折叠, 计数器的自增在编译期完成. 成功时给出计数器的终值
+template <typename Ctx, typename EmitItem>
+static bool FullyUnroll(Ctx &ctx, const WhileStmtAST &loop, const LoopHoists &hoists,
+                        const EmitItem &emit_item, int &final_value) {
+  // 剖析里一次也没迭代过的循环展开了也只是占地方
+  if (!options.unroll || !hoists.step || !hoists.innermost ||
+      DeclaresArray(loop.body.get()) || EdgeCount(ctx, loop, 1) == 0) {
+    return false;
+  }
+  const std::string &var = hoists.counter->ident;
+  int bound = 0;
+  int value = 0;
+  if (!ConstExpr(ctx, hoists.bound, bound) ||
+      (!InitialValue(ctx, loop, var, value) &&
+       !ConstExpr(ctx, hoists.counter, value))) {
+    return false;
+  }
+  int trips = 0;
+  int cur = value;
+  int taken = 0;
+  while (FoldBinary(hoists.cmp_op, cur, bound, taken) && taken) {
+    if (++trips > options.unroll_max_trips) {
+      return false;
+    }
+    FoldBinary("+", cur, hoists.step_value, cur);
+  }
+  if (trips * CountNodes(loop.body.get()) > options.unroll_budget) {
+    return false;
+  }
+  std::vector<const BaseAST *> items;
+  if (auto *block = dynamic_cast<const BlockAST *>(loop.body.get())) {
+    for (const auto &item : block->items) {
+      items.push_back(item.get());
+    }
+  } else {
+    items.push_back(loop.body.get());
+  }
+  for (int t = 0; t < trips; ++t) {
+    auto sym = *ctx.FindSymbol(var);
+    sym.is_const = true;
+    sym.const_value = value;
+    ctx.PushScope();
+    ctx.AddSymbol(var, sym);
+    for (const auto *item : items) {
+      if (item == hoists.step) {
+        FoldBinary("+", ctx.FindSymbol(var)->const_value, hoists.step_value,
+                   ctx.FindSymbol(var)->const_value);
+      } else {
+        emit_item(item);
+      }
+    }
+    value = ctx.FindSymbol(var)->const_value;
+    ctx.PopScope();
+  }
+  final_value = value;
+  if (options.opt_report) {
+    std::cerr << "unroll: " << ctx.func_name << ": fully unrolled loop on " << var
+              << " (" << trips << " iterations)" << std::endl;
+  }
+  return true;
+}
+
+// 部分展开的份数, 1 表示不展开. 只处理计数器朝上界单调逼近的最内层循环, 主循环每轮
+// 跑 factor 份循环体, 剩余的迭代交给原循环
+template <typename Ctx>
+static int UnrollFactor(const Ctx &ctx, const LoopHoists &hoists, const WhileStmtAST &loop) {
+  // 能改成指针比较的循环计数器本身会被删掉, 展开反而多出计数器的自增
+  if (!options.unroll || !hoists.step || !hoists.innermost || hoists.lftr ||
+      options.unroll_factor < 2 || DeclaresArray(loop.body.get())) {
+    return 1;
+  }
+  bool up = (hoists.cmp_op == "<" || hoists.cmp_op == "<=") && hoists.step_value > 0;
+  bool down = (hoists.cmp_op == ">" || hoists.cmp_op == ">=") && hoists.step_value < 0;
+  if (!up && !down) {
+    return 1;
+  }
+  int nodes = std::max(1, CountNodes(loop.body.get()));
+  int factor = std::min(options.unroll_factor, options.unroll_budget / nodes);
+  // 有剖析数据时不超过每次进入循环的平均迭代次数, 否则主循环一轮也跑不满
+  long long entered = EdgeCount(ctx, loop, 0);
+  if (entered >= 0) {
+    factor = static_cast<int>(std::min<long long>(
+        factor, entered ? EdgeCount(ctx, loop, 1) / entered : 0));
+  }
+  // 主循环条件里的 bound - (factor - 1) * step 不能溢出
+  if (factor < 2 || std::abs(hoists.step_value) > INT_MAX / 2 / factor) {
+    return 1;
+  }
+  return factor;
+}
+
+// 主循环: 计数器离上界还够 factor 轮时连跑 factor 份循环体, 否则转到原循环收尾.
+// 上界减去 (factor - 1) * step 溢出时主循环一轮也不跑
+static void EmitUnrolledIR(IRGenContext &ctx, const WhileStmtAST &loop,
+                           const LoopHoists &hoists, int factor,
+                           const std::string &rest_label) {
+  auto main_label = ctx.NewLabel("unroll_cond");
+  auto body_label = ctx.NewLabel("unroll_body");
+  int k = (factor - 1) * hoists.step_value;
+  bool up = hoists.step_value > 0;
+  auto bound = hoists.bound->Gen(ctx);
+  std::string limit;
+  int bound_val = 0;
+  if (IntLiteralValue(bound, bound_val)) {
+    int limit_val = 0;
+    FoldBinary("-", bound_val, k, limit_val);
+    if (up ? limit_val > bound_val : limit_val < bound_val) {
+      ctx.Emit("jump " + rest_label);
+      return;
+    }
+    limit = std::to_string(limit_val);
+    ctx.Emit("jump " + main_label);
+  } else {
+    limit = ctx.NewTemp();
+    ctx.Emit(limit + " = sub " + bound + ", " + std::to_string(k));
+    auto wrapped = ctx.NewTemp();
+    ctx.Emit(wrapped + (up ? " = gt " : " = lt ") + limit + ", " + bound);
+    ctx.Emit("br " + wrapped + ", " + rest_label + ", " + main_label);
+  }
+  EmitLabel(ctx, main_label);
+  const std::string &op = hoists.cmp_op;
+  const char *inst = op == "<" ? " = lt " : op == "<=" ? " = le " : op == ">" ? " = gt " : " = ge ";
+  auto var = hoists.counter->Gen(ctx);
+  auto taken = ctx.NewTemp();
+  ctx.Emit(taken + inst + var + ", " + limit);
+  ctx.Emit("br " + taken + ", " + body_label + ", " + rest_label);
+  EmitLabel(ctx, body_label);
+  for (int i = 0; i < factor; ++i) {
+    loop.body->Dump(ctx);
+  }
+  ctx.Emit("jump " + main_label);
+}
+
+static void EmitUnrolledRiscv(RiscvContext &ctx, const WhileStmtAST &loop,
+                              const LoopHoists &hoists, int factor,
+                              const std::string &rest_label) {
+  auto main_label = ctx.NewLabel("unroll_cond");
+  int k = (factor - 1) * hoists.step_value;
+  bool up = hoists.step_value > 0;
+  auto bound = hoists.bound->GenRiscv(ctx);
+  RiscvValue limit;
+  if (bound.is_imm) {
+    int limit_val = 0;
+    FoldBinary("-", bound.imm, k, limit_val);
+    if (up ? limit_val > bound.imm : limit_val < bound.imm) {
+      ctx.Emit("j " + rest_label);
+      return;
+    }
+    limit = RiscvValue{true, limit_val, false, false, false, "", 0};
+  } else {
+    LoadToReg(ctx, bound, "t1");
+    EmitAddImm(ctx, "t0", "t1", -k);
+    ctx.Emit(up ? "slt t2, t1, t0" : "slt t2, t0, t1");
+    ctx.Emit("bnez t2, " + rest_label);
+    limit = StoreFromReg(ctx, "t0");
+  }
+  ctx.EmitLabel(main_label);
+  LoadToReg(ctx, hoists.counter->GenRiscv(ctx), "t0");
+  LoadToReg(ctx, limit, "t1");
+  // t2 = (var < limit) 或 (var > limit), 不含等号的比较取反后看 t2 是否为 1
+  const std::string &op = hoists.cmp_op;
+  bool less = op == "<" || op == ">=";
+  ctx.Emit(less ? "slt t2, t0, t1" : "slt t2, t1, t0");
+  bool strict = op == "<" || op == ">";
+  ctx.Emit(std::string(strict ? "beqz" : "bnez") + " t2, " + rest_label);
+  ctx.open_blocks.emplace_back(nullptr, 0);
+  for (int i = 0; i < factor; ++i) {
+    loop.body->EmitRiscv(ctx);
+  }
+  ctx.open_blocks.pop_back();
+  ctx.Emit("j " + main_label);
+}
+
+static void ReportUnroll(const std::string &func, const LoopHoists &hoists, int factor) {
+  if (options.opt_report && factor > 1) {
+    std::cerr << "unroll: " << func << ": partially unrolled loop on "
+              << hoists.counter->ident << " by " << factor << std::endl;
+  }
+}
+
+/* =======================
+ * 全局变量提升
+ * ======================= */
+struct PromotedGlobal {
+  std::string label;
+  int slot = 0;
+  bool written = false;
+};
+
+// 不含调用和 return 的循环里, 全局标量只可能被循环自己读写: 进入循环前读进栈槽,
+// 循环里当作局部变量访问, 从循环出来后把改过的写回
+static std::vector<PromotedGlobal> PromoteGlobalsRiscv(RiscvContext &ctx,
+                                                       const WhileStmtAST &loop) {
+  std::vector<PromotedGlobal> promoted;
+  if (!options.promote_globals) {
+    return promoted;
+  }
+  bool blocked = false;
+  std::vector<std::string> names;
+  std::unordered_set<std::string> written;
+  VisitStmt(&loop, [&](const BaseAST *stmt) {
+    blocked = blocked || dynamic_cast<const ReturnStmtAST *>(stmt);
+    auto *assign = dynamic_cast<const AssignStmtAST *>(stmt);
+    auto *lval = assign ? dynamic_cast<const LValAST *>(assign->lval.get()) : nullptr;
+    if (lval && lval->indices.empty()) {
+      written.insert(lval->ident);
+    }
+  }, [&](const ExprAST *expr) {
+    blocked = blocked || dynamic_cast<const CallExpAST *>(expr);
+    auto *lval = dynamic_cast<const LValAST *>(expr);
+    if (lval && std::find(names.begin(), names.end(), lval->ident) == names.end()) {
+      names.push_back(lval->ident);
+    }
+  });
+  if (blocked) {
+    return promoted;
+  }
+  std::vector<std::pair<std::string, RiscvSymbol>> shadows;
+  for (const auto &name : names) {
+    auto *sym = ctx.FindSymbol(name);
+    if (!sym || !sym->is_global || sym->is_array || sym->is_const) {
+      continue;
+    }
+    // 地址已经在 s 寄存器里时访问全局变量和访问栈槽一样是一条访存, 提升只会多出进出循环的读写
+    bool in_reg = std::any_of(ctx.global_regs.begin(), ctx.global_regs.end(),
+                              [&](const std::pair<std::string, std::string> &entry) {
+                                return entry.first == sym->label;
+                              });
+    if (in_reg) {
+      continue;
+    }
+    PromotedGlobal global{sym->label, ctx.AllocSlot(), written.count(name) > 0};
+    ctx.Emit("lw t0, 0(" + GlobalAddr(ctx, global.label, "t2") + ")");
+    EmitStoreBase(ctx, "t0", "sp", global.slot);
+    // 循环里改的是栈槽, 按全局变量记下的公共子表达式在写回后就过时了
+    CseKillVar(ctx, global.label);
+    RiscvSymbol shadow;
+    shadow.offset = global.slot;
+    shadows.emplace_back(name, shadow);
+    promoted.push_back(global);
+  }
+  if (!promoted.empty()) {
+    ctx.PushScope();
+    for (const auto &shadow : shadows) {
+      ctx.AddSymbol(shadow.first, shadow.second);
+    }
+  }
+  return promoted;
+}
+
+static void WriteBackGlobalsRiscv(RiscvContext &ctx, const std::vector<PromotedGlobal> &promoted) {
+  if (promoted.empty()) {
+    return;
+  }
+  ctx.PopScope();
+  for (const auto &global : promoted) {
+    CseKillVar(ctx, global.label);
+    if (global.written) {
+      EmitLoadBase(ctx, "t0", "sp", global.slot);
+      ctx.Emit("sw t0, 0(" + GlobalAddr(ctx, global.label, "t2") + ")");
+    }
+  }
+}
+
+// 函数里出现不少于两次的全局变量按出现次数分到 s1 起的寄存器, 地址在序言里算一次
+static void AssignGlobalRegs(RiscvContext &ctx, const FuncDefAST &func) {
+  std::unordered_map<std::string, int> uses;
+  VisitStmt(func.block.get(), nullptr, [&](const ExprAST *expr) {
+    auto *lval = dynamic_cast<const LValAST *>(expr);
+    auto *sym = lval ? ctx.FindSymbol(lval->ident) : nullptr;
+    if (sym && sym->is_global && !sym->is_const) {
+      ++uses[sym->label];
+    }
+  });
+  std::vector<std::pair<int, std::string>> ranked;
+  for (const auto &use : uses) {
+    if (use.second >= 2) {
+      ranked.emplace_back(-use.second, use.first);
+    }
+  }
+  std::sort(ranked.begin(), ranked.end());
+  ctx.global_regs.clear();
+  for (int i = 0; i < options.global_addr_regs && i < static_cast<int>(ranked.size()); ++i) {
+    ctx.global_regs.emplace_back(ranked[i].second, "s" + std::to_string(i + 1));
+  }
+}
+
+/* =======================
+ * if 转换
+ * ======================= */
+// 分支里只有一条给标量赋值的语句时取出这条赋值
+static const AssignStmtAST *SingleAssign(const BaseAST *stmt) {
+  if (auto *block = dynamic_cast<const BlockAST *>(stmt)) {
+    return block->items.size() == 1 ? SingleAssign(block->items[0].get()) : nullptr;
+  }
+  auto *assign = dynamic_cast<const AssignStmtAST *>(stmt);
+  auto *lval = assign ? dynamic_cast<const LValAST *>(assign->lval.get()) : nullptr;
+  return lval && lval->indices.empty() ? assign : nullptr;
+}
+
+// 无条件求值的开销; 含调用, 数组访问或除法时不能提前求值, 返回 -1
+static int SpeculationCost(const ExprAST *expr) {
+  int cost = 0;
+  bool safe = true;
+  VisitExpr(expr, [&](const ExprAST *node) {
+    auto *lval = dynamic_cast<const LValAST *>(node);
+    auto *binary = dynamic_cast<const BinaryExpAST *>(node);
+    safe = safe && !dynamic_cast<const CallExpAST *>(node) &&
+           !(lval && !lval->indices.empty()) &&
+           !(binary && (binary->op == "/" || binary->op == "%"));
+    ++cost;
+  });
+  return safe ? cost : -1;
+}
+
+// if (c) x = a; [else x = b;] 两边都很便宜时改成无分支的选择:
+// mask = -(c != 0), x = ((a ^ b) & mask) ^ b, 没有 else 时 b 就是 x 原来的值
+static bool IfConvertRiscv(RiscvContext &ctx, const IfStmtAST &stmt) {
+  if (!options.if_convert) {
+    return false;
+  }
+  auto *then_assign = SingleAssign(stmt.then_stmt.get());
+  auto *else_assign = stmt.else_stmt ? SingleAssign(stmt.else_stmt.get()) : nullptr;
+  if (!then_assign || (stmt.else_stmt && !else_assign)) {
+    return false;
+  }
+  auto *target = static_cast<const LValAST *>(then_assign->lval.get());
+  auto *sym = ctx.FindSymbol(target->ident);
+  if (!sym || sym->is_const || sym->is_array) {
+    return false;
+  }
+  if (else_assign) {
+    auto *other = static_cast<const LValAST *>(else_assign->lval.get());
+    if (ctx.FindSymbol(other->ident) != sym) {
+      return false;
+    }
+  }
+  // 被改写成指针自增的计数器赋值要按原样生成
+  if (ctx.iv_steps.count(then_assign) || (else_assign && ctx.iv_steps.count(else_assign))) {
+    return false;
+  }
+  int then_cost = SpeculationCost(then_assign->value.get());
+  int else_cost = else_assign ? SpeculationCost(else_assign->value.get()) : 0;
+  if (then_cost < 0 || else_cost < 0 || then_cost + else_cost > options.if_convert_cost) {
+    return false;
+  }
+  LoadToReg(ctx, stmt.cond->GenRiscv(ctx), "t0");
+  ctx.Emit("snez t0, t0");
+  auto cond_val = StoreFromReg(ctx, "t0");
+  auto then_val = then_assign->value->GenRiscv(ctx);
+  auto else_val = else_assign ? else_assign->value->GenRiscv(ctx) : target->GenRiscv(ctx);
+  LoadToReg(ctx, then_val, "t1");
+  LoadToReg(ctx, else_val, "t2");
+  LoadToReg(ctx, cond_val, "t0");
+  ctx.Emit("sub t0, zero, t0");
+  ctx.Emit("xor t1, t1, t2");
+  ctx.Emit("and t1, t1, t0");
+  ctx.Emit("xor t0, t1, t2");
+  if (sym->is_global) {
+    ctx.Emit("sw t0, 0(" + GlobalAddr(ctx, sym->label, "t2") + ")");
+  } else {
+    EmitStoreBase(ctx, "t0", "sp", sym->offset);
+  }
+  bool same = then_val.is_imm && else_val.is_imm && then_val.imm == else_val.imm;
+  SetScalar(ctx, *sym, same, then_val.imm);
+  if (options.opt_report) {
+    std::cerr << "ifconv: " << ctx.func_name << ": branch on " << target->ident
+              << " turned into a select" << std::endl;
+  }
+  return true;
+}
+
+/* =======================
+ * 分派链
+ * ======================= */
+// if (x == c1) ... else if (x == c2) ... 这样按同一个标量和不同常量分派的 else-if 链
+struct CaseChain {
+  std::vector<std::pair<int, const BaseAST *>> cases;  // 按值排好序
+  const BaseAST *fallback = nullptr;
+};
+
+// 条件是 x == c 或 c == x 时给出 x 和 c
+static bool MatchCase(RiscvContext &ctx, const ExprAST *cond, const RiscvSymbol *&sym,
+                      int &value) {
+  auto *binary = dynamic_cast<const BinaryExpAST *>(cond);
+  if (!binary || binary->op != "==") {
+    return false;
+  }
+  for (auto [var, constant] : {std::pair{binary->lhs.get(), binary->rhs.get()},
+                               std::pair{binary->rhs.get(), binary->lhs.get()}}) {
+    auto *lval = dynamic_cast<const LValAST *>(var);
+    auto *found = lval && lval->indices.empty() ? ctx.FindSymbol(lval->ident) : nullptr;
+    if (found && !found->is_const && !found->is_array && (!sym || sym == found) &&
+        ConstExpr(ctx, constant, value)) {
+      sym = found;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool MatchCaseChain(RiscvContext &ctx, const IfStmtAST &stmt, const LValAST *&selector,
+                           CaseChain &chain) {
+  const RiscvSymbol *sym = nullptr;
+  std::unordered_set<int> seen;
+  const IfStmtAST *link = &stmt;
+  while (link) {
+    int value = 0;
+    if (!MatchCase(ctx, link->cond.get(), sym, value)) {
+      break;
+    }
+    // 重复的值只有第一个分支走得到
+    if (seen.insert(value).second) {
+      chain.cases.emplace_back(value, link->then_stmt.get());
+    }
+    chain.fallback = link->else_stmt.get();
+    link = dynamic_cast<const IfStmtAST *>(link->else_stmt.get());
+  }
+  if (static_cast<int>(chain.cases.size()) < options.jump_table_min_cases) {
+    return false;
+  }
+  auto *binary = static_cast<const BinaryExpAST *>(stmt.cond.get());
+  auto *lhs = dynamic_cast<const LValAST *>(binary->lhs.get());
+  selector = lhs && ctx.FindSymbol(lhs->ident) == sym
+                 ? lhs : static_cast<const LValAST *>(binary->rhs.get());
+  std::sort(chain.cases.begin(), chain.cases.end());
+  return true;
+}
+
+// t0 里是分派的值, 在 [lo, hi) 这些分支里二分查找, 剩下不超过 3 个时逐个比较
+static void EmitCaseSearch(RiscvContext &ctx, const CaseChain &chain,
+                           const std::vector<std::string> &labels, size_t lo, size_t hi,
+                           const std::string &fallback) {
+  if (hi - lo <= 3) {
+    for (size_t i = lo; i < hi; ++i) {
+      ctx.Emit("li t1, " + std::to_string(chain.cases[i].first));
+      ctx.Emit("beq t0, t1, " + labels[i]);
+    }
+    ctx.Emit("j " + fallback);
+    return;
+  }
+  size_t mid = (lo + hi) / 2;
+  auto upper = ctx.NewLabel("case_ge");
+  ctx.Emit("li t1, " + std::to_string(chain.cases[mid].first));
+  ctx.Emit("bge t0, t1, " + upper);
+  EmitCaseSearch(ctx, chain, labels, lo, mid, fallback);
+  ctx.EmitLabel(upper);
+  EmitCaseSearch(ctx, chain, labels, mid, hi, fallback);
+}
+
+// 分派链只取一次变量的值: 取值稠密时查 .rodata 里的跳转表, 否则二分比较
+static bool LowerCaseChainRiscv(RiscvContext &ctx, const IfStmtAST &stmt) {
+  CaseChain chain;
+  const LValAST *selector = nullptr;
+  if (!options.jump_tables || !MatchCaseChain(ctx, stmt, selector, chain)) {
+    return false;
+  }
+  auto end_label = ctx.NewLabel("case_end");
+  auto fallback_label = chain.fallback ? ctx.NewLabel("case_default") : end_label;
+  std::vector<std::string> labels;
+  for (size_t i = 0; i < chain.cases.size(); ++i) {
+    labels.push_back(ctx.NewLabel("case"));
+  }
+  LoadToReg(ctx, selector->GenRiscv(ctx), "t0");
+  long long low = chain.cases.front().first;
+  long long range = static_cast<long long>(chain.cases.back().first) - low + 1;
+  bool dense = range <= 2 * static_cast<long long>(chain.cases.size()) && low > INT_MIN;
+  if (dense) {
+    auto table = ctx.NewLabel("case_table");
+    if (low != 0) {
+      EmitAddImm(ctx, "t0", "t0", static_cast<int>(-low));
+    }
+    ctx.Emit("li t1, " + std::to_string(range));
+    ctx.Emit("bgeu t0, t1, " + fallback_label);
+    ctx.Emit("la t1, " + table);
+    ctx.Emit("slli t0, t0, 2");
+    ctx.Emit("add t1, t1, t0");
+    ctx.Emit("lw t1, 0(t1)");
+    ctx.Emit("jr t1");
+    ctx.rodata.push_back("  .align 2");
+    ctx.rodata.push_back(table + ":");
+    size_t next = 0;
+    for (long long value = low; value < low + range; ++value) {
+      bool hit = chain.cases[next].first == value;
+      ctx.rodata.push_back("  .word " + (hit ? labels[next] : fallback_label));
+      next += hit ? 1 : 0;
+    }
+  } else {
+    EmitCaseSearch(ctx, chain, labels, 0, chain.cases.size(), fallback_label);
+  }
+  // 汇合处的已知值取所有落到末尾的分支的交集
+  KnownValues entry_values = ctx.known_values;
+  KnownValues merged;
+  bool any = false;
+  auto emit_arm = [&](const std::string &label, const BaseAST *arm) {
+    ctx.known_values = entry_values;
+    ctx.EmitLabel(label);
+    CsePush(ctx);
+    if (arm) {
+      arm->EmitRiscv(ctx);
+    }
+    CsePop(ctx);
+    if (arm && arm->IsTerminator()) {
+      return;
+    }
+    ctx.Emit("j " + end_label);
+    merged = any ? MergeKnown(&merged, &ctx.known_values) : ctx.known_values;
+    any = true;
+  };
+  for (size_t i = 0; i < chain.cases.size(); ++i) {
+    emit_arm(labels[i], chain.cases[i].second);
+  }
+  if (chain.fallback) {
+    emit_arm(fallback_label, chain.fallback);
+  } else {
+    merged = any ? MergeKnown(&merged, &entry_values) : entry_values;
+  }
+  ctx.EmitLabel(end_label);
+  ctx.known_values = std::move(merged);
+  if (options.opt_report) {
+    std::cerr << "cases: " << ctx.func_name << ": " << chain.cases.size()
+              << "-way else-if chain on " << selector->ident << " lowered to "
+              << (dense ? "a jump table" : "a binary search") << std::endl;
+  }
+  return true;
+}
+
+/* =======================
+ * 控制流图化简
+ * ======================= */
+// Koopa 基本块: 标号和它之后到下一个标号之前的指令
+struct IRBlock {
+  std::string label;
+  std::vector<std::string> insts;
+  bool removed = false;
+};
+
+static bool IsIRTerminator(const std::string &inst) {
+  return inst.rfind("br ", 0) == 0 || inst.rfind("jump ", 0) == 0 ||
+         inst.rfind("ret", 0) == 0;
+}
+
+// 把 br/jump 拆成条件和目标标号, 其余指令没有目标
+static std::vector<std::string> SplitIRBranch(const std::string &inst, std::string &cond) {
+  if (inst.rfind("jump ", 0) == 0) {
+    return {inst.substr(5)};
+  }
+  if (inst.rfind("br ", 0) != 0) {
+    return {};
+  }
+  auto first = inst.find(", ");
+  auto second = inst.find(", ", first + 2);
+  cond = inst.substr(3, first - 3);
+  return {inst.substr(first + 2, second - first - 2), inst.substr(second + 2)};
+}
+
+// 条件相同或是常量的 br 改成 jump, 目标按 forward 换掉
+static std::string RewriteIRBranch(const std::string &inst,
+                                   const std::unordered_map<std::string, std::string> &forward) {
+  std::string cond;
+  auto targets = SplitIRBranch(inst, cond);
+  if (targets.empty()) {
+    return inst;
+  }
+  for (auto &target : targets) {
+    auto found = forward.find(target);
+    if (found != forward.end()) {
+      target = found->second;
+    }
+  }
+  int taken = 0;
+  if (targets.size() == 2 && IntLiteralValue(cond, taken)) {
+    targets = {taken ? targets[0] : targets[1]};
+  }
+  if (targets.size() == 1 || targets[0] == targets[1]) {
+    return "jump " + targets[0];
+  }
+  return "br " + cond + ", " + targets[0] + ", " + targets[1];
+}
+
+// 删掉从 %entry 走不到的块, 把只含一条 jump 的块从跳转链上绕过去, 再把只有唯一前驱且
+// 前驱无条件跳过来的块并进前驱
+static void SimplifyCfgIR(const std::string &text, std::ostream &os) {
+  std::vector<IRBlock> blocks;
+  std::istringstream in(text);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (!line.empty() && line[0] != ' ') {
+      blocks.push_back({line.substr(0, line.size() - 1), {}, false});
+    } else if (!blocks.empty() && !line.empty() &&
+               (blocks.back().insts.empty() || !IsIRTerminator(blocks.back().insts.back()))) {
+      blocks.back().insts.push_back(line.substr(2));
+    }
+  }
+  if (blocks.empty()) {
+    return;
+  }
+  std::unordered_map<std::string, size_t> index;
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    index[blocks[i].label] = i;
+  }
+  for (bool changed = true; changed;) {
+    changed = false;
+    std::unordered_map<std::string, std::string> forward;
+    for (size_t i = 1; i < blocks.size(); ++i) {
+      const auto &insts = blocks[i].insts;
+      if (!blocks[i].removed && insts.size() == 1 && insts[0].rfind("jump ", 0) == 0) {
+        forward[blocks[i].label] = insts[0].substr(5);
+      }
+    }
+    // 沿跳转链走到底, 成环时停在环上
+    for (auto &entry : forward) {
+      for (size_t steps = 0; steps < blocks.size(); ++steps) {
+        auto next = forward.find(entry.second);
+        if (next == forward.end() || next->second == entry.second) {
+          break;
+        }
+        entry.second = next->second;
+      }
+    }
+    std::unordered_map<std::string, int> preds;
+    for (auto &block : blocks) {
+      if (block.removed || block.insts.empty()) {
+        continue;
+      }
+      auto rewritten = RewriteIRBranch(block.insts.back(), forward);
+      changed = changed || rewritten != block.insts.back();
+      block.insts.back() = rewritten;
+    }
+    std::vector<bool> reached(blocks.size(), false);
+    std::vector<size_t> work = {0};
+    reached[0] = true;
+    while (!work.empty()) {
+      size_t cur = work.back();
+      work.pop_back();
+      std::string cond;
+      auto &insts = blocks[cur].insts;
+      for (const auto &target : insts.empty() ? std::vector<std::string>{}
+                                              : SplitIRBranch(insts.back(), cond)) {
+        ++preds[target];
+        size_t next = index.at(target);
+        if (!reached[next]) {
+          reached[next] = true;
+          work.push_back(next);
+        }
+      }
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      if (!blocks[i].removed && !reached[i]) {
+        blocks[i].removed = true;
+        changed = true;
+      }
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      auto &insts = blocks[i].insts;
+      while (!blocks[i].removed && !insts.empty() && insts.back().rfind("jump ", 0) == 0) {
+        size_t next = index.at(insts.back().substr(5));
+        if (next == 0 || next == i || preds[blocks[next].label] != 1) {
+          break;
+        }
+        insts.pop_back();
+        insts.insert(insts.end(), blocks[next].insts.begin(), blocks[next].insts.end());
+        blocks[next].removed = true;
+        changed = true;
+      }
+    }
+  }
+  for (const auto &block : blocks) {
+    if (block.removed) {
+      continue;
+    }
+    os << block.label << ":\n";
+    for (const auto &inst : block.insts) {
+      os << "  " << inst << "\n";
+    }
+  }
+}
+
+static bool IsRiscvLabel(const std::string &line) {
+  return !line.empty() && line[0] != ' ';
+}
+
+// .loc 不占地址, 判断直通和跳转链时跳过
+static bool IsRiscvLoc(const std::string &line) { return line.rfind("  .loc ", 0) == 0; }
+
+// j, 条件分支和跳转表项的目标标号, 其余指令返回空串
+static std::string RiscvTarget(const std::string &line) {
+  if (line.rfind("  j ", 0) == 0) {
+    return line.substr(4);
+  }
+  if (line.rfind("  .word .L", 0) == 0) {
+    return line.substr(8);
+  }
+  if (line.rfind("  b", 0) == 0) {
+    return line.substr(line.rfind(", ") + 2);
+  }
+  return "";
+}
+
+// 汇编上的同类化简: 跳到 j 的分支直接跳到最终目标, 删掉 j/ret/tail 之后走不到的指令,
+// 跳到紧跟着的标号的分支, 以及没有分支跳到的标号
+static void SimplifyCfgRiscv(std::vector<std::string> &body, std::vector<std::string> &rodata) {
+  for (bool changed = true; changed;) {
+    changed = false;
+    std::unordered_map<std::string, std::string> forward;
+    for (size_t i = 0; i < body.size(); ++i) {
+      if (!IsRiscvLabel(body[i])) {
+        continue;
+      }
+      size_t next = i + 1;
+      while (next < body.size() && (IsRiscvLabel(body[next]) || IsRiscvLoc(body[next]))) {
+        ++next;
+      }
+      auto label = body[i].substr(0, body[i].size() - 1);
+      if (next < body.size() && body[next].rfind("  j ", 0) == 0 &&
+          body[next].substr(4) != label) {
+        forward[label] = body[next].substr(4);
+      }
+    }
+    for (auto &entry : forward) {
+      for (size_t steps = 0; steps < body.size(); ++steps) {
+        auto next = forward.find(entry.second);
+        if (next == forward.end() || next->second == entry.second) {
+          break;
+        }
+        entry.second = next->second;
+      }
+    }
+    std::unordered_set<std::string> referenced;
+    for (auto *lines : {&body, &rodata}) {
+      for (auto &line : *lines) {
+        auto target = RiscvTarget(line);
+        auto found = forward.find(target);
+        if (!target.empty() && found != forward.end()) {
+          line = line.substr(0, line.size() - target.size()) + found->second;
+          target = found->second;
+          changed = true;
+        }
+        if (!target.empty()) {
+          referenced.insert(target);
+        }
+      }
+    }
+    std::vector<std::string> kept;
+    bool live = true;
+    for (size_t i = 0; i < body.size(); ++i) {
+      const auto &line = body[i];
+      if (IsRiscvLabel(line)) {
+        bool used = referenced.count(line.substr(0, line.size() - 1)) > 0;
+        live = live || used;
+        if (used) {
+          kept.push_back(line);
+        } else {
+          changed = true;
+        }
+        continue;
+      }
+      if (IsRiscvLoc(line)) {
+        if (live) {
+          kept.push_back(line);
+        }
+        continue;
+      }
+      auto target = RiscvTarget(line);
+      bool falls_through = false;
+      for (size_t next = i + 1;
+           next < body.size() && (IsRiscvLabel(body[next]) || IsRiscvLoc(body[next])); ++next) {
+        falls_through = falls_through || body[next] == target + ":";
+      }
+      if (!live || falls_through) {
+        changed = true;
+        continue;
+      }
+      kept.push_back(line);
+      live = line.rfind("  j ", 0) != 0 && line.rfind("  jr ", 0) != 0 && !IsReturnLine(line);
+    }
+    body = std::move(kept);
+  }
+}
+
+/* =======================
+ * 代码生成统计
+ * ======================= */
+static std::string RiscvInstClass(const std::string &op) {
+  static const std::unordered_map<std::string, std::string> classes = {
+      {"mul", "muldiv"}, {"div", "muldiv"}, {"divu", "muldiv"}, {"rem", "muldiv"},
+      {"remu", "muldiv"}, {"lw", "load"}, {"lbu", "load"}, {"sw", "store"},
+      {"sb", "store"}, {"li", "const"}, {"la", "const"}, {"lui", "const"},
+      {"j", "jump"}, {"jr", "jump"}, {"jal", "call"}, {"call", "call"},
+      {"tail", "call"}, {"ret", "ret"}, {"ecall", "other"}, {"rdcycle", "other"},
+      {"rdinstret", "other"}, {"rdcycleh", "other"}, {"rdinstreth", "other"}};
+  auto found = classes.find(op);
+  if (found != classes.end()) {
+    return found->second;
+  }
+  return op[0] == 'b' ? "branch" : "alu";
+}
+
+static std::string IRInstClass(const std::string &op) {
+  static const std::unordered_map<std::string, std::string> classes = {
+      {"alloc", "alloc"}, {"load", "load"}, {"store", "store"},
+      {"getelemptr", "address"}, {"getptr", "address"}, {"call", "call"},
+      {"br", "branch"}, {"jump", "jump"}, {"ret", "ret"}};
+  auto found = classes.find(op);
+  return found != classes.end() ? found->second : "arith";
+}
+
+// 统计一个函数最终输出的文本: 标号算基本块, 伪指令不计
+static void RecordRiscvStats(const RiscvContext &ctx, const std::string &name,
+                             const std::string &text, int frame_size) {
+  FuncStats stats;
+  stats.name = name;
+  stats.spills = ctx.spills;
+  stats.reloads = ctx.reloads;
+  stats.frame_size = frame_size;
+  stats.big_offsets = 0;
+  std::istringstream lines(text);
+  std::string line;
+  while (std::getline(lines, line)) {
+    if (!line.empty() && line.back() == ':') {
+      ++stats.blocks;
+    } else if (line.rfind("  .", 0) != 0) {
+      std::istringstream words(line);
+      std::string op;
+      if (!(words >> op)) {
+        continue;
+      }
+      ++stats.insts[RiscvInstClass(op)];
+      stats.big_offsets += line.rfind("  li t4, ", 0) == 0;
+    }
+  }
+  func_stats.push_back(std::move(stats));
+}
+
+static void RecordIRStats(const std::string &name, const std::string &text) {
+  FuncStats stats;
+  stats.name = name;
+  std::istringstream lines(text);
+  std::string line;
+  while (std::getline(lines, line)) {
+    if (!line.empty() && line.back() == ':') {
+      ++stats.blocks;
+      continue;
+    }
+    std::istringstream words(line);
+    std::string op;
+    if (!(words >> op)) {
+      continue;
+    }
+    if (op[0] == '%') {
+      words >> op >> op;  // 跳过 "="
+    }
+    ++stats.insts[IRInstClass(op)];
+  }
+  func_stats.push_back(std::move(stats));
+}
+
+/* =======================
+ * 函数级缓存
+ * ======================= */
+// 结构指纹: 按结点类型和字段依次写成文本, 子结点个数写在前面, 不同的树不会写成同一串.
+// 行号只有 -g 时才会进入输出, 也只在那时计入
+static void Fingerprint(const ExprAST *expr, std::string &out);
+
+static void FingerprintLine(int line, std::string &out) {
+  if (options.debug_lines) {
+    out += "@" + std::to_string(line);
+  }
+}
+
+static void Fingerprint(const InitValAST *init, std::string &out) {
+  if (!init) {
+    out += "_";
+  } else if (init->expr) {
+    Fingerprint(init->expr.get(), out);
+  } else {
+    out += "{" + std::to_string(init->list.size());
+    for (const auto &child : init->list) {
+      Fingerprint(child.get(), out);
+    }
+  }
+}
+
+static void Fingerprint(const ExprAST *expr, std::string &out) {
+  if (!expr) {
+    out += "_";
+    return;
+  }
+  FingerprintLine(expr->line, out);
+  if (auto *num = dynamic_cast<const NumberAST *>(expr)) {
+    out += "n" + std::to_string(num->value);
+  } else if (auto *lval = dynamic_cast<const LValAST *>(expr)) {
+    out += "v" + lval->ident + " " + std::to_string(lval->indices.size());
+    for (const auto &index : lval->indices) {
+      Fingerprint(index.get(), out);
+    }
+  } else if (auto *unary = dynamic_cast<const UnaryExpAST *>(expr)) {
+    out += "u" + unary->op;
+    Fingerprint(unary->rhs.get(), out);
+  } else if (auto *binary = dynamic_cast<const BinaryExpAST *>(expr)) {
+    out += "b" + binary->op;
+    Fingerprint(binary->lhs.get(), out);
+    Fingerprint(binary->rhs.get(), out);
+  } else if (auto *call = dynamic_cast<const CallExpAST *>(expr)) {
+    out += "c" + call->ident + " " + std::to_string(call->args.size());
+    for (const auto &arg : call->args) {
+      Fingerprint(arg.get(), out);
+    }
+  }
+}
+
+template <typename Def>
+static void FingerprintDefs(const std::vector<Def> &defs, std::string &out) {
+  out += std::to_string(defs.size());
+  for (const auto &def : defs) {
+    out += def.ident + " " + std::to_string(def.dims.size());
+    for (const auto &dim : def.dims) {
+      Fingerprint(dim.get(), out);
+    }
+    Fingerprint(def.init.get(), out);
+  }
+}
+
+static void Fingerprint(const BaseAST *node, std::string &out) {
+  if (!node) {
+    out += "_";
+    return;
+  }
+  FingerprintLine(node->line, out);
+  if (auto *func = dynamic_cast<const FuncDefAST *>(node)) {
+    out += "F" + std::string(IsVoidFunc(*func) ? "void " : "int ") + func->ident + " " +
+           std::to_string(func->params.size());
+    for (const auto &param : func->params) {
+      out += param.ident + (param.is_array ? "[" : " ") + std::to_string(param.dims.size());
+      for (const auto &dim : param.dims) {
+        Fingerprint(dim.get(), out);
+      }
+    }
+    Fingerprint(func->block.get(), out);
+  } else if (auto *block = dynamic_cast<const BlockAST *>(node)) {
+    out += "{" + std::to_string(block->items.size());
+    for (const auto &item : block->items) {
+      Fingerprint(item.get(), out);
+    }
+  } else if (auto *decl = dynamic_cast<const ConstDeclAST *>(node)) {
+    out += "K";
+    FingerprintDefs(decl->defs, out);
+  } else if (auto *decl = dynamic_cast<const VarDeclAST *>(node)) {
+    out += "D";
+    FingerprintDefs(decl->defs, out);
+  } else if (auto *ret = dynamic_cast<const ReturnStmtAST *>(node)) {
+    out += "R";
+    Fingerprint(ret->value.get(), out);
+  } else if (auto *assign = dynamic_cast<const AssignStmtAST *>(node)) {
+    out += "=";
+    Fingerprint(assign->lval.get(), out);
+    Fingerprint(assign->value.get(), out);
+  } else if (auto *stmt = dynamic_cast<const ExprStmtAST *>(node)) {
+    out += "E";
+    Fingerprint(stmt->expr.get(), out);
+  } else if (auto *if_stmt = dynamic_cast<const IfStmtAST *>(node)) {
+    out += "I";
+    Fingerprint(if_stmt->cond.get(), out);
+    Fingerprint(if_stmt->then_stmt.get(), out);
+    Fingerprint(if_stmt->else_stmt.get(), out);
+  } else if (auto *while_stmt = dynamic_cast<const WhileStmtAST *>(node)) {
+    out += "W";
+    Fingerprint(while_stmt->cond.get(), out);
+    Fingerprint(while_stmt->body.get(), out);
+  } else if (dynamic_cast<const BreakStmtAST *>(node)) {
+    out += "B";
+  } else if (dynamic_cast<const ContinueStmtAST *>(node)) {
+    out += "C";
+  } else {
+    out += ";";
+  }
 }
 
-static std::string GenElemPtr(IRGenContext &ctx, const std::string &base,
-                              const std::vector<int> &dims, size_t linear) {
-  std::vector<int> indices;
-  indices.reserve(dims.size());
-  size_t rem = linear;
-  for (size_t i = 0; i < dims.size(); ++i) {
-    size_t sub = static_cast<size_t>(Product(dims, i + 1));
-    int idx = static_cast<int>(rem / sub);
-    rem %= sub;
-    indices.push_back(idx);
+// 一个函数的代码取决于: 它自己和 (可能被内联或编译期求值的) 全部间接被调函数的结构,
+// 这些函数的过程间信息, 全局声明, 以及按名字判断的 "从没被赋值过" 的标量.
+// globals 是全部全局声明的指纹, 由调用者算一次
+static std::string FuncCacheKey(const FuncDefAST &func, const ProgramInfo &info,
+                                const std::string &globals) {
+  std::set<std::string> closure = {func.ident};
+  std::vector<std::string> work = {func.ident};
+  while (!work.empty()) {
+    auto name = work.back();
+    work.pop_back();
+    auto found = info.callees.find(name);
+    if (found == info.callees.end()) {
+      continue;
+    }
+    for (const auto &callee : found->second) {
+      if (closure.insert(callee).second) {
+        work.push_back(callee);
+      }
+    }
   }
-  std::string ptr = base;
-  for (int idx : indices) {
-    auto next = ctx.NewTemp();
-    ctx.Emit(next + " = getelemptr " + ptr + ", " + std::to_string(idx));
-    ptr = next;
+  std::string text = globals;
+  std::set<std::string> names;
+  for (const auto &name : closure) {
+    auto found = info.funcs.find(name);
+    if (found == info.funcs.end()) {
+      text += "extern " + name + ";";  // 库函数
+      continue;
+    }
+    const FuncDefAST *callee = found->second;
+    text += name == func.ident ? "self " : "callee ";
+    Fingerprint(callee, text);
+    text += info.pure.count(name) ? "pure " : "";
+    text += info.recursive.count(name) ? "recursive " : "";
+    // 剖析计数器按源码顺序编号, 前面的函数变了编号会整体平移
+    if (options.profile_generate || options.profile_use) {
+      text += "counter " + std::to_string(info.counter_ids.at(callee)) + " ";
+    }
+    for (const auto &param : callee->params) {
+      names.insert(param.ident);
+    }
+    VisitStmt(callee->block.get(), [&](const BaseAST *stmt) {
+      if (auto *decl = dynamic_cast<const VarDeclAST *>(stmt)) {
+        for (const auto &def : decl->defs) {
+          names.insert(def.ident);
+        }
+      }
+    }, [&](const ExprAST *expr) {
+      if (auto *lval = dynamic_cast<const LValAST *>(expr)) {
+        names.insert(lval->ident);
+      }
+    });
   }
-  return ptr;
+  for (const auto &name : names) {
+    text += name + (info.assigned_names.count(name) ? "= " : " ");
+  }
+  if (!info.profile.empty()) {
+    text += "hot " + std::to_string(info.hot_count);
+  }
+  return CacheKey(text.data(), text.size(), options.cache_salt);
 }
 
-static std::string GenToBool(IRGenContext &ctx, const std::string &val) {
-  auto tmp = ctx.NewTemp();
-  ctx.Emit(tmp + " = ne " + val + ", 0");
-  return tmp;
+// 缓存条目: 第一行是 -stats 要的 "spills reloads frame_size", 之后是函数的全部输出
+static void EmitCachedFunc(const std::string &name, const std::string &entry) {
+  size_t newline = entry.find('\n');
+  std::string text = entry.substr(newline + 1);
+  cout << text;
+  if (options.stats) {
+    RiscvContext ctx;
+    int frame_size = 0;
+    std::istringstream(entry.substr(0, newline)) >> ctx.spills >> ctx.reloads >> frame_size;
+    RecordRiscvStats(ctx, name, text, frame_size);
+    func_stats.back().cached = true;
+  }
 }
 
 /* =======================
@@ -304,6 +3858,9 @@ void CompUnitAST::Dump(IRGenContext &ctx) const {
   if (mode != "-koopa") {
     return;
   }
+  ProgramInfo info;
+  BuildProgramInfo(items, info);
+  ctx.prog = &info;
   ctx.PushScope();
   for (const auto &item : items) {
     auto *func = dynamic_cast<FuncDefAST *>(item.get());
@@ -335,15 +3892,23 @@ void CompUnitAST::Dump(IRGenContext &ctx) const {
   }
   ctx.in_global = false;
   for (const auto &item : items) {
-    if (!dynamic_cast<FuncDefAST *>(item.get())) {
+    auto *func = dynamic_cast<FuncDefAST *>(item.get());
+    if (!func || !info.reachable.count(func->ident)) {
       continue;
     }
     item->Dump(ctx);
   }
   ctx.PopScope();
+  ctx.prog = nullptr;
 }
 
 void CompUnitAST::EmitRiscv(RiscvContext &ctx) const {
+  if (options.debug_lines) {
+    cout << "  .file 1 \"" << options.source_file << "\"" << endl;
+  }
+  ProgramInfo info;
+  BuildProgramInfo(items, info);
+  ctx.prog = &info;
   ctx.PushScope();
   for (const auto &item : items) {
     auto *func = dynamic_cast<FuncDefAST *>(item.get());
@@ -362,6 +3927,12 @@ void CompUnitAST::EmitRiscv(RiscvContext &ctx) const {
     item->EmitRiscv(ctx);
   }
   ctx.in_global = false;
+  if (options.profile_generate) {
+    AddProfileData(ctx, info);
+  }
+  if (options.cycle_profile) {
+    AddCycleTable(ctx, items, info);
+  }
 
   if (!ctx.data.empty()) {
     cout << "  .data" << endl;
@@ -370,17 +3941,54 @@ void CompUnitAST::EmitRiscv(RiscvContext &ctx) const {
     }
   }
 
+  // 逐函数缓存: 只重新生成结构或依赖变了的函数, 其余的直接取缓存的代码
+  bool use_cache = !options.cache_salt.empty() && !options.opt_report;
+  std::string globals;
+  if (use_cache) {
+    for (const auto &item : items) {
+      if (!dynamic_cast<FuncDefAST *>(item.get())) {
+        Fingerprint(item.get(), globals);
+      }
+    }
+  }
   for (const auto &item : items) {
     auto *func = dynamic_cast<FuncDefAST *>(item.get());
-    if (!func) {
+    if (!func || !info.reachable.count(func->ident)) {
       continue;
     }
+    std::string key, entry;
+    if (use_cache) {
+      key = FuncCacheKey(*func, info, globals);
+      if (CacheRead(options.cache_dir, key, entry)) {
+        EmitCachedFunc(func->ident, entry);
+        continue;
+      }
+    }
     RiscvContext fn_ctx;
     fn_ctx.func_returns_void = ctx.func_returns_void;
     fn_ctx.scopes.push_back(ctx.scopes.back());
+    fn_ctx.prog = &info;
+    if (!use_cache) {
+      func->EmitRiscv(fn_ctx);
+      continue;
+    }
+    std::ostringstream text;
+    auto *saved = cout.rdbuf(text.rdbuf());
     func->EmitRiscv(fn_ctx);
+    cout.rdbuf(saved);
+    cout << text.str();
+    CacheWrite(options.cache_dir, key,
+               std::to_string(fn_ctx.spills) + " " + std::to_string(fn_ctx.reloads) + " " +
+                   std::to_string(fn_ctx.frame_size) + "\n" + text.str());
+  }
+  if (options.profile_generate) {
+    EmitProfileDump(info);
+  }
+  if (options.cycle_profile) {
+    EmitCycleReport();
   }
   ctx.PopScope();
+  ctx.prog = nullptr;
 }
 
 /* =======================
@@ -390,6 +3998,9 @@ void FuncDefAST::Dump(IRGenContext &ctx) const {
   if (mode != "-koopa") {
     return;
   }
+  ctx.func_name = ident;
+  ctx.inline_growth = 0;
+  ctx.exec_count = EdgeCount(ctx, *this, 0);
   cout << "fun @" << ident << "(";
   for (size_t i = 0; i < params.size(); ++i) {
     if (i != 0) {
@@ -414,7 +4025,11 @@ void FuncDefAST::Dump(IRGenContext &ctx) const {
     func_type->Dump(ctx);
   }
   cout << " {" << endl;
-  cout << "%entry:" << endl;
+  // 函数体先写到缓冲里, 化简控制流图后再输出
+  std::ostringstream body;
+  auto *out = ctx.out;
+  ctx.out = &body;
+  EmitLabel(ctx, "%entry");
   ctx.PushScope();
   for (const auto &param : params) {
     Symbol sym;
@@ -429,10 +4044,24 @@ void FuncDefAST::Dump(IRGenContext &ctx) const {
       ctx.Emit(alloc + " = alloc i32");
       ctx.Emit("store %" + param.ident + ", " + alloc);
       sym.ir_name = alloc;
+      ctx.param_allocs.push_back(alloc);
     }
     ctx.AddSymbol(param.ident, sym);
   }
+  // 数组形参是 SSA 值, 无法重新绑定; 局部数组可能被实参指向, 这两种情况不改写自尾递归
+  bool has_array_param = false;
+  for (const auto &param : params) {
+    has_array_param = has_array_param || param.is_array;
+  }
+  if (!has_array_param && !DeclaresArray(block.get()) && HasSelfTailCall(*this)) {
+    ctx.tailrec_label = ctx.NewLabel("tailrec");
+    ctx.Emit("jump " + ctx.tailrec_label);
+    EmitLabel(ctx, ctx.tailrec_label);
+  }
+  ctx.cse.assign(options.cse ? 1 : 0, {});
+  ctx.known_values.clear();
   block->Dump(ctx);
+  ctx.cse.clear();
   if (is_void && !block->IsTerminator()) {
     if (ctx.koopa_void_as_i32) {
       ctx.Emit("ret 0");
@@ -442,20 +4071,62 @@ void FuncDefAST::Dump(IRGenContext &ctx) const {
   }
   ctx.PopScope();
   ctx.current_func_is_void = false;
+  ctx.tailrec_label.clear();
+  ctx.param_allocs.clear();
+  ctx.out = out;
+  std::string text = body.str();
+  if (options.simplify_cfg) {
+    std::ostringstream simplified;
+    SimplifyCfgIR(text, simplified);
+    text = simplified.str();
+  }
+  *out << text;
   cout << "}" << endl;
+  if (options.stats) {
+    RecordIRStats(ident, text);
+  }
 }
 
 void FuncDefAST::EmitRiscv(RiscvContext &ctx) const {
   if (mode != "-riscv") {
     return;
   }
+  // 叶函数不保存 ra; 栈传参区按函数内最多的参数个数一次性预留在栈底
+  // 可能被内联的函数体里的调用也会落在本函数的栈帧中, 一并统计
+  bool is_leaf = true;
+  size_t max_args = 0;
+  std::unordered_set<std::string> scanned;
+  std::function<void(const BaseAST *)> scan = [&](const BaseAST *body) {
+    VisitStmt(body, nullptr, [&](const ExprAST *expr) {
+      auto *call = dynamic_cast<const CallExpAST *>(expr);
+      if (!call) {
+        return;
+      }
+      is_leaf = false;
+      max_args = std::max(max_args, call->args.size());
+      if (!ctx.prog || ctx.prog->recursive.count(call->ident) ||
+          !scanned.insert(call->ident).second) {
+        return;
+      }
+      auto found = ctx.prog->funcs.find(call->ident);
+      if (found != ctx.prog->funcs.end()) {
+        scan(found->second->block.get());
+      }
+    });
+  };
+  scan(block.get());
+  // 周期剖析时 main 返回前要调用报告函数
+  if (options.cycle_profile && ident == "main") {
+    is_leaf = false;
+  }
   ctx.func_name = ident;
-  ctx.return_label = ".Lreturn_" + ident;
+  ctx.out_args_size = max_args > 8 ? static_cast<int>(max_args - 8) * 4 : 0;
+  ctx.current_func_is_void = IsVoidFunc(*this);
+  ctx.has_local_arrays = DeclaresArray(block.get());
   ctx.PushScope();
-  std::vector<int> param_offsets;
   for (const auto &param : params) {
     int offset = ctx.AllocSlot();
-    param_offsets.push_back(offset);
+    ctx.param_offsets.push_back(offset);
     RiscvSymbol sym;
     sym.is_const = false;
     sym.offset = offset;
@@ -466,33 +4137,100 @@ void FuncDefAST::EmitRiscv(RiscvContext &ctx) const {
     }
     ctx.AddSymbol(param.ident, sym);
   }
+  int probe_slots = options.cycle_profile ? ctx.AllocArray(8) : 0;
+  if (HasSelfTailCall(*this)) {
+    ctx.entry_label = ctx.NewLabel("entry");
+    ctx.EmitLabel(ctx.entry_label);
+  }
+  AssignGlobalRegs(ctx, *this);
+  EmitCounterRiscv(ctx, *this, 0);
+  ctx.exec_count = EdgeCount(ctx, *this, 0);
+  ctx.cse.assign(options.cse ? 1 : 0, {});
   block->EmitRiscv(ctx);
+  ctx.cse.clear();
+  if (ctx.body.empty() || !IsReturnLine(ctx.body.back())) {
+    ctx.Emit("ret");
+  }
+  ctx.body.insert(ctx.body.end(), ctx.cold.begin(), ctx.cold.end());
+  if (options.simplify_cfg) {
+    SimplifyCfgRiscv(ctx.body, ctx.rodata);
+  }
 
-  int frame_size = Align16(ctx.stack_size + 8);
-  cout << "  .text" << endl;
-  cout << "  .globl " << ident << endl;
-  cout << ident << ":" << endl;
-  EmitAddImmOut(cout, "sp", "sp", -frame_size);
-  EmitStoreBaseOut(cout, "ra", "sp", frame_size - 4);
-  EmitStoreBaseOut(cout, "s0", "sp", frame_size - 8);
-  EmitAddImmOut(cout, "s0", "sp", frame_size);
-  for (size_t i = 0; i < param_offsets.size(); ++i) {
+  std::vector<std::string> saved;
+  if (!is_leaf) {
+    saved.push_back("ra");
+  }
+  for (const auto &entry : ctx.global_regs) {
+    saved.push_back(entry.second);
+  }
+  int frame_size = Align16(ctx.out_args_size + ctx.stack_size +
+                           static_cast<int>(saved.size()) * 4);
+  ctx.frame_size = frame_size;
+  // 整个函数先写到缓冲里, 需要统计时直接数最终的文本
+  std::ostringstream text;
+  text << "  .text" << endl;
+  text << "  .globl " << ident << endl;
+  text << ident << ":" << endl;
+  if (options.debug_lines && line > 0) {
+    text << "  .loc 1 " << line << endl;
+  }
+  if (frame_size > 0) {
+    EmitAddImmOut(text, "sp", "sp", -frame_size);
+  }
+  for (size_t i = 0; i < saved.size(); ++i) {
+    EmitStoreBaseOut(text, saved[i], "sp",
+                     frame_size - static_cast<int>(i + 1) * 4);
+  }
+  for (size_t i = 0; i < ctx.param_offsets.size(); ++i) {
     if (i < 8) {
-      EmitStoreBaseOut(cout, "a" + std::to_string(i), "s0", param_offsets[i]);
+      EmitStoreBaseOut(text, "a" + std::to_string(i), "sp",
+                       ctx.param_offsets[i]);
     } else {
-      int arg_offset = static_cast<int>((i - 8) * 4);
-      EmitLoadBaseOut(cout, "t0", "s0", arg_offset);
-      EmitStoreBaseOut(cout, "t0", "s0", param_offsets[i]);
+      int arg_offset = frame_size + static_cast<int>((i - 8) * 4);
+      EmitLoadBaseOut(text, "t0", "sp", arg_offset);
+      EmitStoreBaseOut(text, "t0", "sp", ctx.param_offsets[i]);
     }
   }
+  for (const auto &entry : ctx.global_regs) {
+    text << "  la " << entry.second << ", " << entry.first << endl;
+  }
+  if (options.cycle_profile) {
+    EmitCycleEntry(text, ident, probe_slots);
+  }
+  // 每个 ret/tail 前就地展开一份尾声, 不再跳到公共的返回标号
   for (const auto &line : ctx.body) {
-    cout << line << endl;
+    if (!IsReturnLine(line)) {
+      text << line << endl;
+      continue;
+    }
+    if (options.cycle_profile) {
+      EmitCycleExit(text, ident, probe_slots);
+    }
+    if (options.profile_generate && ident == "main") {
+      text << "  jal t6, .Lprof_dump" << endl;
+    }
+    if (options.cycle_profile && ident == "main") {
+      text << "  call .Lcyc_report" << endl;
+    }
+    for (size_t i = 0; i < saved.size(); ++i) {
+      EmitLoadBaseOut(text, saved[i], "sp",
+                      frame_size - static_cast<int>(i + 1) * 4);
+    }
+    if (frame_size > 0) {
+      EmitAddImmOut(text, "sp", "sp", frame_size);
+    }
+    text << line << endl;
+  }
+  if (!ctx.rodata.empty()) {
+    text << "  .section .rodata" << endl;
+    for (const auto &line : ctx.rodata) {
+      text << line << endl;
+    }
+  }
+  cout << text.str();
+  if (options.stats) {
+    RecordRiscvStats(ctx, ident, text.str(), frame_size);
   }
-  cout << ctx.return_label << ":" << endl;
-  EmitLoadBaseOut(cout, "ra", "sp", frame_size - 4);
-  EmitLoadBaseOut(cout, "s0", "sp", frame_size - 8);
-  EmitAddImmOut(cout, "sp", "sp", frame_size);
-  cout << "  ret" << endl;
   ctx.PopScope();
 }
 
@@ -520,18 +4258,16 @@ void BlockAST::Dump(IRGenContext &ctx) const {
     return;
   }
   ctx.PushScope();
-  bool need_label = false;
-  for (const auto &item : items) {
-    if (need_label) {
-      auto label = ctx.NewLabel("bb");
-      cout << label << ":" << endl;
-      need_label = false;
-    }
-    item->Dump(ctx);
-    if (item->IsTerminator()) {
-      need_label = true;
+  ctx.open_blocks.emplace_back(this, 0);
+  // return/break/continue 之后的语句不可达, 不再生成
+  for (size_t i = 0; i < items.size(); ++i) {
+    ctx.open_blocks.back().second = i;
+    items[i]->Dump(ctx);
+    if (items[i]->IsTerminator()) {
+      break;
     }
   }
+  ctx.open_blocks.pop_back();
   ctx.PopScope();
 }
 
@@ -540,17 +4276,21 @@ void BlockAST::EmitRiscv(RiscvContext &ctx) const {
     return;
   }
   ctx.PushScope();
-  for (const auto &item : items) {
-    item->EmitRiscv(ctx);
+  ctx.open_blocks.emplace_back(this, 0);
+  for (size_t i = 0; i < items.size(); ++i) {
+    ctx.open_blocks.back().second = i;
+    items[i]->EmitRiscv(ctx);
+    if (items[i]->IsTerminator()) {
+      break;
+    }
   }
+  ctx.open_blocks.pop_back();
   ctx.PopScope();
 }
 
 bool BlockAST::IsTerminator() const {
-  if (items.empty()) {
-    return false;
-  }
-  return items.back()->IsTerminator();
+  return std::any_of(items.begin(), items.end(),
+                     [](const auto &item) { return item->IsTerminator(); });
 }
 
 /* =======================
@@ -618,6 +4358,7 @@ void ConstDeclAST::EmitRiscv(RiscvContext &ctx) const {
   if (mode != "-riscv") {
     return;
   }
+  ctx.line = line;
   for (const auto &def : defs) {
     auto dims = EvalDimsRiscv(def.dims, ctx);
     if (dims.empty()) {
@@ -660,7 +4401,7 @@ void ConstDeclAST::EmitRiscv(RiscvContext &ctx) const {
       for (size_t i = 0; i < total; ++i) {
           ctx.Emit("li t0, " + std::to_string(vals[i]));
           int offset = base + static_cast<int>(i) * 4;
-          EmitStoreBase(ctx, "t0", "s0", offset);
+          EmitStoreBase(ctx, "t0", "sp", offset);
       }
       }
     }
@@ -675,6 +4416,9 @@ void VarDeclAST::Dump(IRGenContext &ctx) const {
     return;
   }
   for (const auto &def : defs) {
+    if (ctx.in_global && ctx.prog && !ctx.prog->used_globals.count(def.ident)) {
+      continue;  // 可达函数都没有引用的全局变量不再生成
+    }
     auto dims = EvalDimsIR(def.dims, ctx);
     bool is_array = !dims.empty();
     if (ctx.in_global) {
@@ -687,7 +4431,8 @@ void VarDeclAST::Dump(IRGenContext &ctx) const {
         cout << "global @" << def.ident << " = alloc i32, " << init_val
              << endl;
         Symbol sym;
-        sym.is_const = false;
+        sym.is_const = NeverAssigned(ctx, def.ident);
+        sym.const_value = init_val;
         sym.ir_name = "@" + def.ident;
         ctx.AddSymbol(def.ident, sym);
       } else {
@@ -717,9 +4462,14 @@ void VarDeclAST::Dump(IRGenContext &ctx) const {
       }
     } else {
       if (!is_array) {
+        Symbol sym;
+        if (ConstLocal(ctx, def, sym.const_value)) {
+          sym.is_const = true;
+          ctx.AddSymbol(def.ident, sym);
+          continue;
+        }
         auto alloc = ctx.NewTemp();
         ctx.Emit(alloc + " = alloc i32");
-        Symbol sym;
         sym.is_const = false;
         sym.ir_name = alloc;
         ctx.AddSymbol(def.ident, sym);
@@ -727,6 +4477,9 @@ void VarDeclAST::Dump(IRGenContext &ctx) const {
           auto exprs = BuildInitExprList(def.init.get(), dims);
           auto val = exprs[0] ? exprs[0]->Gen(ctx) : "0";
           ctx.Emit("store " + val + ", " + alloc);
+          int known = 0;
+          bool is_known = IntLiteralValue(val, known);
+          SetScalar(ctx, sym, is_known, known);
         }
       } else {
         std::string type = BuildArrayType(dims);
@@ -759,7 +4512,11 @@ void VarDeclAST::EmitRiscv(RiscvContext &ctx) const {
   if (mode != "-riscv") {
     return;
   }
+  ctx.line = line;
   for (const auto &def : defs) {
+    if (ctx.in_global && ctx.prog && !ctx.prog->used_globals.count(def.ident)) {
+      continue;  // 可达函数都没有引用的全局变量不再生成
+    }
     auto dims = EvalDimsRiscv(def.dims, ctx);
     bool is_array = !dims.empty();
     if (ctx.in_global) {
@@ -773,7 +4530,8 @@ void VarDeclAST::EmitRiscv(RiscvContext &ctx) const {
         ctx.data.push_back(def.ident + ":");
         ctx.data.push_back("  .word " + std::to_string(init_val));
         RiscvSymbol sym;
-        sym.is_const = false;
+        sym.is_const = NeverAssigned(ctx, def.ident);
+        sym.const_value = init_val;
         sym.is_global = true;
         sym.label = def.ident;
         ctx.AddSymbol(def.ident, sym);
@@ -803,8 +4561,13 @@ void VarDeclAST::EmitRiscv(RiscvContext &ctx) const {
       }
     } else {
       if (!is_array) {
-        int offset = ctx.AllocSlot();
         RiscvSymbol sym;
+        if (ConstLocal(ctx, def, sym.const_value)) {
+          sym.is_const = true;
+          ctx.AddSymbol(def.ident, sym);
+          continue;
+        }
+        int offset = ctx.AllocSlot();
         sym.is_const = false;
         sym.offset = offset;
         ctx.AddSymbol(def.ident, sym);
@@ -813,7 +4576,8 @@ void VarDeclAST::EmitRiscv(RiscvContext &ctx) const {
           auto val = exprs[0] ? exprs[0]->GenRiscv(ctx)
                               : RiscvValue{true, 0, false, false, false, "", 0};
           LoadToReg(ctx, val, "t0");
-          EmitStoreBase(ctx, "t0", "s0", offset);
+          EmitStoreBase(ctx, "t0", "sp", offset);
+          SetScalar(ctx, sym, val.is_imm, val.imm);
         }
       } else {
         size_t total = static_cast<size_t>(Product(dims, 0));
@@ -831,7 +4595,7 @@ void VarDeclAST::EmitRiscv(RiscvContext &ctx) const {
                                       : RiscvValue{true, 0, false, false, false, "", 0};
             LoadToReg(ctx, val, "t0");
             int offset = base + static_cast<int>(i) * 4;
-            EmitStoreBase(ctx, "t0", "s0", offset);
+            EmitStoreBase(ctx, "t0", "sp", offset);
         }
         }
       }
@@ -846,6 +4610,30 @@ void ReturnStmtAST::Dump(IRGenContext &ctx) const {
   if (mode != "-koopa") {
     return;
   }
+  if (!ctx.inline_frames.empty()) {
+    auto frame = ctx.inline_frames.back();
+    if (value) {
+      auto val = value->Gen(ctx);
+      if (!frame.result.empty()) {
+        ctx.Emit("store " + val + ", " + frame.result);
+      }
+    }
+    ctx.Emit("jump " + frame.end_label);
+    return;
+  }
+  auto *call = dynamic_cast<const CallExpAST *>(value.get());
+  if (call && call->ident == ctx.func_name && !ctx.tailrec_label.empty() &&
+      call->args.size() == ctx.param_allocs.size()) {
+    std::vector<std::string> arg_vals;
+    for (const auto &arg : call->args) {
+      arg_vals.push_back(arg->Gen(ctx));
+    }
+    for (size_t i = 0; i < arg_vals.size(); ++i) {
+      ctx.Emit("store " + arg_vals[i] + ", " + ctx.param_allocs[i]);
+    }
+    ctx.Emit("jump " + ctx.tailrec_label);
+    return;
+  }
   if (value) {
     auto val = value->Gen(ctx);
     ctx.Emit("ret " + val);
@@ -862,11 +4650,28 @@ void ReturnStmtAST::EmitRiscv(RiscvContext &ctx) const {
   if (mode != "-riscv") {
     return;
   }
+  ctx.line = line;
+  if (!ctx.inline_frames.empty()) {
+    auto frame = ctx.inline_frames.back();
+    if (value) {
+      auto val = value->GenRiscv(ctx);
+      if (frame.result_offset >= 0) {
+        LoadToReg(ctx, val, "t0");
+        EmitStoreBase(ctx, "t0", "sp", frame.result_offset);
+      }
+    }
+    ctx.Emit("j " + frame.end_label);
+    return;
+  }
+  auto *call = dynamic_cast<const CallExpAST *>(value.get());
+  if (call && EmitTailCall(ctx, *call)) {
+    return;
+  }
   if (value) {
     auto val = value->GenRiscv(ctx);
     LoadToReg(ctx, val, "a0");
   }
-  ctx.Emit("j " + ctx.return_label);
+  ctx.Emit("ret");
 }
 
 /* =======================
@@ -884,40 +4689,82 @@ void AssignStmtAST::Dump(IRGenContext &ctx) const {
     size_t full = sym->is_param_ptr ? sym->dims.size() + 1 : sym->dims.size();
     assert(lval_node->indices.size() == full);
   }
-  auto ptr = lval_node->GetPtr(ctx);
+  auto ptr = sym->is_array ? ElemPtrIR(ctx, *lval_node) : lval_node->GetPtr(ctx);
   auto val = value->Gen(ctx);
   ctx.Emit("store " + val + ", " + ptr);
+  if (sym->is_array) {
+    CseKillMemory(ctx, false);
+  } else {
+    int known = 0;
+    bool is_known = IntLiteralValue(val, known);
+    SetScalar(ctx, *sym, is_known, known);
+  }
 }
 
 void AssignStmtAST::EmitRiscv(RiscvContext &ctx) const {
   if (mode != "-riscv") {
     return;
   }
+  ctx.line = line;
+  auto step = ctx.iv_steps.find(this);
+  if (step != ctx.iv_steps.end()) {
+    for (const auto &bump : step->second.bumps) {
+      EmitLoadBase(ctx, "t0", "sp", bump.first);
+      EmitAddImm(ctx, "t0", "t0", bump.second);
+      EmitStoreBase(ctx, "t0", "sp", bump.first);
+    }
+    if (step->second.counter_dead) {
+      auto *counter = dynamic_cast<LValAST *>(lval.get());
+      SetScalar(ctx, *ctx.FindSymbol(counter->ident), false, 0);
+      return;
+    }
+  }
   auto *lval_node = dynamic_cast<LValAST *>(lval.get());
   assert(lval_node);
-  auto val = value->GenRiscv(ctx);
   auto *sym = ctx.FindSymbol(lval_node->ident);
   assert(sym);
   if (sym->is_array) {
     size_t full = sym->is_param_ptr ? sym->dims.size() + 1 : sym->dims.size();
     assert(lval_node->indices.size() == full);
+    // 地址算过时直接复用; a[i] = a[i] + x 这类读写同一元素的赋值先算地址, 右边取值时复用
+    std::string key;
+    RiscvContext::CseEntry entry;
+    bool keyed = !ctx.cse.empty() && CseAddrKey(ctx, *lval_node, key, entry);
+    auto *hit = keyed ? CseFind(ctx, key) : nullptr;
+    bool have_addr = hit != nullptr;
+    RiscvValue addr = hit ? hit->value : RiscvValue{};
+    if (!have_addr && keyed && ReadsSameElement(ctx, value.get(), key)) {
+      EmitElemAddrRiscv(ctx, *lval_node, *sym);
+      addr = StoreFromReg(ctx, "t0");
+      entry.value = addr;
+      CseRecord(ctx, key, std::move(entry));
+      have_addr = true;
+    }
+    auto val = value->GenRiscv(ctx);
     std::vector<RiscvValue> idx_vals;
-    idx_vals.reserve(lval_node->indices.size());
-    for (const auto &idx : lval_node->indices) {
-      idx_vals.push_back(idx->GenRiscv(ctx));
+    if (!have_addr) {
+      idx_vals = lval_node->GenIndicesRiscv(ctx);
     }
     LoadToReg(ctx, val, "t5");
-    lval_node->EmitAddrRiscv(ctx, sym->dims, idx_vals, *sym);
+    if (have_addr) {
+      LoadToReg(ctx, addr, "t0");
+    } else {
+      lval_node->EmitAddrRiscv(ctx, sym->dims, idx_vals, *sym);
+    }
     ctx.Emit("sw t5, 0(t0)");
-  } else if (lval_node->IsGlobal(ctx)) {
+    CseKillMemory(ctx, false);
+    return;
+  }
+  auto val = value->GenRiscv(ctx);
+  if (lval_node->IsGlobal(ctx)) {
     LoadToReg(ctx, val, "t0");
-    ctx.Emit("la t2, " + lval_node->GetLabel(ctx));
-    ctx.Emit("sw t0, 0(t2)");
+    ctx.Emit("sw t0, 0(" + GlobalAddr(ctx, lval_node->GetLabel(ctx), "t2") + ")");
   } else {
     LoadToReg(ctx, val, "t0");
     int offset = lval_node->GetOffset(ctx);
-    EmitStoreBase(ctx, "t0", "s0", offset);
+    EmitStoreBase(ctx, "t0", "sp", offset);
   }
+  SetScalar(ctx, *sym, val.is_imm, val.imm);
 }
 
 /* =======================
@@ -934,6 +4781,7 @@ void ExprStmtAST::EmitRiscv(RiscvContext &ctx) const {
   if (mode != "-riscv") {
     return;
   }
+  ctx.line = line;
   expr->GenRiscv(ctx);
 }
 
@@ -955,64 +4803,150 @@ void IfStmtAST::Dump(IRGenContext &ctx) const {
   if (mode != "-koopa") {
     return;
   }
+  // 条件在编译期确定时只生成会走的分支
+  int taken = 0;
+  if (ConstExpr(ctx, cond.get(), taken)) {
+    const BaseAST *branch = taken ? then_stmt.get() : else_stmt.get();
+    if (branch) {
+      branch->Dump(ctx);
+      if (branch->IsTerminator() && !IsTerminator()) {
+        EmitLabel(ctx, ctx.NewLabel("bb"));
+      }
+    }
+    return;
+  }
   auto then_label = ctx.NewLabel("then");
   auto end_label = ctx.NewLabel("end");
   bool then_term = then_stmt->IsTerminator();
+  KnownValues entry_values = ctx.known_values;
+  long long entry_count = ctx.exec_count;
+  long long then_count = EdgeCount(ctx, *this, 0);
+  long long else_count = EdgeCount(ctx, *this, 1);
   if (else_stmt) {
     bool else_term = else_stmt->IsTerminator();
     auto else_label = ctx.NewLabel("else");
     auto cond_val = GenToBool(ctx, cond->Gen(ctx));
     ctx.Emit("br " + cond_val + ", " + then_label + ", " + else_label);
-    cout << then_label << ":" << endl;
+    EmitLabel(ctx, then_label);
+    CsePush(ctx);
+    ctx.exec_count = then_count >= 0 ? then_count : entry_count;
     then_stmt->Dump(ctx);
+    CsePop(ctx);
     if (!then_term) {
       ctx.Emit("jump " + end_label);
     }
-    cout << else_label << ":" << endl;
+    KnownValues then_values = std::move(ctx.known_values);
+    ctx.known_values = entry_values;
+    EmitLabel(ctx, else_label);
+    CsePush(ctx);
+    ctx.exec_count = else_count >= 0 ? else_count : entry_count;
     else_stmt->Dump(ctx);
+    CsePop(ctx);
     if (!else_term) {
       ctx.Emit("jump " + end_label);
     }
     if (!then_term || !else_term) {
-      cout << end_label << ":" << endl;
+      EmitLabel(ctx, end_label);
     }
+    ctx.known_values = MergeKnown(then_term ? nullptr : &then_values,
+                                  else_term ? nullptr : &ctx.known_values);
   } else {
     auto cond_val = GenToBool(ctx, cond->Gen(ctx));
     ctx.Emit("br " + cond_val + ", " + then_label + ", " + end_label);
-    cout << then_label << ":" << endl;
+    EmitLabel(ctx, then_label);
+    CsePush(ctx);
+    ctx.exec_count = then_count >= 0 ? then_count : entry_count;
     then_stmt->Dump(ctx);
+    CsePop(ctx);
     if (!then_term) {
       ctx.Emit("jump " + end_label);
     }
-    cout << end_label << ":" << endl;
+    EmitLabel(ctx, end_label);
+    ctx.known_values = MergeKnown(then_term ? nullptr : &ctx.known_values, &entry_values);
   }
+  ctx.exec_count = entry_count;
 }
 
 void IfStmtAST::EmitRiscv(RiscvContext &ctx) const {
   if (mode != "-riscv") {
     return;
   }
+  ctx.line = line;
+  int taken = 0;
+  if (ConstExpr(ctx, cond.get(), taken)) {
+    const BaseAST *branch = taken ? then_stmt.get() : else_stmt.get();
+    if (branch) {
+      branch->EmitRiscv(ctx);
+    }
+    return;
+  }
+  if (LowerCaseChainRiscv(ctx, *this) || IfConvertRiscv(ctx, *this)) {
+    return;
+  }
+  KnownValues entry_values = ctx.known_values;
+  long long entry_count = ctx.exec_count;
+  const BaseAST *arms[2] = {then_stmt.get(), else_stmt.get()};
+  long long counts[2] = {EdgeCount(ctx, *this, 0), EdgeCount(ctx, *this, 1)};
+  // 插桩时没有 else 的 if 也要给 else 边计数
+  bool empty_else = !else_stmt && !options.profile_generate;
   auto then_label = ctx.NewLabel("then");
   auto end_label = ctx.NewLabel("end");
-  if (else_stmt) {
-    auto else_label = ctx.NewLabel("else");
-    auto cond_val = cond->GenRiscv(ctx);
-    LoadToReg(ctx, cond_val, "t0");
-    ctx.Emit("beqz t0, " + else_label);
-    ctx.EmitLabel(then_label);
-    then_stmt->EmitRiscv(ctx);
-    ctx.Emit("j " + end_label);
-    ctx.EmitLabel(else_label);
-    else_stmt->EmitRiscv(ctx);
-    ctx.Emit("j " + end_label);
-    ctx.EmitLabel(end_label);
-  } else {
-    auto cond_val = cond->GenRiscv(ctx);
-    LoadToReg(ctx, cond_val, "t0");
-    ctx.Emit("beqz t0, " + end_label);
-    ctx.EmitLabel(then_label);
-    then_stmt->EmitRiscv(ctx);
-    ctx.EmitLabel(end_label);
+  std::string labels[2] = {then_label, empty_else ? end_label : ctx.NewLabel("else")};
+  // 有剖析数据时执行得多的一边紧跟在条件跳转后面, 另一边挪到函数末尾, 热路径上不用
+  // 跳过它. 没有 else 时挪走 then 会让 then 多一次跳回, 只在 then 很少执行时才挪
+  int first = counts[1] > counts[0] ? 1 : 0;
+  bool move_second = counts[1 - first] >= 0 && counts[1 - first] < counts[first];
+  if (empty_else) {
+    move_second = counts[0] >= 0 && counts[1] > 0 &&
+                  counts[0] * options.profile_cold_ratio <= counts[1];
+    first = move_second ? 1 : 0;
+  }
+  int second = 1 - first;
+  bool second_inline = !move_second && !(empty_else && second == 1);
+  auto cond_val = cond->GenRiscv(ctx);
+  LoadToReg(ctx, cond_val, "t0");
+  ctx.Emit(std::string(first == 0 ? "beqz" : "bnez") + " t0, " + labels[second]);
+  KnownValues values[2] = {entry_values, entry_values};
+  bool falls[2] = {true, true};  // 这一边执行完会到 end
+  auto emit_arm = [&](int i, bool jump_end) {
+    ctx.known_values = entry_values;
+    ctx.exec_count = counts[i] >= 0 ? counts[i] : entry_count;
+    ctx.EmitLabel(labels[i]);
+    EmitCounterRiscv(ctx, *this, i);
+    CsePush(ctx);
+    if (arms[i]) {
+      arms[i]->EmitRiscv(ctx);
+    }
+    CsePop(ctx);
+    falls[i] = !arms[i] || !arms[i]->IsTerminator();
+    if (jump_end && falls[i]) {
+      ctx.Emit("j " + end_label);
+    }
+    values[i] = std::move(ctx.known_values);
+  };
+  if (!(empty_else && first == 1)) {
+    emit_arm(first, second_inline);
+  }
+  if (move_second) {
+    std::vector<std::string> main_body;
+    std::swap(ctx.body, main_body);
+    emit_arm(second, true);
+    ctx.cold.insert(ctx.cold.end(), ctx.body.begin(), ctx.body.end());
+    ctx.body = std::move(main_body);
+  } else if (second_inline) {
+    emit_arm(second, false);
+  }
+  ctx.EmitLabel(end_label);
+  ctx.exec_count = entry_count;
+  ctx.known_values = MergeKnown(falls[0] ? &values[0] : nullptr,
+                                falls[1] ? &values[1] : nullptr);
+  if (options.opt_report && (first == 1 || move_second)) {
+    std::cerr << "layout: " << ctx.func_name << ": " << (first ? "else" : "then")
+              << " edge falls through"
+              << (move_second ? std::string(", ") + (second ? "else" : "then") +
+                                    " arm moved to the end of the function"
+                              : "")
+              << " (then " << counts[0] << ", else " << counts[1] << ")" << std::endl;
   }
 }
 
@@ -1030,47 +4964,178 @@ void WhileStmtAST::Dump(IRGenContext &ctx) const {
   if (mode != "-koopa") {
     return;
   }
+  int taken = 0;
+  if (ConstExpr(ctx, cond.get(), taken) && !taken) {
+    return;
+  }
+  // 循环里被赋值的变量在循环头处的值不确定; 整个展开时循环体按顺序执行, 进入时的值仍然有效
+  KnownValues entry_values = ctx.known_values;
+  ForgetLoopValues(ctx, *this);
+  auto hoists = LoopHoister<IRGenContext>(ctx, *this).Run();
+  KnownValues loop_values = std::move(ctx.known_values);
+  ctx.known_values = std::move(entry_values);
+  int final_value = 0;
+  if (FullyUnroll(ctx, *this, hoists, [&](const BaseAST *item) { item->Dump(ctx); },
+                  final_value)) {
+    auto *sym = ctx.FindSymbol(hoists.counter->ident);
+    ctx.Emit("store " + std::to_string(final_value) + ", " + sym->ir_name);
+    SetScalar(ctx, *sym, true, final_value);
+    return;
+  }
+  ctx.known_values = loop_values;
+  int factor = UnrollFactor(ctx, hoists, *this);
   auto cond_label = ctx.NewLabel("while_cond");
   auto body_label = ctx.NewLabel("while_body");
   auto end_label = ctx.NewLabel("while_end");
-  ctx.Emit("jump " + cond_label);
-  cout << cond_label << ":" << endl;
+  if (!hoists.empty()) {
+    // 先判一次条件, 循环至少执行一次时才进入前置块, 然后直接进入循环体
+    auto pre_label = ctx.NewLabel("while_pre");
+    auto guard = GenToBool(ctx, cond->Gen(ctx));
+    ctx.Emit("br " + guard + ", " + pre_label + ", " + end_label);
+    EmitLabel(ctx, pre_label);
+  }
+  // 前置块, 主循环, 循环头和循环体各自只在本层复用算过的值
+  CsePush(ctx);
+  if (!hoists.empty()) {
+    EmitHoistsIR(ctx, hoists);
+    ReportHoists(ctx, hoists);
+  }
+  CseKillLoop(ctx, *this);
+  if (factor > 1) {
+    ReportUnroll(ctx.func_name, hoists, factor);
+    CsePush(ctx);
+    EmitUnrolledIR(ctx, *this, hoists, factor, cond_label);
+    CsePop(ctx);
+    // 主循环可能一轮也没跑, 收尾的原循环不能用展开副本里算出的值
+    ctx.known_values = loop_values;
+  } else {
+    ctx.Emit("jump " + (hoists.empty() ? cond_label : body_label));
+  }
+  EmitLabel(ctx, cond_label);
+  CsePush(ctx);
   auto cond_val = GenToBool(ctx, cond->Gen(ctx));
+  CsePop(ctx);
   ctx.Emit("br " + cond_val + ", " + body_label + ", " + end_label);
-  cout << body_label << ":" << endl;
+  EmitLabel(ctx, body_label);
   ctx.break_labels.push_back(end_label);
   ctx.continue_labels.push_back(cond_label);
+  ctx.open_blocks.emplace_back(nullptr, 0);
+  CsePush(ctx);
+  long long entry_count = ctx.exec_count;
+  long long iterations = EdgeCount(ctx, *this, 1);
+  ctx.exec_count = iterations >= 0 ? iterations : entry_count;
   body->Dump(ctx);
+  ctx.exec_count = entry_count;
+  CsePop(ctx);
+  ctx.open_blocks.pop_back();
   ctx.break_labels.pop_back();
   ctx.continue_labels.pop_back();
   if (!body->IsTerminator()) {
     ctx.Emit("jump " + cond_label);
   }
-  cout << end_label << ":" << endl;
+  EmitLabel(ctx, end_label);
+  CsePop(ctx);
+  ForgetHoists(ctx, hoists);
+  ctx.known_values = std::move(loop_values);
 }
 
 void WhileStmtAST::EmitRiscv(RiscvContext &ctx) const {
   if (mode != "-riscv") {
     return;
   }
+  ctx.line = line;
+  int taken = 0;
+  if (ConstExpr(ctx, cond.get(), taken) && !taken) {
+    return;
+  }
+  auto promoted = PromoteGlobalsRiscv(ctx, *this);
+  KnownValues entry_values = ctx.known_values;
+  ForgetLoopValues(ctx, *this);
+  auto hoists = LoopHoister<RiscvContext>(ctx, *this).Run();
+  KnownValues loop_values = std::move(ctx.known_values);
+  ctx.known_values = std::move(entry_values);
+  int final_value = 0;
+  if (FullyUnroll(ctx, *this, hoists, [&](const BaseAST *item) { item->EmitRiscv(ctx); },
+                  final_value)) {
+    ctx.Emit("li t0, " + std::to_string(final_value));
+    EmitStoreBase(ctx, "t0", "sp", hoists.counter->GetOffset(ctx));
+    SetScalar(ctx, *ctx.FindSymbol(hoists.counter->ident), true, final_value);
+    WriteBackGlobalsRiscv(ctx, promoted);
+    return;
+  }
+  ctx.known_values = loop_values;
+  int factor = UnrollFactor(ctx, hoists, *this);
   auto cond_label = ctx.NewLabel("while_cond");
   auto body_label = ctx.NewLabel("while_body");
   auto end_label = ctx.NewLabel("while_end");
-  ctx.Emit("j " + cond_label);
+  auto saved_iv_access = ctx.iv_access;
+  auto saved_iv_steps = ctx.iv_steps;
+  LftrExit exit;
+  bool guarded = !hoists.empty() || !hoists.ivs.empty();
+  EmitCounterRiscv(ctx, *this, 0);
+  if (guarded) {
+    LoadToReg(ctx, cond->GenRiscv(ctx), "t0");
+    ctx.Emit("beqz t0, " + end_label);
+  }
+  CsePush(ctx);
+  if (guarded) {
+    EmitHoistsRiscv(ctx, hoists);
+    ReportHoists(ctx, hoists);
+    // 部分展开时原循环还要收尾, 计数器不能丢
+    exit = EmitIvPointersRiscv(ctx, hoists, factor == 1);
+  }
+  CseKillLoop(ctx, *this);
+  if (factor > 1) {
+    ReportUnroll(ctx.func_name, hoists, factor);
+    CsePush(ctx);
+    EmitUnrolledRiscv(ctx, *this, hoists, factor, cond_label);
+    CsePop(ctx);
+    // 主循环可能一轮也没跑, 收尾的原循环不能用展开副本里算出的值
+    ctx.known_values = loop_values;
+  } else {
+    ctx.Emit("j " + (guarded ? body_label : cond_label));
+  }
   ctx.EmitLabel(cond_label);
-  auto cond_val = cond->GenRiscv(ctx);
-  LoadToReg(ctx, cond_val, "t0");
-  ctx.Emit("beqz t0, " + end_label);
+  CsePush(ctx);
+  if (exit.active) {
+    // 指针差的符号与计数器和上界之差相同
+    EmitLoadBase(ctx, "t0", "sp", exit.ptr_slot);
+    EmitLoadBase(ctx, "t1", "sp", exit.end_slot);
+    ctx.Emit("sub t0, t0, t1");
+    const char *branch = exit.op == "<" ? "bgez" : exit.op == "<=" ? "bgtz" : "beqz";
+    ctx.Emit(std::string(branch) + " t0, " + end_label);
+  } else {
+    auto cond_val = cond->GenRiscv(ctx);
+    LoadToReg(ctx, cond_val, "t0");
+    ctx.Emit("beqz t0, " + end_label);
+  }
+  CsePop(ctx);
   ctx.EmitLabel(body_label);
+  EmitCounterRiscv(ctx, *this, 1);
   ctx.break_labels.push_back(end_label);
   ctx.continue_labels.push_back(cond_label);
+  ctx.open_blocks.emplace_back(nullptr, 0);
+  CsePush(ctx);
+  long long entry_count = ctx.exec_count;
+  long long iterations = EdgeCount(ctx, *this, 1);
+  ctx.exec_count = iterations >= 0 ? iterations : entry_count;
   body->EmitRiscv(ctx);
+  ctx.exec_count = entry_count;
+  CsePop(ctx);
+  ctx.line = line;
+  ctx.open_blocks.pop_back();
   ctx.break_labels.pop_back();
   ctx.continue_labels.pop_back();
   if (!body->IsTerminator()) {
     ctx.Emit("j " + cond_label);
   }
   ctx.EmitLabel(end_label);
+  CsePop(ctx);
+  ForgetHoists(ctx, hoists);
+  ctx.iv_access = std::move(saved_iv_access);
+  ctx.iv_steps = std::move(saved_iv_steps);
+  ctx.known_values = std::move(loop_values);
+  WriteBackGlobalsRiscv(ctx, promoted);
 }
 
 /* =======================
@@ -1088,6 +5153,7 @@ void BreakStmtAST::EmitRiscv(RiscvContext &ctx) const {
   if (mode != "-riscv") {
     return;
   }
+  ctx.line = line;
   assert(!ctx.break_labels.empty());
   ctx.Emit("j " + ctx.break_labels.back());
 }
@@ -1107,6 +5173,7 @@ void ContinueStmtAST::EmitRiscv(RiscvContext &ctx) const {
   if (mode != "-riscv") {
     return;
   }
+  ctx.line = line;
   assert(!ctx.continue_labels.empty());
   ctx.Emit("j " + ctx.continue_labels.back());
 }
@@ -1138,6 +5205,10 @@ int NumberAST::EvalConst(RiscvContext &ctx) const {
  * LValAST
  * ======================= */
 std::string LValAST::Gen(IRGenContext &ctx) const {
+  return GenReusing(ctx, this, [&] { return GenUncached(ctx); });
+}
+
+std::string LValAST::GenUncached(IRGenContext &ctx) const {
   auto *sym = ctx.FindSymbol(ident);
   assert(sym);
   if (sym->is_const && !sym->is_array) {
@@ -1145,12 +5216,12 @@ std::string LValAST::Gen(IRGenContext &ctx) const {
   }
   if (sym->is_array) {
     size_t full = sym->is_param_ptr ? sym->dims.size() + 1 : sym->dims.size();
-    auto ptr = GetPtrWithIndices(ctx);
     if (indices.size() == full) {
       auto tmp = ctx.NewTemp();
-      ctx.Emit(tmp + " = load " + ptr);
+      ctx.Emit(tmp + " = load " + ElemPtrIR(ctx, *this));
       return tmp;
     }
+    auto ptr = GetPtrWithIndices(ctx);
     if (indices.size() > 0 && indices.size() < full) {
       auto tmp = ctx.NewTemp();
       ctx.Emit(tmp + " = getelemptr " + ptr + ", 0");
@@ -1158,6 +5229,10 @@ std::string LValAST::Gen(IRGenContext &ctx) const {
     }
     return ptr;
   }
+  int known = 0;
+  if (KnownScalar(ctx, *sym, known)) {
+    return std::to_string(known);
+  }
   auto tmp = ctx.NewTemp();
   ctx.Emit(tmp + " = load " + sym->ir_name);
   return tmp;
@@ -1184,40 +5259,19 @@ std::string LValAST::GetPtr(IRGenContext &ctx) const {
 std::string LValAST::GetPtrWithIndices(IRGenContext &ctx) const {
   auto *sym = ctx.FindSymbol(ident);
   assert(sym);
-  std::vector<std::string> idx_vals;
-  idx_vals.reserve(indices.size());
-  for (const auto &idx : indices) {
-    idx_vals.push_back(idx->Gen(ctx));
-  }
-  std::string ptr = sym->ir_name;
-  if (sym->is_param_ptr) {
-    if (idx_vals.empty()) {
-      return ptr;
-    }
-    auto tmp = ctx.NewTemp();
-    ctx.Emit(tmp + " = getptr " + ptr + ", " + idx_vals[0]);
-    ptr = tmp;
-    for (size_t i = 1; i < idx_vals.size(); ++i) {
-      auto next = ctx.NewTemp();
-      ctx.Emit(next + " = getelemptr " + ptr + ", " + idx_vals[i]);
-      ptr = next;
-    }
-    return ptr;
-  }
-  if (idx_vals.empty()) {
-    auto next = ctx.NewTemp();
-    ctx.Emit(next + " = getelemptr " + ptr + ", 0");
-    return next;
+  auto row = ctx.hoisted_rows.find(this);
+  if (row != ctx.hoisted_rows.end()) {
+    return GenIndexedPtr(ctx, *sym, row->second.ptr, *this, row->second.prefix,
+                         indices.size());
   }
-  for (const auto &idx : idx_vals) {
-    auto next = ctx.NewTemp();
-    ctx.Emit(next + " = getelemptr " + ptr + ", " + idx);
-    ptr = next;
-  }
-  return ptr;
+  return GenIndexedPtr(ctx, *sym, sym->ir_name, *this, 0, indices.size());
 }
 
 RiscvValue LValAST::GenRiscv(RiscvContext &ctx) const {
+  return GenReusing(ctx, this, [&] { return GenRiscvUncached(ctx); });
+}
+
+RiscvValue LValAST::GenRiscvUncached(RiscvContext &ctx) const {
   auto *sym = ctx.FindSymbol(ident);
   assert(sym);
   if (sym->is_const && !sym->is_array) {
@@ -1225,31 +5279,30 @@ RiscvValue LValAST::GenRiscv(RiscvContext &ctx) const {
   }
   if (sym->is_array) {
     size_t full = sym->is_param_ptr ? sym->dims.size() + 1 : sym->dims.size();
-    std::vector<RiscvValue> idx_vals;
-    idx_vals.reserve(indices.size());
-    for (const auto &idx : indices) {
-      idx_vals.push_back(idx->GenRiscv(ctx));
-    }
-    if (indices.size() < full) {
-      if (indices.empty()) {
-        if (sym->is_global) {
-          return {false, 0, true, true, false, sym->label, 0};
-        }
-        if (sym->is_param_ptr) {
-          return {false, 0, true, false, true, "", sym->offset};
-        }
-        return {false, 0, true, false, false, "", sym->offset};
+    if (indices.size() == full) {
+      EmitElemAddrRiscv(ctx, *this, *sym);
+      ctx.Emit("lw t1, 0(t0)");
+      return StoreFromReg(ctx, "t1");
+    }
+    if (indices.empty()) {
+      if (sym->is_global) {
+        return {false, 0, true, true, false, sym->label, 0};
       }
-      EmitAddrRiscv(ctx, sym->dims, idx_vals, *sym);
-      return StoreFromReg(ctx, "t0");
+      if (sym->is_param_ptr) {
+        return {false, 0, true, false, true, "", sym->offset};
+      }
+      return {false, 0, true, false, false, "", sym->offset};
     }
+    auto idx_vals = GenIndicesRiscv(ctx);
     EmitAddrRiscv(ctx, sym->dims, idx_vals, *sym);
-    ctx.Emit("lw t1, 0(t0)");
-    return StoreFromReg(ctx, "t1");
+    return StoreFromReg(ctx, "t0");
+  }
+  int known = 0;
+  if (KnownScalar(ctx, *sym, known)) {
+    return {true, known, false, false, false, "", 0};
   }
   if (sym->is_global) {
-    ctx.Emit("la t2, " + sym->label);
-    ctx.Emit("lw t0, 0(t2)");
+    ctx.Emit("lw t0, 0(" + GlobalAddr(ctx, sym->label, "t2") + ")");
     return StoreFromReg(ctx, "t0");
   }
   return {false, 0, false, false, false, "", sym->offset};
@@ -1284,23 +5337,53 @@ std::string LValAST::GetLabel(RiscvContext &ctx) const {
   return sym->label;
 }
 
+// 前缀地址已经外提时只生成剩下的下标
+std::vector<RiscvValue> LValAST::GenIndicesRiscv(RiscvContext &ctx) const {
+  if (ctx.iv_access.count(this)) {
+    return {};
+  }
+  auto row = ctx.hoisted_rows.find(this);
+  size_t first = row == ctx.hoisted_rows.end() ? 0 : row->second.prefix;
+  std::vector<RiscvValue> idx_vals;
+  idx_vals.reserve(indices.size() - first);
+  for (size_t i = first; i < indices.size(); ++i) {
+    idx_vals.push_back(indices[i]->GenRiscv(ctx));
+  }
+  return idx_vals;
+}
+
 void LValAST::EmitAddrRiscv(RiscvContext &ctx, const std::vector<int> &dims,
                             const std::vector<RiscvValue> &idx_vals,
                             const RiscvSymbol &sym) const {
-  if (sym.is_global) {
-    ctx.Emit("la t0, " + sym.label);
+  auto iv = ctx.iv_access.find(this);
+  if (iv != ctx.iv_access.end()) {
+    EmitLoadBase(ctx, "t0", "sp", iv->second.slot);
+    if (iv->second.offset != 0) {
+      EmitAddImm(ctx, "t0", "t0", iv->second.offset);
+    }
+    return;
+  }
+  auto row = ctx.hoisted_rows.find(this);
+  size_t first = 0;
+  if (row != ctx.hoisted_rows.end()) {
+    LoadToReg(ctx, row->second.ptr, "t0");
+    first = row->second.prefix;
+  } else if (sym.is_global) {
+    LoadGlobalAddr(ctx, sym.label, "t0");
   } else if (sym.is_param_ptr) {
-    EmitLoadBase(ctx, "t0", "s0", sym.offset);
+    EmitLoadBase(ctx, "t0", "sp", sym.offset);
   } else {
-    EmitAddImm(ctx, "t0", "s0", sym.offset);
+    EmitAddImm(ctx, "t0", "sp", sym.offset);
   }
   if (idx_vals.empty()) {
     return;
   }
+  // 常量下标在编译期并进偏移, 变量下标按步长累加到 t1
   int64_t stride0 = sym.is_param_ptr ? Product(dims, 0) : 0;
-  ctx.Emit("li t1, 0");
-  for (size_t i = 0; i < idx_vals.size(); ++i) {
-    LoadToReg(ctx, idx_vals[i], "t2");
+  int64_t const_offset = 0;
+  bool has_var = false;
+  for (size_t k = 0; k < idx_vals.size(); ++k) {
+    size_t i = first + k;
     int64_t stride = 1;
     if (sym.is_param_ptr) {
       if (i == 0) {
@@ -1311,24 +5394,49 @@ void LValAST::EmitAddrRiscv(RiscvContext &ctx, const std::vector<int> &dims,
     } else {
       stride = Product(dims, i + 1);
     }
-    if (stride != 1) {
+    if (idx_vals[k].is_imm) {
+      const_offset += idx_vals[k].imm * stride;
+      continue;
+    }
+    LoadToReg(ctx, idx_vals[k], "t2");
+    if (stride > 1 && (stride & (stride - 1)) == 0) {
+      int shift = 0;
+      while ((int64_t{1} << shift) != stride) {
+        ++shift;
+      }
+      ctx.Emit("slli t2, t2, " + std::to_string(shift));
+    } else if (stride != 1) {
       ctx.Emit("li t3, " + std::to_string(stride));
       ctx.Emit("mul t2, t2, t3");
     }
-    ctx.Emit("add t1, t1, t2");
+    ctx.Emit(has_var ? "add t1, t1, t2" : "mv t1, t2");
+    has_var = true;
+  }
+  if (has_var) {
+    ctx.Emit("slli t1, t1, 2");
+    ctx.Emit("add t0, t0, t1");
+  }
+  if (const_offset != 0) {
+    EmitAddImm(ctx, "t0", "t0", static_cast<int>(const_offset * 4));
   }
-  ctx.Emit("slli t1, t1, 2");
-  ctx.Emit("add t0, t0, t1");
 }
 
 /* =======================
  * UnaryExpAST
  * ======================= */
 std::string UnaryExpAST::Gen(IRGenContext &ctx) const {
+  return GenReusing(ctx, this, [&] { return GenUncached(ctx); });
+}
+
+std::string UnaryExpAST::GenUncached(IRGenContext &ctx) const {
   auto rhs_val = rhs->Gen(ctx);
+  int known = 0;
   if (op == "+") {
     return rhs_val;
   }
+  if (IntLiteralValue(rhs_val, known)) {
+    return std::to_string(FoldUnary(op, known));
+  }
   if (op == "-") {
     auto tmp = ctx.NewTemp();
     ctx.Emit(tmp + " = sub 0, " + rhs_val);
@@ -1359,10 +5467,17 @@ int UnaryExpAST::Eval(IRGenContext &ctx) const {
 }
 
 RiscvValue UnaryExpAST::GenRiscv(RiscvContext &ctx) const {
+  return GenReusing(ctx, this, [&] { return GenRiscvUncached(ctx); });
+}
+
+RiscvValue UnaryExpAST::GenRiscvUncached(RiscvContext &ctx) const {
   auto rhs_val = rhs->GenRiscv(ctx);
   if (op == "+") {
     return rhs_val;
   }
+  if (rhs_val.is_imm) {
+    return {true, FoldUnary(op, rhs_val.imm), false, false, false, "", 0};
+  }
   LoadToReg(ctx, rhs_val, "t0");
   if (op == "-") {
     ctx.Emit("neg t0, t0");
@@ -1393,17 +5508,36 @@ int UnaryExpAST::EvalConst(RiscvContext &ctx) const {
  * BinaryExpAST
  * ======================= */
 std::string BinaryExpAST::Gen(IRGenContext &ctx) const {
+  return GenReusing(ctx, this, [&] { return GenUncached(ctx); });
+}
+
+std::string BinaryExpAST::GenUncached(IRGenContext &ctx) const {
   if (op == "&&" || op == "||") {
+    auto lhs_raw = lhs->Gen(ctx);
+    int known = 0;
+    if (IntLiteralValue(lhs_raw, known)) {
+      // 左边已知时短路在编译期决定
+      if ((known != 0) != (op == "&&")) {
+        return op == "&&" ? "0" : "1";
+      }
+      auto rhs_val = rhs->Gen(ctx);
+      if (IntLiteralValue(rhs_val, known)) {
+        return known != 0 ? "1" : "0";
+      }
+      return GenToBool(ctx, rhs_val);
+    }
     auto res_alloc = ctx.NewTemp();
     ctx.Emit(res_alloc + " = alloc i32");
-    auto lhs_val = GenToBool(ctx, lhs->Gen(ctx));
+    auto lhs_val = GenToBool(ctx, lhs_raw);
     auto rhs_label = ctx.NewLabel("sc_rhs");
     auto set_label = ctx.NewLabel("sc_set");
     auto end_label = ctx.NewLabel("sc_end");
     if (op == "&&") {
       ctx.Emit("br " + lhs_val + ", " + rhs_label + ", " + set_label);
       EmitLabel(ctx, rhs_label);
+      CsePush(ctx);
       auto rhs_val = GenToBool(ctx, rhs->Gen(ctx));
+      CsePop(ctx);
       ctx.Emit("store " + rhs_val + ", " + res_alloc);
       ctx.Emit("jump " + end_label);
       EmitLabel(ctx, set_label);
@@ -1412,7 +5546,9 @@ std::string BinaryExpAST::Gen(IRGenContext &ctx) const {
     } else {
       ctx.Emit("br " + lhs_val + ", " + set_label + ", " + rhs_label);
       EmitLabel(ctx, rhs_label);
+      CsePush(ctx);
       auto rhs_val = GenToBool(ctx, rhs->Gen(ctx));
+      CsePop(ctx);
       ctx.Emit("store " + rhs_val + ", " + res_alloc);
       ctx.Emit("jump " + end_label);
       EmitLabel(ctx, set_label);
@@ -1426,6 +5562,13 @@ std::string BinaryExpAST::Gen(IRGenContext &ctx) const {
   }
   auto lhs_val = lhs->Gen(ctx);
   auto rhs_val = rhs->Gen(ctx);
+  int lhs_known = 0;
+  int rhs_known = 0;
+  int folded = 0;
+  if (IntLiteralValue(lhs_val, lhs_known) && IntLiteralValue(rhs_val, rhs_known) &&
+      FoldBinary(op, lhs_known, rhs_known, folded)) {
+    return std::to_string(folded);
+  }
   auto tmp = ctx.NewTemp();
   string inst;
   if (op == "+") {
@@ -1504,36 +5647,56 @@ int BinaryExpAST::Eval(IRGenContext &ctx) const {
 }
 
 RiscvValue BinaryExpAST::GenRiscv(RiscvContext &ctx) const {
+  return GenReusing(ctx, this, [&] { return GenRiscvUncached(ctx); });
+}
+
+RiscvValue BinaryExpAST::GenRiscvUncached(RiscvContext &ctx) const {
   if (op == "&&" || op == "||") {
+    auto lhs_val = lhs->GenRiscv(ctx);
+    if (lhs_val.is_imm) {
+      if ((lhs_val.imm != 0) != (op == "&&")) {
+        return {true, op == "&&" ? 0 : 1, false, false, false, "", 0};
+      }
+      auto rhs_val = rhs->GenRiscv(ctx);
+      if (rhs_val.is_imm) {
+        return {true, rhs_val.imm != 0, false, false, false, "", 0};
+      }
+      LoadToReg(ctx, rhs_val, "t0");
+      ctx.Emit("snez t0, t0");
+      return StoreFromReg(ctx, "t0");
+    }
     auto res_offset = ctx.AllocSlot();
     auto rhs_label = ctx.NewLabel("sc_rhs");
     auto set_label = ctx.NewLabel("sc_set");
     auto end_label = ctx.NewLabel("sc_end");
 
-    auto lhs_val = lhs->GenRiscv(ctx);
     LoadToReg(ctx, lhs_val, "t0");
     if (op == "&&") {
       ctx.Emit("beqz t0, " + set_label);
       ctx.EmitLabel(rhs_label);
+      CsePush(ctx);
       auto rhs_val = rhs->GenRiscv(ctx);
+      CsePop(ctx);
       LoadToReg(ctx, rhs_val, "t1");
       ctx.Emit("snez t1, t1");
-      EmitStoreBase(ctx, "t1", "s0", res_offset);
+      EmitStoreBase(ctx, "t1", "sp", res_offset);
       ctx.Emit("j " + end_label);
       ctx.EmitLabel(set_label);
-      EmitStoreBase(ctx, "x0", "s0", res_offset);
+      EmitStoreBase(ctx, "x0", "sp", res_offset);
       ctx.Emit("j " + end_label);
     } else {
       ctx.Emit("bnez t0, " + set_label);
       ctx.EmitLabel(rhs_label);
+      CsePush(ctx);
       auto rhs_val = rhs->GenRiscv(ctx);
+      CsePop(ctx);
       LoadToReg(ctx, rhs_val, "t1");
       ctx.Emit("snez t1, t1");
-      EmitStoreBase(ctx, "t1", "s0", res_offset);
+      EmitStoreBase(ctx, "t1", "sp", res_offset);
       ctx.Emit("j " + end_label);
       ctx.EmitLabel(set_label);
       ctx.Emit("li t1, 1");
-      EmitStoreBase(ctx, "t1", "s0", res_offset);
+      EmitStoreBase(ctx, "t1", "sp", res_offset);
       ctx.Emit("j " + end_label);
     }
     ctx.EmitLabel(end_label);
@@ -1541,6 +5704,11 @@ RiscvValue BinaryExpAST::GenRiscv(RiscvContext &ctx) const {
   }
   auto lhs_val = lhs->GenRiscv(ctx);
   auto rhs_val = rhs->GenRiscv(ctx);
+  int folded = 0;
+  if (lhs_val.is_imm && rhs_val.is_imm &&
+      FoldBinary(op, lhs_val.imm, rhs_val.imm, folded)) {
+    return {true, folded, false, false, false, "", 0};
+  }
   LoadToReg(ctx, lhs_val, "t0");
   LoadToReg(ctx, rhs_val, "t1");
 
@@ -1635,11 +5803,19 @@ int BinaryExpAST::EvalConst(RiscvContext &ctx) const {
  * CallExpAST
  * ======================= */
 std::string CallExpAST::Gen(IRGenContext &ctx) const {
+  int folded = 0;
+  if (TryEvalCall(ctx, *this, folded)) {
+    return std::to_string(folded);
+  }
+  const FuncDefAST *callee = InlineTarget(ctx, *this);
   std::vector<std::string> arg_vals;
   arg_vals.reserve(args.size());
   for (const auto &arg : args) {
     arg_vals.push_back(arg->Gen(ctx));
   }
+  if (callee) {
+    return GenInlineIR(ctx, *callee, arg_vals);
+  }
   string args_str;
   for (size_t i = 0; i < arg_vals.size(); ++i) {
     if (i != 0) {
@@ -1652,6 +5828,7 @@ std::string CallExpAST::Gen(IRGenContext &ctx) const {
   if (it != ctx.func_returns_void.end()) {
     is_void = it->second;
   }
+  CseKillCall(ctx, ident);
   if (is_void && (!ctx.koopa_void_as_i32 || IsBuiltinFunc(ident))) {
     ctx.Emit("call @" + ident + "(" + args_str + ")");
     return "0";
@@ -1662,36 +5839,41 @@ std::string CallExpAST::Gen(IRGenContext &ctx) const {
 }
 
 int CallExpAST::Eval(IRGenContext &ctx) const {
-  (void)ctx;
-  return 0;
+  int value = 0;
+  TryEvalCall(ctx, *this, value);
+  return value;
 }
 
 RiscvValue CallExpAST::GenRiscv(RiscvContext &ctx) const {
+  int folded = 0;
+  if (TryEvalCall(ctx, *this, folded)) {
+    return {true, folded, false, false, false, "", 0};
+  }
+  const FuncDefAST *callee = InlineTarget(ctx, *this);
   std::vector<RiscvValue> arg_vals;
   arg_vals.reserve(args.size());
   for (const auto &arg : args) {
     arg_vals.push_back(arg->GenRiscv(ctx));
   }
-  int extra = 0;
-  int aligned = 0;
-  if (arg_vals.size() > 8) {
-    extra = static_cast<int>((arg_vals.size() - 8) * 4);
-    aligned = Align16(extra);
-    EmitAddImm(ctx, "sp", "sp", -aligned);
-    for (size_t i = 8; i < arg_vals.size(); ++i) {
-      LoadToReg(ctx, arg_vals[i], "t0");
-      int offset = static_cast<int>((i - 8) * 4);
-      EmitStoreBase(ctx, "t0", "sp", offset);
-    }
+  if (callee) {
+    // 展开体里的语句带着被调函数的行号, 回来后恢复成调用点的
+    int line = ctx.line;
+    auto result = GenInlineRiscv(ctx, *callee, arg_vals);
+    ctx.line = line;
+    return result;
   }
-  for (size_t i = 0; i < arg_vals.size() && i < 8; ++i) {
-    LoadToReg(ctx, arg_vals[i], "t0");
-    ctx.Emit("mv a" + std::to_string(i) + ", t0");
+  std::vector<ParallelMove> moves(arg_vals.size());
+  for (size_t i = 0; i < arg_vals.size(); ++i) {
+    moves[i].src = arg_vals[i];
+    if (i < 8) {
+      moves[i].dst_reg = "a" + std::to_string(i);
+    } else {
+      moves[i].dst_offset = static_cast<int>((i - 8) * 4);
+    }
   }
+  EmitParallelMoves(ctx, std::move(moves));
   ctx.Emit("call " + ident);
-  if (aligned > 0) {
-    EmitAddImm(ctx, "sp", "sp", aligned);
-  }
+  CseKillCall(ctx, ident);
   bool is_void = false;
   auto it = ctx.func_returns_void.find(ident);
   if (it != ctx.func_returns_void.end()) {
@@ -1704,6 +5886,7 @@ RiscvValue CallExpAST::GenRiscv(RiscvContext &ctx) const {
 }
 
 int CallExpAST::EvalConst(RiscvContext &ctx) const {
-  (void)ctx;
-  return 0;
+  int value = 0;
+  TryEvalCall(ctx, *this, value);
+  return value;
 }
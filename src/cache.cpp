@@ -0,0 +1,181 @@
+#include "include/cache.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace {
+
+uint64_t Fnv1a(uint64_t hash, const void *data, size_t size) {
+  auto bytes = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+bool WriteAll(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+std::string EntryPath(const std::string &dir, const std::string &name) {
+  return dir + "/" + name;
+}
+
+// 把条目映射进内存交给 use, 并刷新修改时间: 修改时间就是 LRU 的 "最近使用时间"
+template <typename Use>
+bool UseEntry(const std::string &dir, const std::string &key, Use use) {
+  int fd = open(EntryPath(dir, key).c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  bool hit = false;
+  if (data != MAP_FAILED) {
+    hit = use(static_cast<const char *>(data), static_cast<size_t>(st.st_size));
+    munmap(data, st.st_size);
+    futimens(fd, nullptr);
+  }
+  close(fd);
+  return hit;
+}
+
+}  // namespace
+
+std::string CacheKey(const char *source, size_t size, const std::string &args) {
+  // 编译器重新构建后可执行文件的大小或修改时间会变, 旧条目自然失效
+  std::string build;
+  struct stat st;
+  if (stat("/proc/self/exe", &st) == 0) {
+    build = std::to_string(st.st_size) + ":" + std::to_string(st.st_mtim.tv_sec) + "." +
+            std::to_string(st.st_mtim.tv_nsec);
+  }
+  // 每部分前面带上长度, 免得不同的切分拼出同样的字节串
+  uint64_t hash = 14695981039346656037ull;
+  std::pair<const char *, uint64_t> parts[] = {
+      {build.data(), build.size()}, {args.data(), args.size()}, {source, size}};
+  for (const auto &part : parts) {
+    hash = Fnv1a(hash, &part.second, sizeof(part.second));
+    hash = Fnv1a(hash, part.first, part.second);
+  }
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+  return name;
+}
+
+bool CacheLookup(const std::string &dir, const std::string &key, const char *output) {
+  return UseEntry(dir, key, [&](const char *data, size_t size) {
+    int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = out >= 0 && WriteAll(out, data, size);
+    if (out >= 0) {
+      close(out);
+    }
+    return ok;
+  });
+}
+
+void CacheStore(const std::string &dir, const std::string &key, const char *output) {
+  int in = open(output, O_RDONLY);
+  if (in < 0) {
+    return;
+  }
+  std::string data;
+  char buf[1 << 16];
+  ssize_t n;
+  while ((n = read(in, buf, sizeof(buf))) > 0) {
+    data.append(buf, n);
+  }
+  close(in);
+  CacheWrite(dir, key, data);
+}
+
+bool CacheRead(const std::string &dir, const std::string &key, std::string &data) {
+  return UseEntry(dir, key, [&](const char *bytes, size_t size) {
+    data.assign(bytes, size);
+    return true;
+  });
+}
+
+void CacheWrite(const std::string &dir, const std::string &key, const std::string &data) {
+  mkdir(dir.c_str(), 0755);
+  // 先写临时文件再改名, 并发的编译不会读到写了一半的条目
+  std::string tmp = EntryPath(dir, "." + key + "." + std::to_string(getpid()));
+  int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = out >= 0 && WriteAll(out, data.data(), data.size());
+  if (out >= 0) {
+    close(out);
+  }
+  if (!ok || rename(tmp.c_str(), EntryPath(dir, key).c_str()) < 0) {
+    unlink(tmp.c_str());
+  }
+}
+
+void CacheEvict(const std::string &dir, long long limit) {
+  DIR *d = opendir(dir.c_str());
+  if (!d) {
+    return;
+  }
+  // (修改时间, 大小, 文件名)
+  std::vector<std::tuple<long long, long long, std::string>> entries;
+  long long total = 0;
+  while (auto ent = readdir(d)) {
+    // 以 '.' 开头的是临时文件和计数文件, 不算条目
+    struct stat st;
+    if (ent->d_name[0] == '.' || stat(EntryPath(dir, ent->d_name).c_str(), &st) < 0) {
+      continue;
+    }
+    long long mtime = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+    entries.emplace_back(mtime, st.st_size, ent->d_name);
+    total += st.st_size;
+  }
+  closedir(d);
+  std::sort(entries.begin(), entries.end());
+  for (size_t i = 0; i < entries.size() && total > limit; ++i) {
+    unlink(EntryPath(dir, std::get<2>(entries[i])).c_str());
+    total -= std::get<1>(entries[i]);
+  }
+}
+
+void CacheCount(const std::string &dir, bool hit, long long &hits, long long &misses) {
+  hits = misses = 0;
+  mkdir(dir.c_str(), 0755);
+  int fd = open(EntryPath(dir, ".stats").c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return;
+  }
+  flock(fd, LOCK_EX);
+  char buf[64] = {};
+  ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+  if (n > 0) {
+    sscanf(buf, "%lld %lld", &hits, &misses);
+  }
+  ++(hit ? hits : misses);
+  int len = snprintf(buf, sizeof(buf), "%lld %lld\n", hits, misses);
+  if (ftruncate(fd, 0) == 0) {
+    (void)!pwrite(fd, buf, len, 0);
+  }
+  close(fd);
+}
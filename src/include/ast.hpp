@@ -1,15 +1,92 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 extern std::string mode;
 
+// 命令行中模式/输入/输出之后的可选开关
+struct CompileOptions {
+  bool inline_funcs = true;
+  int inline_threshold = 40;  // 被内联函数体的节点数上限, 循环内的调用放宽一倍
+  int inline_growth = 1000;   // 每个函数因内联增加的节点数上限
+  int const_eval_steps = 100000;  // 编译期求值一次纯函数调用最多执行的语句/表达式数
+  bool unroll = true;
+  int unroll_factor = 4;      // 部分展开的份数
+  int unroll_max_trips = 16;  // 完全展开的最大迭代次数
+  int unroll_budget = 200;    // 展开后循环体的节点数上限
+  bool cse = true;
+  bool simplify_cfg = true;
+  bool if_convert = true;
+  int if_convert_cost = 12;   // 两个分支表达式合计的节点数上限
+  bool jump_tables = true;
+  int jump_table_min_cases = 4;  // 按同一变量分派的 else-if 链至少这么多个分支才改写
+  bool promote_globals = true;
+  int global_addr_regs = 4;   // 存放全局变量地址的被调用者保存寄存器个数, 从 s1 起
+  bool opt_report = false;
+  bool exec_counts = false;   // -run 时在 stderr 列出每个基本块的执行次数
+  bool profile_generate = false;  // 插桩, 程序退出时把计数器写到 profile_file
+  bool profile_use = false;       // 按 profile_file 里的计数安排代码布局, 内联和循环展开
+  std::string profile_file = "sysy.prof";
+  int profile_cold_ratio = 16;    // 没有 else 的 if, then 边不到另一边的 1/N 时挪到函数末尾
+  bool cycle_profile = false;  // 函数进出时读 rdcycle/rdinstret, main 返回时在 stderr 打印平坦剖析
+  bool stats = false;          // 输出每个函数的代码生成统计 (JSON)
+  std::string stats_file;      // 为空时写到 stderr
+  bool debug_lines = false;    // RISC-V 输出里带 .file/.loc 行号信息
+  std::string source_file;
+  std::string cache_dir;       // 编译结果缓存的目录, 为空时不用缓存
+  long long cache_size = 64 << 20;  // 缓存目录的总字节数上限, 超出时按最久未用淘汰
+  std::string cache_salt;      // 除源码外影响输出的参数, 由 main 填写; 不为空时逐函数缓存 RISC-V 代码
+};
+
+extern CompileOptions options;
+
+// -stats 统计的一个函数的生成结果, 按生成顺序收集, 最后由 main 输出
+struct FuncStats {
+  std::string name;
+  std::map<std::string, int> insts;  // 指令类别 -> 条数
+  int blocks = 0;
+  // 以下只有 RISC-V 有, -1 表示不适用
+  int spills = -1;       // StoreFromReg 把中间结果写到新栈槽的次数
+  int reloads = -1;      // LoadToReg 从栈槽读回的次数
+  int frame_size = -1;
+  int big_offsets = -1;  // 立即数放不进 12 位, 经 li t4 中转的次数
+  bool cached = false;   // 代码取自函数级缓存
+};
+
+extern std::vector<FuncStats> func_stats;
+
 class InitValAST;
+class FuncDefAST;
+class ExprAST;
+class BaseAST;
+class BlockAST;
+
+// 编译单元级的过程间信息, 在生成代码前由 CompUnitAST 统一计算
+struct ProgramInfo {
+  std::unordered_map<std::string, const FuncDefAST *> funcs;
+  std::unordered_map<std::string, std::vector<std::string>> callees;
+  std::unordered_set<std::string> recursive;  // 处在调用环上的函数
+  std::unordered_map<std::string, int> sizes;
+  std::unordered_set<std::string> global_vars;  // 非常量全局变量
+  std::unordered_set<std::string> pure;         // 结果只取决于实参的函数
+  std::unordered_set<std::string> reachable;    // 从 main 出发能调用到的函数
+  std::unordered_set<std::string> used_globals; // 可达函数引用到的全局变量
+  std::unordered_set<std::string> assigned_names;  // 在某处被赋值过的标量名
+  // 剖析计数器按源码顺序编号: 函数入口一个, if 的 then/else 两条边, while 的进入和迭代各一个
+  std::unordered_map<const BaseAST *, int> counter_ids;
+  int num_counters = 0;
+  uint32_t counter_layout = 0;     // 计数器布局的散列, 防止用错剖析文件
+  std::vector<long long> profile;  // -fprofile-use 读入的计数, 为空表示没有剖析数据
+  long long hot_count = 0;         // 执行次数不少于这个值的调用点算热点
+};
 
 struct Symbol {
   bool is_const = false;
@@ -31,6 +108,43 @@ struct IRGenContext {
   bool current_func_is_void = false;
   bool in_global = false;
   std::ostream *out = nullptr;
+  size_t visible_from = 0;  // 内联展开时只看得到展开体自己的作用域和全局作用域
+  std::string func_name;
+  const ProgramInfo *prog = nullptr;
+
+  // 内联展开时 return 改为写结果并跳到展开末尾
+  struct InlineFrame {
+    std::string end_label;
+    std::string result;
+  };
+  std::vector<InlineFrame> inline_frames;
+  int inline_growth = 0;
+
+  // 自尾递归改写成给形参重新赋值后跳回这个标号
+  std::string tailrec_label;
+  std::vector<std::string> param_allocs;
+
+  // 循环不变量外提: 结点 -> 在循环前置块里算好的值; 数组访问 -> 前 prefix 个下标已算好的地址
+  struct HoistedRow {
+    std::string ptr;
+    size_t prefix = 0;
+  };
+  std::unordered_map<const ExprAST *, std::string> hoisted;
+  std::unordered_map<const ExprAST *, HoistedRow> hoisted_rows;
+  // 正在生成的语句块及其当前语句的下标, 进入循环体时压入空指针隔开
+  std::vector<std::pair<const BlockAST *, size_t>> open_blocks;
+  // 公共子表达式: 键是把变量换成存储位置后的表达式文本. 按分支和循环嵌套分层,
+  // 离开时丢掉内层算出的值; 写变量, 写数组和调用时作废依赖它们的值
+  struct CseEntry {
+    std::string value;
+    std::vector<std::string> vars;  // 依赖的标量的存储位置
+    bool reads_memory = false;      // 读了数组元素
+    bool reads_globals = false;     // 读了全局标量
+  };
+  std::vector<std::unordered_map<std::string, CseEntry>> cse;
+  // 常量传播: 当前位置值确定的局部标量, 存储位置 -> 值
+  std::unordered_map<std::string, int> known_values;
+  long long exec_count = -1;  // 剖析给出的当前语句的执行次数, -1 表示不知道
 
   void PushScope();
   void PopScope();
@@ -65,15 +179,69 @@ struct RiscvValue {
 struct RiscvContext {
   int stack_size = 0;
   int label_id = 0;
+  // 栈底预留给栈传参的区域大小, 局部变量紧挨着它往上分配
+  int out_args_size = 0;
   std::string func_name;
-  std::string return_label;
   std::vector<std::string> break_labels;
   std::vector<std::string> continue_labels;
   std::unordered_map<std::string, bool> func_returns_void;
   std::vector<std::string> data;
   bool in_global = false;
   std::vector<std::string> body;
+  std::vector<std::string> rodata;  // 跳转表, 跟在函数代码后面输出
   std::vector<std::unordered_map<std::string, RiscvSymbol>> scopes;
+  size_t visible_from = 0;
+  const ProgramInfo *prog = nullptr;
+
+  struct InlineFrame {
+    std::string end_label;
+    int result_offset = -1;
+  };
+  std::vector<InlineFrame> inline_frames;
+  int inline_growth = 0;
+
+  bool current_func_is_void = false;
+  bool has_local_arrays = false;
+  std::vector<int> param_offsets;
+  std::string entry_label;  // 自尾递归跳回的位置, 为空表示没有自尾递归
+  // 全局变量标号 -> 序言里算好其地址的寄存器
+  std::vector<std::pair<std::string, std::string>> global_regs;
+
+  struct HoistedRow {
+    RiscvValue ptr;
+    size_t prefix = 0;
+  };
+  std::unordered_map<const ExprAST *, RiscvValue> hoisted;
+  std::unordered_map<const ExprAST *, HoistedRow> hoisted_rows;
+  struct CseEntry {
+    RiscvValue value;
+    std::vector<std::string> vars;
+    bool reads_memory = false;
+    bool reads_globals = false;
+  };
+  std::vector<std::unordered_map<std::string, CseEntry>> cse;
+  std::unordered_map<std::string, int> known_values;
+  long long exec_count = -1;
+  std::vector<std::string> cold;  // 剖析认为很少执行的代码, 接在函数末尾
+  int spills = 0;   // -stats 用
+  int reloads = 0;
+  int frame_size = 0;  // 生成完函数后才确定, 函数级缓存用
+  int line = 0;      // 正在生成的语句的源码行号
+  int loc_line = 0;  // 上一条 .loc 给出的行号, 0 表示标号之后还没输出过
+
+  // 归纳变量强度削减: 数组访问 -> 指针槽和附加偏移; 归纳变量自增语句 -> 要同步推进的指针槽和字节数
+  struct IvAccess {
+    int slot = 0;
+    int offset = 0;
+  };
+  struct IvStep {
+    std::vector<std::pair<int, int>> bumps;
+    bool counter_dead = false;  // 计数器只用于寻址和循环条件, 已被指针比较取代
+  };
+  std::unordered_map<const ExprAST *, IvAccess> iv_access;
+  std::unordered_map<const BaseAST *, IvStep> iv_steps;
+  // 正在生成的语句块及其当前语句的下标, 进入循环体时压入空指针隔开
+  std::vector<std::pair<const BlockAST *, size_t>> open_blocks;
 
   void PushScope();
   void PopScope();
@@ -81,7 +249,7 @@ struct RiscvContext {
   RiscvSymbol *FindSymbol(const std::string &name);
   int AllocSlot();
   int AllocArray(size_t count);
-  void Emit(const std::string &line);
+  void Emit(const std::string &inst);
   void EmitLabel(const std::string &label);
   std::string NewLabel(const std::string &prefix);
 };
@@ -91,6 +259,8 @@ struct RiscvContext {
  */
 class BaseAST {
  public:
+  int line = 0;  // 源码行号, 0 表示不知道
+
   virtual ~BaseAST() = default;
   virtual void Dump(IRGenContext &ctx) const = 0;
   virtual void EmitRiscv(RiscvContext &ctx) const = 0;
@@ -99,6 +269,8 @@ class BaseAST {
 
 class ExprAST {
  public:
+  int line = 0;
+
   virtual ~ExprAST() = default;
   virtual std::string Gen(IRGenContext &ctx) const = 0;
   virtual int Eval(IRGenContext &ctx) const = 0;
@@ -271,14 +443,17 @@ class LValAST : public ExprAST {
   std::vector<std::unique_ptr<ExprAST>> indices;
 
   std::string Gen(IRGenContext &ctx) const override;
+  std::string GenUncached(IRGenContext &ctx) const;
   int Eval(IRGenContext &ctx) const override;
   std::string GetPtr(IRGenContext &ctx) const;
   std::string GetPtrWithIndices(IRGenContext &ctx) const;
   RiscvValue GenRiscv(RiscvContext &ctx) const override;
+  RiscvValue GenRiscvUncached(RiscvContext &ctx) const;
   int EvalConst(RiscvContext &ctx) const override;
   int GetOffset(RiscvContext &ctx) const;
   bool IsGlobal(RiscvContext &ctx) const;
   std::string GetLabel(RiscvContext &ctx) const;
+  std::vector<RiscvValue> GenIndicesRiscv(RiscvContext &ctx) const;
   void EmitAddrRiscv(RiscvContext &ctx, const std::vector<int> &dims,
                      const std::vector<RiscvValue> &idx_vals,
                      const RiscvSymbol &sym) const;
@@ -290,8 +465,10 @@ class UnaryExpAST : public ExprAST {
   std::unique_ptr<ExprAST> rhs;
 
   std::string Gen(IRGenContext &ctx) const override;
+  std::string GenUncached(IRGenContext &ctx) const;
   int Eval(IRGenContext &ctx) const override;
   RiscvValue GenRiscv(RiscvContext &ctx) const override;
+  RiscvValue GenRiscvUncached(RiscvContext &ctx) const;
   int EvalConst(RiscvContext &ctx) const override;
 };
 
@@ -302,8 +479,10 @@ class BinaryExpAST : public ExprAST {
   std::unique_ptr<ExprAST> rhs;
 
   std::string Gen(IRGenContext &ctx) const override;
+  std::string GenUncached(IRGenContext &ctx) const;
   int Eval(IRGenContext &ctx) const override;
   RiscvValue GenRiscv(RiscvContext &ctx) const override;
+  RiscvValue GenRiscvUncached(RiscvContext &ctx) const;
   int EvalConst(RiscvContext &ctx) const override;
 };
 
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// 以内容为键的编译结果缓存: 每个条目是目录下以键命名的一个文件, 整个输出文件和
+// 单个函数的代码 (见 CompUnitAST::EmitRiscv) 都存在这里. 命中时刷新条目的修改时间,
+// CacheEvict 按修改时间从旧到新淘汰, 直到总大小不超过上限
+
+// 由源码, 其余参数 (模式, 选项等) 和编译器本身 (可执行文件的大小和修改时间) 算出的键
+std::string CacheKey(const char *source, size_t size, const std::string &args);
+
+// 命中时把缓存的内容写到 output 并返回 true
+bool CacheLookup(const std::string &dir, const std::string &key, const char *output);
+
+// 把刚生成的 output 存为 key 的条目
+void CacheStore(const std::string &dir, const std::string &key, const char *output);
+
+// 按键读写条目的内容
+bool CacheRead(const std::string &dir, const std::string &key, std::string &data);
+void CacheWrite(const std::string &dir, const std::string &key, const std::string &data);
+
+// 淘汰最久未用的条目, 直到总大小不超过 limit 字节
+void CacheEvict(const std::string &dir, long long limit);
+
+// 累加目录里的命中/未命中计数, 返回累加后的值
+void CacheCount(const std::string &dir, bool hit, long long &hits, long long &misses);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// 解释执行 Koopa IR 得到的动态统计
+struct KoopaRunStats {
+  long long insts = 0;   // 执行的指令条数, 含 br/jump/ret
+  long long blocks = 0;  // 进入基本块的次数
+  // "@函数 %块" -> 进入次数, 按次数从多到少排列, 只含执行过的块
+  std::vector<std::pair<std::string, long long>> block_counts;
+};
+
+// 解释执行 CompUnitAST::Dump 生成的 Koopa IR, 从 @main 开始; 程序的输入输出走
+// stdin/stdout, 返回 main 的返回值. IR 有错或运行时出错时在 stderr 报告并返回非零值
+int RunKoopa(const std::string &ir, KoopaRunStats &stats);
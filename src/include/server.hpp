@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+// 一次编译: argv 的格式和命令行相同 (argv[0] 是程序名, 之后是 模式 输入 -o 输出 [选项...]).
+// in 不为空时从 in 读源码, 否则打开 argv[2]. 返回进程的退出码
+using CompileFunc = int (*)(int argc, const char *argv[], FILE *in);
+
+// 常驻编译服务: 在 Unix 套接字 socket_path 上接受编译请求, 每个请求 fork 一个
+// 子进程去编译, 最多 jobs 个同时进行. 收到 SIGINT/SIGTERM 后等正在编译的请求
+// 结束, 删除套接字文件并返回
+int RunServer(const std::string &socket_path, int jobs, CompileFunc compile);
+
+// 把 argv (从模式开始的 argc 个参数) 发给 socket_path 上的服务, 诊断信息转到
+// stderr, 返回服务端编译的退出码. 连不上服务或者模式是 -run 时在本进程里调用 compile
+int RunClient(const std::string &socket_path, int argc, const char *argv[],
+              CompileFunc compile);
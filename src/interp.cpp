@@ -0,0 +1,630 @@
+#include "include/interp.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+// 预先把 IR 译成按寄存器编号寻址的指令数组再执行: 每个 %值, 常量和全局变量地址都在
+// 函数的寄存器文件里有固定编号, 常量在建立栈帧时一次性填好, 执行时不再查名字
+
+namespace {
+
+struct KoopaError : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+/* =======================
+ * 类型
+ * ======================= */
+// 类型保持 Koopa 的文本形式: i32, *T, [T, n]. i32 和指针各占一个字
+std::string Trim(const std::string &text) {
+  size_t begin = text.find_first_not_of(' ');
+  size_t end = text.find_last_not_of(' ');
+  return begin == std::string::npos ? "" : text.substr(begin, end - begin + 1);
+}
+
+// 按最外层的逗号拆分, 括号里的逗号不算
+std::vector<std::string> SplitTopLevel(const std::string &text) {
+  std::vector<std::string> parts;
+  int depth = 0;
+  size_t start = 0;
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] == '[' || text[i] == '(' || text[i] == '{') {
+      ++depth;
+    } else if (text[i] == ']' || text[i] == ')' || text[i] == '}') {
+      --depth;
+    } else if (text[i] == ',' && depth == 0) {
+      parts.push_back(Trim(text.substr(start, i - start)));
+      start = i + 1;
+    }
+  }
+  auto last = Trim(text.substr(start));
+  if (!last.empty()) {
+    parts.push_back(last);
+  }
+  return parts;
+}
+
+bool SplitArrayType(const std::string &type, std::string &elem, int64_t &len) {
+  if (type.size() < 2 || type.front() != '[') {
+    return false;
+  }
+  auto parts = SplitTopLevel(type.substr(1, type.size() - 2));
+  if (parts.size() != 2) {
+    throw KoopaError("bad array type " + type);
+  }
+  elem = parts[0];
+  len = std::stoll(parts[1]);
+  return true;
+}
+
+int64_t TypeSize(const std::string &type) {
+  std::string elem;
+  int64_t len = 0;
+  return SplitArrayType(type, elem, len) ? len * TypeSize(elem) : 1;
+}
+
+std::string Pointee(const std::string &type) {
+  if (type.empty() || type[0] != '*') {
+    throw KoopaError("expected a pointer, got " + type);
+  }
+  return type.substr(1);
+}
+
+/* =======================
+ * 预译码的程序
+ * ======================= */
+enum class Op : uint8_t {
+  kAlloc, kLoad, kStore, kOffset,
+  kAdd, kSub, kMul, kDiv, kMod, kLt, kGt, kLe, kGe, kEq, kNe,
+  kAnd, kOr, kXor, kShl, kShr, kSar,
+  kBr, kJump, kRet, kCall, kBuiltin,
+};
+
+enum Builtin { kGetint, kGetch, kGetarray, kPutint, kPutch, kPutarray };
+
+struct Inst {
+  Op op = Op::kRet;
+  int dst = -1;      // 结果寄存器, -1 表示没有结果
+  int a = -1;        // 操作数寄存器; ret 没有返回值时为 -1
+  int b = -1;
+  int64_t imm = 0;   // alloc 的帧内偏移, getelemptr/getptr 的步长, 内建函数编号
+  int t1 = 0;        // 跳转目标块
+  int t2 = 0;
+  int callee = -1;
+  std::vector<int> args;
+};
+
+struct Function {
+  std::string name;
+  bool defined = false;
+  int num_params = 0;                // 形参占寄存器 0 .. num_params-1
+  std::vector<std::string> param_types;
+  std::vector<int64_t> init_regs;    // 新栈帧的寄存器文件, 常量已经填好
+  int64_t frame_words = 0;           // alloc 出来的局部变量占的字数
+  std::vector<Inst> code;
+  std::vector<size_t> block_start;   // 各基本块第一条指令的下标
+  std::vector<std::string> block_names;
+  size_t count_base = 0;             // 在全局块计数数组里的起点
+};
+
+struct Program {
+  std::vector<Function> funcs;
+  std::unordered_map<std::string, int> func_index;
+  std::unordered_map<std::string, std::pair<int64_t, std::string>> globals;  // 地址和类型
+  std::vector<int32_t> mem;
+  size_t total_blocks = 0;
+};
+
+const std::unordered_map<std::string, Op> kBinaryOps = {
+    {"add", Op::kAdd}, {"sub", Op::kSub}, {"mul", Op::kMul}, {"div", Op::kDiv},
+    {"mod", Op::kMod}, {"lt", Op::kLt},   {"gt", Op::kGt},   {"le", Op::kLe},
+    {"ge", Op::kGe},   {"eq", Op::kEq},   {"ne", Op::kNe},   {"and", Op::kAnd},
+    {"or", Op::kOr},   {"xor", Op::kXor}, {"shl", Op::kShl}, {"shr", Op::kShr},
+    {"sar", Op::kSar},
+};
+
+const std::unordered_map<std::string, int> kBuiltins = {
+    {"getint", kGetint}, {"getch", kGetch}, {"getarray", kGetarray},
+    {"putint", kPutint}, {"putch", kPutch}, {"putarray", kPutarray},
+};
+
+bool IsNumber(const std::string &text) {
+  size_t start = !text.empty() && text[0] == '-' ? 1 : 0;
+  return text.size() > start &&
+         std::all_of(text.begin() + start, text.end(), [](char c) { return isdigit(c); });
+}
+
+// 聚合初值按出现顺序展开成数, 不足的部分补零
+void FlattenInit(const std::string &init, std::vector<int32_t> &out) {
+  std::string number;
+  for (char c : init + ",") {
+    if (isdigit(c) || c == '-') {
+      number += c;
+    } else if (!number.empty()) {
+      out.push_back(static_cast<int32_t>(std::stoll(number)));
+      number.clear();
+    }
+  }
+}
+
+/* =======================
+ * 译码
+ * ======================= */
+class Decoder {
+ public:
+  Decoder(Program &prog, Function &fn, std::vector<std::string> params)
+      : params_(std::move(params)), prog_(prog), fn_(fn) {}
+
+  void Decode(const std::vector<std::string> &body) {
+    for (int i = 0; i < fn_.num_params; ++i) {
+      regs_[params_[i]] = i;
+    }
+    next_reg_ = fn_.num_params;
+    for (const auto &line : body) {
+      if (line[0] != ' ') {
+        blocks_[line.substr(0, line.size() - 1)] = static_cast<int>(blocks_.size());
+        continue;
+      }
+      auto text = Trim(line);
+      auto eq = text.find(" = ");
+      if (text[0] == '%' && eq != std::string::npos) {
+        defs_[text.substr(0, eq)] = text.substr(eq + 3);
+      }
+    }
+    for (const auto &line : body) {
+      if (line[0] != ' ') {
+        fn_.block_start.push_back(fn_.code.size());
+        fn_.block_names.push_back(line.substr(0, line.size() - 1));
+      } else {
+        DecodeInst(Trim(line));
+      }
+    }
+    fn_.init_regs.assign(next_reg_, 0);
+    for (const auto &entry : consts_) {
+      fn_.init_regs[entry.second] = std::stoll(entry.first);
+    }
+    for (const auto &entry : global_regs_) {
+      fn_.init_regs[entry.second] = prog_.globals.at(entry.first).first;
+    }
+  }
+
+ private:
+  int Reg(const std::string &operand) {
+    if (IsNumber(operand)) {
+      auto found = consts_.find(operand);
+      return found != consts_.end() ? found->second : consts_[operand] = next_reg_++;
+    }
+    if (operand[0] == '@') {
+      if (!prog_.globals.count(operand)) {
+        throw KoopaError("unknown global " + operand);
+      }
+      auto found = global_regs_.find(operand);
+      return found != global_regs_.end() ? found->second : global_regs_[operand] = next_reg_++;
+    }
+    auto found = regs_.find(operand);
+    return found != regs_.end() ? found->second : regs_[operand] = next_reg_++;
+  }
+
+  int Block(const std::string &label) {
+    auto found = blocks_.find(label);
+    if (found == blocks_.end()) {
+      throw KoopaError("unknown label " + label + " in @" + fn_.name);
+    }
+    return found->second;
+  }
+
+  std::string TypeOf(const std::string &operand) {
+    if (IsNumber(operand)) {
+      return "i32";
+    }
+    if (operand[0] == '@') {
+      return "*" + prog_.globals.at(operand).second;
+    }
+    auto cached = types_.find(operand);
+    if (cached != types_.end()) {
+      return cached->second;
+    }
+    for (int i = 0; i < fn_.num_params; ++i) {
+      if (params_[i] == operand) {
+        return fn_.param_types[i];
+      }
+    }
+    auto def = defs_.find(operand);
+    if (def == defs_.end()) {
+      throw KoopaError("undefined value " + operand + " in @" + fn_.name);
+    }
+    const auto &rhs = def->second;
+    auto space = rhs.find(' ');
+    auto opcode = rhs.substr(0, space);
+    auto operands = SplitTopLevel(rhs.substr(space + 1));
+    std::string type = "i32";
+    if (opcode == "alloc") {
+      type = "*" + rhs.substr(space + 1);
+    } else if (opcode == "load") {
+      type = Pointee(TypeOf(operands[0]));
+    } else if (opcode == "getelemptr") {
+      std::string elem;
+      int64_t len = 0;
+      if (!SplitArrayType(Pointee(TypeOf(operands[0])), elem, len)) {
+        throw KoopaError("getelemptr on a non-array in @" + fn_.name);
+      }
+      type = "*" + elem;
+    } else if (opcode == "getptr") {
+      type = TypeOf(operands[0]);
+    }
+    return types_[operand] = type;
+  }
+
+  void DecodeInst(const std::string &text) {
+    Inst inst;
+    std::string rhs = text;
+    auto eq = text.find(" = ");
+    if (text[0] == '%' && eq != std::string::npos) {
+      inst.dst = Reg(text.substr(0, eq));
+      rhs = text.substr(eq + 3);
+    }
+    auto space = rhs.find(' ');
+    auto opcode = rhs.substr(0, space);
+    auto rest = space == std::string::npos ? "" : rhs.substr(space + 1);
+    auto operands = SplitTopLevel(rest);
+    if (opcode == "alloc") {
+      inst.op = Op::kAlloc;
+      inst.imm = fn_.frame_words;
+      fn_.frame_words += TypeSize(rest);
+    } else if (opcode == "load") {
+      inst.op = Op::kLoad;
+      inst.a = Reg(operands[0]);
+    } else if (opcode == "store") {
+      inst.op = Op::kStore;
+      inst.a = Reg(operands[0]);
+      inst.b = Reg(operands[1]);
+    } else if (opcode == "getelemptr" || opcode == "getptr") {
+      auto base = Pointee(TypeOf(operands[0]));
+      std::string elem = base;
+      int64_t len = 0;
+      if (opcode == "getelemptr" && !SplitArrayType(base, elem, len)) {
+        throw KoopaError("getelemptr on a non-array in @" + fn_.name);
+      }
+      inst.op = Op::kOffset;
+      inst.a = Reg(operands[0]);
+      inst.b = Reg(operands[1]);
+      inst.imm = TypeSize(elem);
+    } else if (kBinaryOps.count(opcode)) {
+      inst.op = kBinaryOps.at(opcode);
+      inst.a = Reg(operands[0]);
+      inst.b = Reg(operands[1]);
+    } else if (opcode == "br") {
+      inst.op = Op::kBr;
+      inst.a = Reg(operands[0]);
+      inst.t1 = Block(operands[1]);
+      inst.t2 = Block(operands[2]);
+    } else if (opcode == "jump") {
+      inst.op = Op::kJump;
+      inst.t1 = Block(operands[0]);
+    } else if (opcode == "ret") {
+      inst.op = Op::kRet;
+      inst.a = operands.empty() ? -1 : Reg(operands[0]);
+    } else if (opcode == "call") {
+      auto open = rest.find('(');
+      auto name = rest.substr(1, open - 1);
+      for (const auto &arg : SplitTopLevel(rest.substr(open + 1, rest.size() - open - 2))) {
+        inst.args.push_back(Reg(arg));
+      }
+      auto callee = prog_.func_index.find(name);
+      if (callee != prog_.func_index.end() && prog_.funcs[callee->second].defined) {
+        inst.op = Op::kCall;
+        inst.callee = callee->second;
+      } else if (kBuiltins.count(name)) {
+        inst.op = Op::kBuiltin;
+        inst.imm = kBuiltins.at(name);
+      } else {
+        throw KoopaError("call to undefined function @" + name);
+      }
+    } else {
+      throw KoopaError("unsupported instruction: " + text);
+    }
+    fn_.code.push_back(std::move(inst));
+  }
+
+  std::vector<std::string> params_;
+  Program &prog_;
+  Function &fn_;
+  int next_reg_ = 0;
+  std::unordered_map<std::string, int> regs_;
+  std::unordered_map<std::string, int> consts_;
+  std::unordered_map<std::string, int> global_regs_;
+  std::unordered_map<std::string, int> blocks_;
+  std::unordered_map<std::string, std::string> defs_;
+  std::unordered_map<std::string, std::string> types_;
+};
+
+// fun @f(%a: i32, %p: *[i32, 3]): i32 { 里的函数名和形参
+void ParseSignature(const std::string &line, Function &fn, std::vector<std::string> &params) {
+  auto open = line.find('(');
+  fn.name = line.substr(5, open - 5);
+  int depth = 0;
+  size_t close = open;
+  for (; close < line.size(); ++close) {
+    depth += line[close] == '(' ? 1 : line[close] == ')' ? -1 : 0;
+    if (depth == 0) {
+      break;
+    }
+  }
+  for (const auto &param : SplitTopLevel(line.substr(open + 1, close - open - 1))) {
+    auto colon = param.find(':');
+    params.push_back(Trim(param.substr(0, colon)));
+    fn.param_types.push_back(Trim(param.substr(colon + 1)));
+  }
+  fn.num_params = static_cast<int>(params.size());
+}
+
+void LoadProgram(const std::string &ir, Program &prog) {
+  std::vector<std::string> lines;
+  std::istringstream in(ir);
+  for (std::string line; std::getline(in, line);) {
+    if (!Trim(line).empty()) {
+      lines.push_back(line);
+    }
+  }
+  // 先登记全局变量和函数名, 函数体里可以引用后面定义的函数
+  struct Body {
+    int func;
+    size_t begin;
+    size_t end;
+    std::vector<std::string> params;
+  };
+  std::vector<Body> bodies;
+  for (size_t i = 0; i < lines.size(); ++i) {
+    const auto &line = lines[i];
+    if (line.rfind("global ", 0) == 0) {
+      auto eq = line.find(" = alloc ");
+      auto name = line.substr(7, eq - 7);
+      auto parts = SplitTopLevel(line.substr(eq + 9));
+      int64_t addr = static_cast<int64_t>(prog.mem.size());
+      std::vector<int32_t> init;
+      if (parts.size() > 1 && parts[1] != "zeroinit") {
+        FlattenInit(parts[1], init);
+      }
+      init.resize(TypeSize(parts[0]), 0);
+      prog.mem.insert(prog.mem.end(), init.begin(), init.end());
+      prog.globals[name] = {addr, parts[0]};
+    } else if (line.rfind("fun ", 0) == 0) {
+      Function fn;
+      fn.defined = true;
+      std::vector<std::string> params;
+      ParseSignature(line, fn, params);
+      int index = static_cast<int>(prog.funcs.size());
+      prog.func_index[fn.name] = index;
+      prog.funcs.push_back(std::move(fn));
+      size_t end = i + 1;
+      while (end < lines.size() && lines[end] != "}") {
+        ++end;
+      }
+      bodies.push_back({index, i + 1, end, std::move(params)});
+      i = end;
+    }
+  }
+  for (auto &body : bodies) {
+    auto &fn = prog.funcs[body.func];
+    Decoder decoder(prog, fn, std::move(body.params));
+    decoder.Decode({lines.begin() + body.begin, lines.begin() + body.end});
+    fn.count_base = prog.total_blocks;
+    prog.total_blocks += fn.block_start.size();
+  }
+}
+
+/* =======================
+ * 执行
+ * ======================= */
+struct Frame {
+  int func;
+  size_t reg_base;
+  int64_t mem_base;
+  size_t pc;
+  int ret_dst;  // 调用者里接收返回值的寄存器
+};
+
+constexpr int64_t kMaxMemWords = int64_t(1) << 28;
+
+int32_t Wrap(int64_t value) { return static_cast<int32_t>(static_cast<uint32_t>(value)); }
+
+int Execute(Program &prog, KoopaRunStats &stats) {
+  auto main_fn = prog.func_index.find("main");
+  if (main_fn == prog.func_index.end()) {
+    throw KoopaError("no @main");
+  }
+  auto &mem = prog.mem;
+  std::vector<int64_t> regs;
+  std::vector<Frame> frames;
+  std::vector<long long> counts(prog.total_blocks, 0);
+  int64_t stack_top = static_cast<int64_t>(mem.size());
+
+  const Function *fn = nullptr;
+  const Inst *code = nullptr;
+  int64_t *r = nullptr;
+  size_t pc = 0;
+  int64_t mem_base = 0;
+  auto load_frame = [&] {
+    const Frame &frame = frames.back();
+    fn = &prog.funcs[frame.func];
+    code = fn->code.data();
+    r = regs.data() + frame.reg_base;
+    pc = frame.pc;
+    mem_base = frame.mem_base;
+  };
+  // 建立被调函数的栈帧, 实参从调用者的寄存器里取
+  auto enter = [&](int callee, const std::vector<int> &args, int ret_dst) {
+    const Function &target = prog.funcs[callee];
+    if (target.block_start.empty()) {
+      throw KoopaError("@" + target.name + " has no body");
+    }
+    size_t caller_base = frames.empty() ? 0 : frames.back().reg_base;
+    size_t base = regs.size();
+    regs.insert(regs.end(), target.init_regs.begin(), target.init_regs.end());
+    for (size_t i = 0; i < args.size(); ++i) {
+      regs[base + i] = regs[caller_base + args[i]];
+    }
+    if (stack_top + target.frame_words > kMaxMemWords) {
+      throw KoopaError("stack overflow in @" + target.name);
+    }
+    if (static_cast<int64_t>(mem.size()) < stack_top + target.frame_words) {
+      mem.resize(std::max<int64_t>(stack_top + target.frame_words, mem.size() * 2));
+    }
+    frames.push_back({callee, base, stack_top, target.block_start[0], ret_dst});
+    stack_top += target.frame_words;
+    ++counts[target.count_base];
+    ++stats.blocks;
+    load_frame();
+  };
+  auto check = [&](int64_t addr) {
+    if (addr < 0 || addr >= static_cast<int64_t>(mem.size())) {
+      throw KoopaError("memory access out of bounds in @" + fn->name);
+    }
+    return addr;
+  };
+  auto jump = [&](int block) {
+    pc = fn->block_start[block];
+    ++counts[fn->count_base + block];
+    ++stats.blocks;
+  };
+
+  enter(main_fn->second, {}, -1);
+  int exit_code = 0;
+  while (!frames.empty()) {
+    const Inst &inst = code[pc++];
+    ++stats.insts;
+    int32_t x = inst.a >= 0 ? Wrap(r[inst.a]) : 0;
+    int32_t y = inst.b >= 0 ? Wrap(r[inst.b]) : 0;
+    auto ux = static_cast<uint32_t>(x);
+    auto uy = static_cast<uint32_t>(y);
+    switch (inst.op) {
+      case Op::kAlloc: r[inst.dst] = mem_base + inst.imm; break;
+      case Op::kLoad: r[inst.dst] = mem[check(r[inst.a])]; break;
+      case Op::kStore: mem[check(r[inst.b])] = x; break;
+      case Op::kOffset: r[inst.dst] = r[inst.a] + static_cast<int64_t>(y) * inst.imm; break;
+      case Op::kAdd: r[inst.dst] = static_cast<int32_t>(ux + uy); break;
+      case Op::kSub: r[inst.dst] = static_cast<int32_t>(ux - uy); break;
+      case Op::kMul: r[inst.dst] = static_cast<int32_t>(ux * uy); break;
+      case Op::kDiv:
+      case Op::kMod:
+        if (y == 0) {
+          throw KoopaError("division by zero in @" + fn->name);
+        }
+        if (x == INT32_MIN && y == -1) {
+          r[inst.dst] = inst.op == Op::kDiv ? x : 0;
+        } else {
+          r[inst.dst] = inst.op == Op::kDiv ? x / y : x % y;
+        }
+        break;
+      case Op::kLt: r[inst.dst] = x < y; break;
+      case Op::kGt: r[inst.dst] = x > y; break;
+      case Op::kLe: r[inst.dst] = x <= y; break;
+      case Op::kGe: r[inst.dst] = x >= y; break;
+      case Op::kEq: r[inst.dst] = x == y; break;
+      case Op::kNe: r[inst.dst] = x != y; break;
+      case Op::kAnd: r[inst.dst] = x & y; break;
+      case Op::kOr: r[inst.dst] = x | y; break;
+      case Op::kXor: r[inst.dst] = x ^ y; break;
+      case Op::kShl: r[inst.dst] = static_cast<int32_t>(ux << (uy & 31)); break;
+      case Op::kShr: r[inst.dst] = static_cast<int32_t>(ux >> (uy & 31)); break;
+      case Op::kSar: r[inst.dst] = x >> (uy & 31); break;
+      case Op::kBr: jump(x != 0 ? inst.t1 : inst.t2); break;
+      case Op::kJump: jump(inst.t1); break;
+      case Op::kCall:
+        frames.back().pc = pc;
+        enter(inst.callee, inst.args, inst.dst);
+        break;
+      case Op::kRet: {
+        int64_t value = inst.a >= 0 ? x : 0;
+        Frame done = frames.back();
+        frames.pop_back();
+        regs.resize(done.reg_base);
+        stack_top = done.mem_base;
+        if (frames.empty()) {
+          exit_code = static_cast<int32_t>(value);
+          break;
+        }
+        load_frame();
+        if (done.ret_dst >= 0) {
+          r[done.ret_dst] = value;
+        }
+        break;
+      }
+      case Op::kBuiltin: {
+        int value = 0;
+        auto arg = [&](size_t i) { return r[inst.args.at(i)]; };
+        switch (inst.imm) {
+          case kGetint:
+            if (scanf("%d", &value) != 1) {
+              value = 0;
+            }
+            break;
+          case kGetch: value = getchar(); break;
+          case kGetarray: {
+            if (scanf("%d", &value) != 1) {
+              value = 0;
+            }
+            int64_t base = arg(0);
+            for (int i = 0; i < value; ++i) {
+              int elem = 0;
+              if (scanf("%d", &elem) != 1) {
+                elem = 0;
+              }
+              mem[check(base + i)] = elem;
+            }
+            break;
+          }
+          case kPutint: printf("%d", Wrap(arg(0))); break;
+          case kPutch: putchar(Wrap(arg(0))); break;
+          case kPutarray: {
+            int n = Wrap(arg(0));
+            int64_t base = arg(1);
+            printf("%d:", n);
+            for (int i = 0; i < n; ++i) {
+              printf(" %d", mem[check(base + i)]);
+            }
+            printf("\n");
+            break;
+          }
+        }
+        if (inst.dst >= 0) {
+          r[inst.dst] = value;
+        }
+        break;
+      }
+    }
+  }
+  for (const auto &func : prog.funcs) {
+    for (size_t i = 0; i < func.block_start.size(); ++i) {
+      if (counts[func.count_base + i] > 0) {
+        stats.block_counts.emplace_back("@" + func.name + " " + func.block_names[i],
+                                        counts[func.count_base + i]);
+      }
+    }
+  }
+  std::stable_sort(stats.block_counts.begin(), stats.block_counts.end(),
+                   [](const auto &lhs, const auto &rhs) { return lhs.second > rhs.second; });
+  return exit_code;
+}
+
+}  // namespace
+
+int RunKoopa(const std::string &ir, KoopaRunStats &stats) {
+  try {
+    Program prog;
+    LoadProgram(ir, prog);
+    int exit_code = Execute(prog, stats);
+    fflush(stdout);
+    return exit_code;
+  } catch (const std::exception &error) {
+    fflush(stdout);
+    std::cerr << "run: error: " << error.what() << std::endl;
+    return 255;
+  }
+}
@@ -0,0 +1,273 @@
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// 因为要用到 Bison 中关于 token 的定义
+#include "sysy.tab.hpp"
+
+// 手写的词法分析器, make LEXER=hand 时代替 sysy.l 生成的扫描器, 给出完全相同的 token 序列.
+// 空白和块注释用 SSE2 (AVX2=1 时 AVX2) 一次看 16 (32) 个字节; 标识符字符查表, 关键字用完美散列
+
+namespace {
+
+/* =======================
+ * 字符分类
+ * ======================= */
+enum : uint8_t {
+  kSpace = 1,       // sysy.l 的 WhiteSpace: 只有空格, \t, \n, \r
+  kIdentStart = 2,
+  kIdentChar = 4,
+  kDigit = 8,
+  kOctal = 16,
+  kHex = 32,
+};
+
+struct CharTable {
+  uint8_t cls[256] = {};
+
+  constexpr CharTable() {
+    for (int c : {' ', '\t', '\n', '\r'}) {
+      cls[c] |= kSpace;
+    }
+    for (int c = 'a'; c <= 'z'; ++c) {
+      cls[c] |= kIdentStart | kIdentChar;
+    }
+    for (int c = 'A'; c <= 'Z'; ++c) {
+      cls[c] |= kIdentStart | kIdentChar;
+    }
+    cls['_'] |= kIdentStart | kIdentChar;
+    for (int c = '0'; c <= '9'; ++c) {
+      cls[c] |= kIdentChar | kDigit | kHex;
+    }
+    for (int c = '0'; c <= '7'; ++c) {
+      cls[c] |= kOctal;
+    }
+    for (int c = 'a'; c <= 'f'; ++c) {
+      cls[c] |= kHex;
+    }
+    for (int c = 'A'; c <= 'F'; ++c) {
+      cls[c] |= kHex;
+    }
+  }
+  bool Is(char c, uint8_t kind) const { return cls[static_cast<unsigned char>(c)] & kind; }
+};
+
+constexpr CharTable kChars;
+
+/* =======================
+ * 关键字
+ * ======================= */
+// (长度 * 7 + 首字母) % 16 在这 9 个关键字上两两不同, 查一次表再比较一次就够了
+struct Keyword {
+  const char *text;
+  size_t size;
+  int token;
+};
+
+constexpr Keyword kKeywords[16] = {
+    {"", 0, 0},              {"else", 4, ELSE},   {"void", 4, VOID},   {"", 0, 0},
+    {"", 0, 0},              {"break", 5, BREAK}, {"const", 5, CONST}, {"if", 2, IF},
+    {"", 0, 0},              {"", 0, 0},          {"while", 5, WHILE}, {"continue", 8, CONTINUE},
+    {"return", 6, RETURN},   {"", 0, 0},          {"int", 3, INT},     {"", 0, 0},
+};
+
+int KeywordToken(const char *text, size_t size) {
+  const Keyword &kw = kKeywords[(size * 7 + static_cast<unsigned char>(text[0])) % 16];
+  return kw.size == size && !memcmp(kw.text, text, size) ? kw.token : 0;
+}
+
+// 双字符运算符, 不是时返回 0
+int PairToken(char first, char second) {
+  switch (first) {
+    case '&': return second == '&' ? AND : 0;
+    case '|': return second == '|' ? OR : 0;
+    case '=': return second == '=' ? EQ : 0;
+    case '!': return second == '=' ? NE : 0;
+    case '<': return second == '=' ? LE : 0;
+    case '>': return second == '=' ? GE : 0;
+  }
+  return 0;
+}
+
+/* =======================
+ * 批量扫描
+ * ======================= */
+// 按块对齐读取, 对齐的读不会跨页, 所以可以读到缓冲开头之前和末尾的 '\0' 之后;
+// 读到的多余字节用掩码去掉
+#if defined(__AVX2__)
+constexpr size_t kLanes = 32;
+using Vec = __m256i;
+Vec Load(const char *p) { return _mm256_load_si256(reinterpret_cast<const Vec *>(p)); }
+uint32_t Match(Vec v, char c) {
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+}
+#elif defined(__SSE2__)
+constexpr size_t kLanes = 16;
+using Vec = __m128i;
+Vec Load(const char *p) { return _mm_load_si128(reinterpret_cast<const Vec *>(p)); }
+uint32_t Match(Vec v, char c) { return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))); }
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+const char *AlignDown(const char *p) {
+  return reinterpret_cast<const char *>(reinterpret_cast<uintptr_t>(p) & ~(kLanes - 1));
+}
+
+// 第 i 位以下的位
+uint32_t Below(int i) { return (1u << i) - 1; }
+
+// 跳过空白, 顺便数换行. 缓冲以 '\0' 结尾, 一定会停下
+const char *SkipSpace(const char *p, int &line) {
+  const char *block = AlignDown(p);
+  uint32_t keep = ~0u << (p - block);
+  for (;; block += kLanes, keep = ~0u) {
+    Vec v = Load(block);
+    uint32_t newline = Match(v, '\n') & keep;
+    uint32_t space = Match(v, ' ') | Match(v, '\t') | Match(v, '\r') | newline;
+    uint32_t other = ~space & keep & (kLanes == 32 ? ~0u : 0xffffu);
+    if (other) {
+      int i = __builtin_ctz(other);
+      line += __builtin_popcount(newline & Below(i));
+      return block + i;
+    }
+    line += __builtin_popcount(newline);
+  }
+}
+
+// 从 p 开始找块注释的结尾 "*/", 返回其中 '*' 的位置, 到 end 还没有时返回空指针.
+// 找到时把跳过的换行数加到 line 上
+const char *FindCommentEnd(const char *p, const char *end, int &line) {
+  const char *block = AlignDown(p);
+  uint32_t keep = ~0u << (p - block);
+  int lines = 0;
+  for (; block < end; block += kLanes, keep = ~0u) {
+    Vec v = Load(block);
+    uint32_t newline = Match(v, '\n') & keep;
+    for (uint32_t star = Match(v, '*') & keep; star; star &= star - 1) {
+      int i = __builtin_ctz(star);
+      if (block + i + 1 < end && block[i + 1] == '/') {
+        line += lines + __builtin_popcount(newline & Below(i));
+        return block + i;
+      }
+    }
+    lines += __builtin_popcount(newline);
+  }
+  return nullptr;
+}
+#else
+const char *SkipSpace(const char *p, int &line) {
+  for (; kChars.Is(*p, kSpace); ++p) {
+    line += *p == '\n';
+  }
+  return p;
+}
+
+const char *FindCommentEnd(const char *p, const char *end, int &line) {
+  int lines = 0;
+  for (; p + 1 < end; ++p) {
+    if (p[0] == '*' && p[1] == '/') {
+      line += lines;
+      return p;
+    }
+    lines += *p == '\n';
+  }
+  return nullptr;
+}
+#endif
+
+/* =======================
+ * 扫描器
+ * ======================= */
+const char *cur = nullptr;
+const char *end = nullptr;
+int line = 1;
+
+// 和 strtol(text, nullptr, 0) 再转成 int 的结果一致: 溢出时取 LONG_MAX
+int ParseInt(const char *text, size_t size, int base) {
+  long value = 0;
+  for (size_t i = 0; i < size; ++i) {
+    char c = text[i];
+    int digit = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+    if (value > (LONG_MAX - digit) / base) {
+      return static_cast<int>(LONG_MAX);
+    }
+    value = value * base + digit;
+  }
+  return static_cast<int>(value);
+}
+
+}  // namespace
+
+void SetLexerBuffer(char *buf, size_t size) {
+  cur = buf;
+  end = buf + size - 2;
+  line = 1;
+}
+
+int yylex() {
+  for (;;) {
+    cur = SkipSpace(cur, line);
+    yylloc.first_line = yylloc.last_line = line;
+    if (cur >= end) {
+      return 0;
+    }
+    const char *start = cur;
+    char c = *cur;
+    if (c == '/' && cur[1] == '/') {
+      auto newline = static_cast<const char *>(memchr(cur, '\n', end - cur));
+      cur = newline ? newline : end;
+      continue;
+    }
+    if (c == '/' && cur[1] == '*') {
+      // 没有结尾的 "/*" 不是注释, 和 flex 一样按单个字符 '/' 处理
+      if (const char *close = FindCommentEnd(cur + 2, end, line)) {
+        cur = close + 2;
+        continue;
+      }
+    }
+
+    if (kChars.Is(c, kIdentStart)) {
+      while (kChars.Is(*++cur, kIdentChar)) {
+      }
+      size_t size = cur - start;
+      if (int token = KeywordToken(start, size)) {
+        return token;
+      }
+      yylval.token_text = {start, static_cast<int>(size)};
+      return IDENT;
+    }
+
+    // 和 sysy.l 一样取最长匹配: 0x 后面没有十六进制数字时只有 "0" 是数, 0 开头的按八进制
+    if (kChars.Is(c, kDigit)) {
+      int base = 10;
+      if (c != '0') {
+        while (kChars.Is(*++cur, kDigit)) {
+        }
+      } else if ((cur[1] | 0x20) == 'x' && kChars.Is(cur[2], kHex)) {
+        base = 16;
+        start = cur += 2;
+        while (kChars.Is(*++cur, kHex)) {
+        }
+      } else {
+        base = 8;
+        while (kChars.Is(*++cur, kOctal)) {
+        }
+      }
+      yylval.int_val = ParseInt(start, cur - start, base);
+      return INT_CONST;
+    }
+
+    if (int token = PairToken(c, cur[1])) {
+      cur += 2;
+      return token;
+    }
+    ++cur;
+    return c;
+  }
+}
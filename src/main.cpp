@@ -1,40 +1,238 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <string>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "include/ast.hpp"
+#include "include/cache.hpp"
+#include "include/interp.hpp"
+#include "include/server.hpp"
 
 using namespace std;
 
 
 std::string mode;
+CompileOptions options;
+std::vector<FuncStats> func_stats;
 
 // 声明 lexer 的输入, 以及 parser 函数
-// 为什么不引用 sysy.tab.hpp 呢? 因为首先里面没有 yyin 的定义
+// 为什么不引用 sysy.tab.hpp 呢? 因为首先里面没有 SetLexerBuffer 的定义
 // 其次, 因为这个文件不是我们自己写的, 而是被 Bison 生成出来的
 // 你的代码编辑器/IDE 很可能找不到这个文件, 然后会给你报错 (虽然编译不会出错)
 // 看起来会很烦人, 于是干脆采用这种看起来 dirty 但实际很有效的手段
-extern FILE *yyin;
+extern void SetLexerBuffer(char *buf, size_t size);
 extern int yyparse(unique_ptr<BaseAST> &ast);
 
-int main(int argc, const char *argv[]) {
+// 把输入文件映射进内存, 后面至少跟两个 '\0' (lexer 原地扫描的要求): 先占一段比文件
+// 多两个字节的匿名映射, 再把文件覆盖映射到开头, 文件末尾之后的字节都是 0.
+// 私有映射可写, 只有 lexer 写到的页才会被复制. mapped 是要 munmap 的长度
+static char *MapSource(const char *path, size_t &size, size_t &mapped) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    return nullptr;
+  }
+  size = st.st_size;
+  size_t page = sysconf(_SC_PAGESIZE);
+  mapped = (size + 2 + page - 1) / page * page;
+  void *base = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base != MAP_FAILED && size > 0 &&
+      mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+          MAP_FAILED) {
+    munmap(base, mapped);
+    base = MAP_FAILED;
+  }
+  close(fd);
+  return base == MAP_FAILED ? nullptr : static_cast<char *>(base);
+}
+
+// 本次编译查缓存的结果和缓存目录里累计的计数, 用于 -stats
+static bool cache_used = false, cache_hit = false;
+static long long cache_hits = 0, cache_misses = 0;
+
+// -stats 的输出: 每个函数一行 JSON 对象, 不适用的字段省略
+static void PrintStats() {
+  ofstream file;
+  if (!options.stats_file.empty()) {
+    file.open(options.stats_file);
+  }
+  ostream &os = options.stats_file.empty() ? cerr : file;
+  os << "{\"mode\": \"" << mode.substr(1) << "\", ";
+  if (cache_used) {
+    // 命中时没有做代码生成, functions 为空
+    os << "\"cache\": {\"hit\": " << (cache_hit ? "true" : "false")
+       << ", \"hits\": " << cache_hits << ", \"misses\": " << cache_misses << "}, ";
+  }
+  os << "\"functions\": [";
+  for (size_t i = 0; i < func_stats.size(); ++i) {
+    const auto &stats = func_stats[i];
+    int total = 0;
+    os << (i ? "," : "") << "\n  {\"name\": \"" << stats.name << "\", \"insts\": {";
+    for (auto it = stats.insts.begin(); it != stats.insts.end(); ++it) {
+      os << (it == stats.insts.begin() ? "" : ", ") << "\"" << it->first
+         << "\": " << it->second;
+      total += it->second;
+    }
+    os << "}, \"total\": " << total << ", \"blocks\": " << stats.blocks;
+    if (cache_used) {
+      os << ", \"cached\": " << (stats.cached ? "true" : "false");
+    }
+    if (stats.frame_size >= 0) {
+      os << ", \"spills\": " << stats.spills << ", \"reloads\": " << stats.reloads
+         << ", \"frame_size\": " << stats.frame_size
+         << ", \"big_offsets\": " << stats.big_offsets;
+    }
+    os << "}";
+  }
+  os << "\n]}" << endl;
+}
+
+// 编译一个文件; in 不为空时从 in 读源码 (编译服务的 "-" 输入)
+static int Compile(int argc, const char *argv[], FILE *in) {
   // 解析命令行参数. 测试脚本/评测平台要求你的编译器能接收如下参数:
-  // compiler 模式 输入文件 -o 输出文件
-  assert(argc == 5);
+  // compiler 模式 输入文件 -o 输出文件 [选项...]
+  assert(argc >= 5);
   mode = argv[1];
   auto input = argv[2];
   auto output = argv[4];
+  // 除了缓存和统计本身的开关, 其余参数都会影响输出, 都算进缓存的键
+  string cache_args = mode;
+  for (int i = 5; i < argc; ++i) {
+    string opt = argv[i];
+    if (opt.rfind("-fcache", 0) != 0 && opt.rfind("-stats", 0) != 0) {
+      cache_args += '\0' + opt;
+    }
+    if (opt == "-fno-inline") {
+      options.inline_funcs = false;
+    } else if (opt.rfind("-finline-threshold=", 0) == 0) {
+      options.inline_threshold = stoi(opt.substr(opt.find('=') + 1));
+    } else if (opt.rfind("-finline-growth=", 0) == 0) {
+      options.inline_growth = stoi(opt.substr(opt.find('=') + 1));
+    } else if (opt.rfind("-fconst-eval-steps=", 0) == 0) {
+      options.const_eval_steps = stoi(opt.substr(opt.find('=') + 1));
+    } else if (opt == "-fno-unroll") {
+      options.unroll = false;
+    } else if (opt.rfind("-funroll-factor=", 0) == 0) {
+      options.unroll_factor = stoi(opt.substr(opt.find('=') + 1));
+    } else if (opt.rfind("-funroll-max-trips=", 0) == 0) {
+      options.unroll_max_trips = stoi(opt.substr(opt.find('=') + 1));
+    } else if (opt.rfind("-funroll-budget=", 0) == 0) {
+      options.unroll_budget = stoi(opt.substr(opt.find('=') + 1));
+    } else if (opt == "-fno-cse") {
+      options.cse = false;
+    } else if (opt == "-fno-simplify-cfg") {
+      options.simplify_cfg = false;
+    } else if (opt == "-fno-if-convert") {
+      options.if_convert = false;
+    } else if (opt.rfind("-fif-convert-cost=", 0) == 0) {
+      options.if_convert_cost = stoi(opt.substr(opt.find('=') + 1));
+    } else if (opt == "-fno-jump-tables") {
+      options.jump_tables = false;
+    } else if (opt.rfind("-fjump-table-min-cases=", 0) == 0) {
+      options.jump_table_min_cases = stoi(opt.substr(opt.find('=') + 1));
+    } else if (opt == "-fno-promote-globals") {
+      options.promote_globals = false;
+    } else if (opt.rfind("-fglobal-addr-regs=", 0) == 0) {
+      options.global_addr_regs = std::min(11, stoi(opt.substr(opt.find('=') + 1)));
+    } else if (opt == "-fopt-report") {
+      options.opt_report = true;
+    } else if (opt == "-fexec-counts") {
+      options.exec_counts = true;
+    } else if (opt.rfind("-fprofile-generate", 0) == 0) {
+      // 插桩版本不做会吞掉计数器的变换: 内联, 展开, if 转换和跳转表
+      options.profile_generate = true;
+      options.inline_funcs = options.unroll = false;
+      options.if_convert = options.jump_tables = false;
+      if (opt.find('=') != string::npos) {
+        options.profile_file = opt.substr(opt.find('=') + 1);
+      }
+    } else if (opt.rfind("-fprofile-use", 0) == 0) {
+      options.profile_use = true;
+      if (opt.find('=') != string::npos) {
+        options.profile_file = opt.substr(opt.find('=') + 1);
+      }
+    } else if (opt.rfind("-fprofile-cold-ratio=", 0) == 0) {
+      options.profile_cold_ratio = stoi(opt.substr(opt.find('=') + 1));
+    } else if (opt == "-fcycle-profile") {
+      options.cycle_profile = true;
+    } else if (opt == "-g") {
+      options.debug_lines = true;
+      options.source_file = input;
+    } else if (opt.rfind("-fcache-size=", 0) == 0) {
+      options.cache_size = stoll(opt.substr(opt.find('=') + 1));
+    } else if (opt.rfind("-fcache", 0) == 0) {
+      options.cache_dir = opt.find('=') != string::npos ? opt.substr(opt.find('=') + 1)
+                                                        : ".sysy-cache";
+    } else if (opt.rfind("-stats", 0) == 0) {
+      options.stats = true;
+      if (opt.find('=') != string::npos) {
+        options.stats_file = opt.substr(opt.find('=') + 1);
+      }
+    } else {
+      cerr << "warning: unknown option " << opt << endl;
+    }
+  }
 
-  // 打开输入文件, 并且指定 lexer 在解析的时候读取这个文件
-  yyin = fopen(input, "r");
-  assert(yyin);
+  // 把输入文件映射进内存, lexer 直接在上面扫描; 编译服务从连接读到的源码先攒进字符串
+  size_t source_size = 0, mapped = 0;
+  string streamed;
+  char *source = nullptr;
+  if (in) {
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+      streamed.append(buf, n);
+    }
+    source_size = streamed.size();
+    streamed.append(2, '\0');
+    source = &streamed[0];
+  } else {
+    source = MapSource(input, source_size, mapped);
+  }
+  assert(source);
+
+  // 查缓存: 用源码算键, 命中时直接写出缓存的结果, 不解析也不生成代码.
+  // -run 的结果取决于程序的输入, -fopt-report 的报告不在输出文件里, 这两种不缓存
+  string cache_key;
+  if (!options.cache_dir.empty() && mode != "-run" && !options.opt_report) {
+    if (options.debug_lines) {
+      cache_args += '\0' + options.source_file;
+    }
+    if (options.profile_use) {
+      ifstream prof(options.profile_file, ios::binary);
+      cache_args += '\0' + string(istreambuf_iterator<char>(prof), istreambuf_iterator<char>());
+    }
+    cache_used = true;
+    options.cache_salt = cache_args;
+    cache_key = CacheKey(source, source_size, cache_args);
+    cache_hit = CacheLookup(options.cache_dir, cache_key, output);
+    CacheCount(options.cache_dir, cache_hit, cache_hits, cache_misses);
+    if (cache_hit) {
+      if (options.stats) {
+        PrintStats();
+      }
+      return 0;
+    }
+  }
 
   // 调用 parser 函数, parser 函数会进一步调用 lexer 解析输入文件的
   unique_ptr<BaseAST> ast;
+  SetLexerBuffer(source, source_size + 2);
   auto ret = yyparse(ast);
   assert(!ret);
+  if (mapped) {
+    munmap(source, mapped);
+  }
 
   // 输出解析得到的 AST, 其实就是个字符串
   freopen(output, "w", stdout);
@@ -46,7 +244,62 @@ int main(int argc, const char *argv[]) {
   } else if (mode == "-riscv") {
     RiscvContext ctx;
     ast->EmitRiscv(ctx);
+  } else if (mode == "-run") {
+    // 生成 Koopa IR 后直接解释执行: 程序的输出写到输出文件, 执行统计写到 stderr
+    mode = "-koopa";
+    ostringstream ir;
+    auto *saved = cout.rdbuf(ir.rdbuf());
+    IRGenContext ctx;
+    ctx.out = &cout;
+    ast->Dump(ctx);
+    cout.rdbuf(saved);
+    if (options.stats) {
+      PrintStats();
+    }
+    KoopaRunStats stats;
+    int exit_code = RunKoopa(ir.str(), stats);
+    cerr << "run: " << stats.insts << " instructions, " << stats.blocks
+         << " basic blocks executed" << endl;
+    if (options.exec_counts) {
+      for (const auto &block : stats.block_counts) {
+        cerr << "  " << block.second << "\t" << block.first << endl;
+      }
+    }
+    return exit_code & 0xff;
   }
   cout << endl;
+  if (cache_used) {
+    cout.flush();
+    fflush(stdout);
+    CacheStore(options.cache_dir, cache_key, output);
+    CacheEvict(options.cache_dir, options.cache_size);
+  }
+  if (options.stats) {
+    PrintStats();
+  }
   return 0;
 }
+
+int main(int argc, const char *argv[]) {
+  // compiler -server 套接字 [-jN]: 常驻编译服务
+  // compiler -client 套接字 模式 输入 -o 输出 [选项...]: 把这次编译交给服务
+  string command = argc > 1 ? argv[1] : "";
+  if (command == "-server") {
+    assert(argc >= 3);
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 3; i < argc; ++i) {
+      string opt = argv[i];
+      if (opt.rfind("-j", 0) == 0) {
+        jobs = std::max(1, stoi(opt.substr(2)));
+      } else {
+        cerr << "warning: unknown option " << opt << endl;
+      }
+    }
+    return RunServer(argv[2], jobs, Compile);
+  }
+  if (command == "-client") {
+    assert(argc >= 3);
+    return RunClient(argv[2], argc - 3, argv + 3, Compile);
+  }
+  return Compile(argc, argv, nullptr);
+}
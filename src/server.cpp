@@ -0,0 +1,270 @@
+#include "include/server.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <vector>
+
+// 协议: 客户端先发一串以 '\0' 结尾的字符串: 工作目录, 然后是从模式开始的各个参数,
+// 最后一个空串表示参数结束. 输入文件是 "-" 时, 之后直到 EOF 的字节就是源码.
+// 服务端把编译时的 stderr 原样发回, 最后追加一个字节的退出码, 然后关闭连接
+//
+// 编译器的状态 (选项, 统计, lexer/parser) 都是全局变量, 而且出错时直接 assert,
+// 所以每个请求 fork 一个子进程来编译, 而不是在线程里跑: 子进程从常驻进程继承
+// 已经加载好的程序, 出错也只影响自己
+
+namespace {
+
+bool WriteAll(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool ReadString(FILE *in, std::string &str) {
+  str.clear();
+  int c;
+  while ((c = getc(in)) != EOF && c != '\0') {
+    str += static_cast<char>(c);
+  }
+  return c != EOF;
+}
+
+bool FillAddress(const std::string &path, sockaddr_un &addr) {
+  if (path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "error: socket path too long: " << path << std::endl;
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+  return true;
+}
+
+/* =======================
+ * 服务端
+ * ======================= */
+// SIGCHLD 和退出信号都往这个管道里写一个字节, 把主循环从 poll 里唤醒
+int wake_pipe[2];
+volatile sig_atomic_t stop_server = 0;
+
+void OnSignal(int sig) {
+  int saved = errno;
+  if (sig != SIGCHLD) {
+    stop_server = 1;
+  }
+  (void)!write(wake_pipe[1], "", 1);
+  errno = saved;
+}
+
+// 在子进程里处理一个请求, 不返回
+[[noreturn]] void ServeRequest(int fd, CompileFunc compile) {
+  FILE *in = fdopen(fd, "r");
+  std::string cwd, arg;
+  std::vector<std::string> args;
+  bool ok = ReadString(in, cwd);
+  while (ok && (ok = ReadString(in, arg)) && !arg.empty()) {
+    args.push_back(arg);
+  }
+  dup2(fd, STDERR_FILENO);
+  if (!ok || args.size() < 4) {
+    std::cerr << "error: malformed request" << std::endl;
+    exit(2);
+  }
+  if (chdir(cwd.c_str()) < 0) {
+    std::cerr << "error: cannot chdir to " << cwd << ": " << strerror(errno) << std::endl;
+    exit(2);
+  }
+  int null_fd = open("/dev/null", O_RDONLY);
+  dup2(null_fd, STDIN_FILENO);
+  close(null_fd);
+
+  std::vector<const char *> argv = {"compiler"};
+  for (const auto &a : args) {
+    argv.push_back(a.c_str());
+  }
+  argv.push_back(nullptr);
+  exit(compile(argv.size() - 1, argv.data(), args[1] == "-" ? in : nullptr));
+}
+
+}  // namespace
+
+int RunServer(const std::string &socket_path, int jobs, CompileFunc compile) {
+  sockaddr_un addr;
+  if (!FillAddress(socket_path, addr)) {
+    return 1;
+  }
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path.c_str());
+  if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      listen(listen_fd, 64) < 0) {
+    std::cerr << "error: cannot listen on " << socket_path << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+  if (pipe(wake_pipe) < 0) {
+    std::cerr << "error: pipe: " << strerror(errno) << std::endl;
+    return 1;
+  }
+  for (int fd : wake_pipe) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = OnSignal;
+  sigaction(SIGCHLD, &sa, nullptr);
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+  std::cerr << "server: listening on " << socket_path << " with " << jobs << " jobs" << std::endl;
+
+  // 正在编译的子进程 -> 它的客户端连接
+  std::map<pid_t, int> running;
+  while (true) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      auto it = running.find(pid);
+      if (it == running.end()) {
+        continue;
+      }
+      char code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+      WriteAll(it->second, &code, 1);
+      close(it->second);
+      running.erase(it);
+    }
+    if (stop_server && running.empty()) {
+      break;
+    }
+
+    // 子进程满了或者要退出时只等 SIGCHLD, 不再接受新连接
+    pollfd fds[2] = {{wake_pipe[0], POLLIN, 0}, {listen_fd, POLLIN, 0}};
+    int nfds = stop_server || static_cast<int>(running.size()) >= jobs ? 1 : 2;
+    if (poll(fds, nfds, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "error: poll: " << strerror(errno) << std::endl;
+      break;
+    }
+    char buf[64];
+    while (read(wake_pipe[0], buf, sizeof(buf)) > 0) {
+    }
+    if (nfds < 2 || !(fds[1].revents & POLLIN)) {
+      continue;
+    }
+    int client = accept(listen_fd, nullptr, nullptr);
+    if (client < 0) {
+      continue;
+    }
+    pid = fork();
+    if (pid == 0) {
+      // 别的请求的连接不能留在这个子进程里, 否则它们要等这个子进程结束才收到 EOF
+      for (const auto &other : running) {
+        close(other.second);
+      }
+      close(listen_fd);
+      close(wake_pipe[0]);
+      close(wake_pipe[1]);
+      signal(SIGCHLD, SIG_DFL);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGPIPE, SIG_DFL);
+      ServeRequest(client, compile);
+    }
+    if (pid < 0) {
+      std::cerr << "error: fork: " << strerror(errno) << std::endl;
+      close(client);
+      continue;
+    }
+    running[pid] = client;
+  }
+  close(listen_fd);
+  unlink(socket_path.c_str());
+  return 0;
+}
+
+/* =======================
+ * 客户端
+ * ======================= */
+int RunClient(const std::string &socket_path, int argc, const char *argv[],
+              CompileFunc compile) {
+  if (argc < 4) {
+    std::cerr << "usage: compiler -client SOCKET mode input -o output [options...]" << std::endl;
+    return 2;
+  }
+  bool from_stdin = std::string(argv[1]) == "-";
+  // -run 编出的程序要读本进程的 stdin, 服务端拿不到, 所以也在本进程里做
+  bool local_only = std::string(argv[0]) == "-run";
+  sockaddr_un addr;
+  int fd = local_only ? -1 : socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || !FillAddress(socket_path, addr) ||
+      connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+    // 服务没开时退回到本进程编译, 脚本里可以无条件使用 -client
+    if (fd >= 0) {
+      close(fd);
+    }
+    std::vector<const char *> local = {"compiler"};
+    local.insert(local.end(), argv, argv + argc);
+    local.push_back(nullptr);
+    return compile(argc + 1, local.data(), from_stdin ? stdin : nullptr);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) {
+    std::cerr << "error: getcwd: " << strerror(errno) << std::endl;
+    return 1;
+  }
+  std::string request(cwd, strlen(cwd) + 1);
+  for (int i = 0; i < argc; ++i) {
+    request.append(argv[i], strlen(argv[i]) + 1);
+  }
+  request += '\0';
+  bool ok = WriteAll(fd, request.data(), request.size());
+  char buf[4096];
+  ssize_t n;
+  while (ok && from_stdin && (n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+    ok = WriteAll(fd, buf, n);
+  }
+  shutdown(fd, SHUT_WR);
+
+  // 最后一个字节是退出码, 其余的是诊断信息
+  std::string response;
+  while ((n = read(fd, buf, sizeof(buf))) != 0) {
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      break;
+    }
+    response.append(buf, n);
+  }
+  close(fd);
+  if (response.empty()) {
+    std::cerr << "error: server closed the connection" << std::endl;
+    return 1;
+  }
+  WriteAll(STDERR_FILENO, response.data(), response.size() - 1);
+  return static_cast<unsigned char>(response.back());
+}
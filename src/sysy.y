@@ -4,6 +4,12 @@
   #include <utility>
   #include <vector>
   #include "include/ast.hpp"
+
+  // 标识符 token 的值: 输入缓冲里这段文字的起点和长度, 建 AST 结点时才复制成 std::string
+  struct TokenText {
+    const char *text;
+    int size;
+  };
 }
 
 %{
@@ -28,6 +34,9 @@ using namespace std;
 // 解析完成后, 我们要手动修改这个参数, 把它设置成解析得到的字符串
 %parse-param { std::unique_ptr<BaseAST> &ast }
 
+// 记录 token 所在的行, 建 AST 结点时用 @$ 取产生式开头的行号
+%locations
+
 // yylval 的定义, 我们把它定义成了一个联合体 (union)
 // 因为 token 的值有的是字符串指针, 有的是整数
 // 之前我们在 lexer 中用到的 str_val 和 int_val 就是在这里被定义的
@@ -35,6 +44,7 @@ using namespace std;
 // 请自行 STFW 在 union 里写一个带析构函数的类会出现什么情况
 %union {
   std::string *str_val;
+  TokenText token_text;
   int int_val;
   BaseAST *ast_val;
   ExprAST *expr_val;
@@ -51,9 +61,9 @@ using namespace std;
 }
 
 // lexer 返回的所有 token 种类的声明
-// 注意 IDENT 和 INT_CONST 会返回 token 的值, 分别对应 str_val 和 int_val
+// 注意 IDENT 和 INT_CONST 会返回 token 的值, 分别对应 token_text 和 int_val
 %token INT VOID RETURN CONST IF ELSE WHILE BREAK CONTINUE
-%token <str_val> IDENT
+%token <token_text> IDENT
 %token <int_val> INT_CONST
 %token AND OR EQ NE LE GE
 
@@ -134,10 +144,11 @@ CompUnitItem
 FuncDef
   : INT IDENT '(' FuncFParamsOpt ')' Block {
     auto node = new FuncDefAST();
+    node->line = @$.first_line;
     auto type = new FuncTypeAST();
     type->type = "int";
     node->func_type = unique_ptr<BaseAST>(type);
-    node->ident = *unique_ptr<string>($2);
+    node->ident = string($2.text, $2.size);
     node->params = std::move(*$4);
     delete $4;
     node->block = unique_ptr<BaseAST>($6);
@@ -145,10 +156,11 @@ FuncDef
   }
   | VOID IDENT '(' FuncFParamsOpt ')' Block {
     auto node = new FuncDefAST();
+    node->line = @$.first_line;
     auto type = new FuncTypeAST();
     type->type = "void";
     node->func_type = unique_ptr<BaseAST>(type);
-    node->ident = *unique_ptr<string>($2);
+    node->ident = string($2.text, $2.size);
     node->params = std::move(*$4);
     delete $4;
     node->block = unique_ptr<BaseAST>($6);
@@ -182,12 +194,12 @@ FuncFParams
 FuncFParam
   : INT IDENT {
     auto param = new FuncDefAST::Param();
-    param->ident = *unique_ptr<string>($2);
+    param->ident = string($2.text, $2.size);
     $$ = param;
   }
   | INT IDENT '[' ']' ArrayDimListOpt {
     auto param = new FuncDefAST::Param();
-    param->ident = *unique_ptr<string>($2);
+    param->ident = string($2.text, $2.size);
     param->is_array = true;
     for (auto *dim : *$5) {
       param->dims.emplace_back(dim);
@@ -221,6 +233,7 @@ ArrayDimList
 Block
   : '{' BlockItemListOpt '}' {
     auto node = new BlockAST();
+    node->line = @$.first_line;
     for (auto *item : *$2) {
       node->items.emplace_back(item);
     }
@@ -263,6 +276,7 @@ Decl
 ConstDecl
   : CONST INT ConstDefList ';' {
     auto node = new ConstDeclAST();
+    node->line = @$.first_line;
     node->defs = std::move(*$3);
     delete $3;
     $$ = node;
@@ -286,7 +300,7 @@ ConstDefList
 ConstDef
   : IDENT ArrayDimListOpt '=' InitVal {
     auto def = new ConstDef();
-    def->ident = *unique_ptr<string>($1);
+    def->ident = string($1.text, $1.size);
     for (auto *dim : *$2) {
       def->dims.emplace_back(dim);
     }
@@ -303,6 +317,7 @@ ConstExp
 VarDecl
   : INT VarDefList ';' {
     auto node = new VarDeclAST();
+    node->line = @$.first_line;
     node->defs = std::move(*$2);
     delete $2;
     $$ = node;
@@ -326,7 +341,7 @@ VarDefList
 VarDef
   : IDENT ArrayDimListOpt {
     auto def = new VarDef();
-    def->ident = *unique_ptr<string>($1);
+    def->ident = string($1.text, $1.size);
     for (auto *dim : *$2) {
       def->dims.emplace_back(dim);
     }
@@ -336,7 +351,7 @@ VarDef
   }
   | IDENT ArrayDimListOpt '=' InitVal {
     auto def = new VarDef();
-    def->ident = *unique_ptr<string>($1);
+    def->ident = string($1.text, $1.size);
     for (auto *dim : *$2) {
       def->dims.emplace_back(dim);
     }
@@ -389,18 +404,21 @@ InitValList
 Stmt
   : LVal '=' Exp ';' {
     auto node = new AssignStmtAST();
+    node->line = @$.first_line;
     node->lval = unique_ptr<ExprAST>($1);
     node->value = unique_ptr<ExprAST>($3);
     $$ = node;
   }
   | IF '(' Exp ')' Stmt %prec LOWER_THAN_ELSE {
     auto node = new IfStmtAST();
+    node->line = @$.first_line;
     node->cond = unique_ptr<ExprAST>($3);
     node->then_stmt = unique_ptr<BaseAST>($5);
     $$ = node;
   }
   | IF '(' Exp ')' Stmt ELSE Stmt {
     auto node = new IfStmtAST();
+    node->line = @$.first_line;
     node->cond = unique_ptr<ExprAST>($3);
     node->then_stmt = unique_ptr<BaseAST>($5);
     node->else_stmt = unique_ptr<BaseAST>($7);
@@ -408,32 +426,42 @@ Stmt
   }
   | WHILE '(' Exp ')' Stmt {
     auto node = new WhileStmtAST();
+    node->line = @$.first_line;
     node->cond = unique_ptr<ExprAST>($3);
     node->body = unique_ptr<BaseAST>($5);
     $$ = node;
   }
   | BREAK ';' {
-    $$ = new BreakStmtAST();
+    auto node = new BreakStmtAST();
+    node->line = @$.first_line;
+    $$ = node;
   }
   | CONTINUE ';' {
-    $$ = new ContinueStmtAST();
+    auto node = new ContinueStmtAST();
+    node->line = @$.first_line;
+    $$ = node;
   }
   | Exp ';' {
     auto node = new ExprStmtAST();
+    node->line = @$.first_line;
     node->expr = unique_ptr<ExprAST>($1);
     $$ = node;
   }
   | ';' {
-    $$ = new EmptyStmtAST();
+    auto node = new EmptyStmtAST();
+    node->line = @$.first_line;
+    $$ = node;
   }
   | Block { $$ = $1; }
   | RETURN Exp ';' {
     auto node = new ReturnStmtAST();
+    node->line = @$.first_line;
     node->value = unique_ptr<ExprAST>($2);
     $$ = node;
   }
   | RETURN ';' {
     auto node = new ReturnStmtAST();
+    node->line = @$.first_line;
     $$ = node;
   }
   ;
@@ -445,6 +473,7 @@ Exp
 LOrExp
   : LOrExp OR LAndExp {
     auto node = new BinaryExpAST();
+    node->line = @$.first_line;
     node->op = "||";
     node->lhs = unique_ptr<ExprAST>($1);
     node->rhs = unique_ptr<ExprAST>($3);
@@ -456,6 +485,7 @@ LOrExp
 LAndExp
   : LAndExp AND EqExp {
     auto node = new BinaryExpAST();
+    node->line = @$.first_line;
     node->op = "&&";
     node->lhs = unique_ptr<ExprAST>($1);
     node->rhs = unique_ptr<ExprAST>($3);
@@ -467,6 +497,7 @@ LAndExp
 EqExp
   : EqExp EQ RelExp {
     auto node = new BinaryExpAST();
+    node->line = @$.first_line;
     node->op = "==";
     node->lhs = unique_ptr<ExprAST>($1);
     node->rhs = unique_ptr<ExprAST>($3);
@@ -474,6 +505,7 @@ EqExp
   }
   | EqExp NE RelExp {
     auto node = new BinaryExpAST();
+    node->line = @$.first_line;
     node->op = "!=";
     node->lhs = unique_ptr<ExprAST>($1);
     node->rhs = unique_ptr<ExprAST>($3);
@@ -485,6 +517,7 @@ EqExp
 RelExp
   : RelExp '<' AddExp {
     auto node = new BinaryExpAST();
+    node->line = @$.first_line;
     node->op = "<";
     node->lhs = unique_ptr<ExprAST>($1);
     node->rhs = unique_ptr<ExprAST>($3);
@@ -492,6 +525,7 @@ RelExp
   }
   | RelExp '>' AddExp {
     auto node = new BinaryExpAST();
+    node->line = @$.first_line;
     node->op = ">";
     node->lhs = unique_ptr<ExprAST>($1);
     node->rhs = unique_ptr<ExprAST>($3);
@@ -499,6 +533,7 @@ RelExp
   }
   | RelExp LE AddExp {
     auto node = new BinaryExpAST();
+    node->line = @$.first_line;
     node->op = "<=";
     node->lhs = unique_ptr<ExprAST>($1);
     node->rhs = unique_ptr<ExprAST>($3);
@@ -506,6 +541,7 @@ RelExp
   }
   | RelExp GE AddExp {
     auto node = new BinaryExpAST();
+    node->line = @$.first_line;
     node->op = ">=";
     node->lhs = unique_ptr<ExprAST>($1);
     node->rhs = unique_ptr<ExprAST>($3);
@@ -517,6 +553,7 @@ RelExp
 AddExp
   : AddExp '+' MulExp {
     auto node = new BinaryExpAST();
+    node->line = @$.first_line;
     node->op = "+";
     node->lhs = unique_ptr<ExprAST>($1);
     node->rhs = unique_ptr<ExprAST>($3);
@@ -524,6 +561,7 @@ AddExp
   }
   | AddExp '-' MulExp {
     auto node = new BinaryExpAST();
+    node->line = @$.first_line;
     node->op = "-";
     node->lhs = unique_ptr<ExprAST>($1);
     node->rhs = unique_ptr<ExprAST>($3);
@@ -535,6 +573,7 @@ AddExp
 MulExp
   : MulExp '*' UnaryExp {
     auto node = new BinaryExpAST();
+    node->line = @$.first_line;
     node->op = "*";
     node->lhs = unique_ptr<ExprAST>($1);
     node->rhs = unique_ptr<ExprAST>($3);
@@ -542,6 +581,7 @@ MulExp
   }
   | MulExp '/' UnaryExp {
     auto node = new BinaryExpAST();
+    node->line = @$.first_line;
     node->op = "/";
     node->lhs = unique_ptr<ExprAST>($1);
     node->rhs = unique_ptr<ExprAST>($3);
@@ -549,6 +589,7 @@ MulExp
   }
   | MulExp '%' UnaryExp {
     auto node = new BinaryExpAST();
+    node->line = @$.first_line;
     node->op = "%";
     node->lhs = unique_ptr<ExprAST>($1);
     node->rhs = unique_ptr<ExprAST>($3);
@@ -561,13 +602,15 @@ UnaryExp
   : PrimaryExp { $$ = $1; }
   | UnaryOp UnaryExp {
     auto node = new UnaryExpAST();
+    node->line = @$.first_line;
     node->op = *unique_ptr<string>($1);
     node->rhs = unique_ptr<ExprAST>($2);
     $$ = node;
   }
   | IDENT '(' FuncRParamsOpt ')' {
     auto node = new CallExpAST();
-    node->ident = *unique_ptr<string>($1);
+    node->line = @$.first_line;
+    node->ident = string($1.text, $1.size);
     for (auto *arg : *$3) {
       node->args.emplace_back(arg);
     }
@@ -591,7 +634,8 @@ PrimaryExp
 LVal
   : IDENT ArrayIndexListOpt {
     auto node = new LValAST();
-    node->ident = *unique_ptr<string>($1);
+    node->line = @$.first_line;
+    node->ident = string($1.text, $1.size);
     for (auto *idx : *$2) {
       node->indices.emplace_back(idx);
     }
@@ -624,6 +668,7 @@ ArrayIndexList
 Number
   : INT_CONST {
     auto node = new NumberAST();
+    node->line = @$.first_line;
     node->value = $1;
     $$ = node;
   }
@@ -655,5 +700,5 @@ FuncRParams
 // 定义错误处理函数, 其中第二个参数是错误信息
 // parser 如果发生错误 (例如输入的程序出现了语法错误), 就会调用这个函数
 void yyerror(unique_ptr<BaseAST> &ast, const char *s) {
-  cerr << "error: " << s << endl;
+  cerr << "error: line " << yylloc.first_line << ": " << s << endl;
 }